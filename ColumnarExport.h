@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// ---------------- выгрузка колонками в раскладке Apache Arrow ----------------
+//
+// Батч - три колонки одинаковой длины, буферы устроены как в Arrow columnar format:
+//   key        - binary:  смещения int32 (length + 1, первое 0) + данные подряд, без null;
+//   value      - binary:  так же;
+//   death_time - uint64:  абсолютное время смерти в единицах часов хранилища, null - без ttl;
+//                битовая карта валидности - бит i (младший первым) = 1, если значение есть.
+// Буферы можно отдать arrow::Buffer::Wrap / ArrowArray как есть, без перекладывания по строкам.
+// Выравнивание - как у std::vector (Arrow его рекомендует, но не требует).
+
+struct ColumnarBatch {
+    int64_t length = 0;
+    std::vector<int32_t> key_offsets{0};
+    std::string key_data;
+    std::vector<int32_t> value_offsets{0};
+    std::string value_data;
+    std::vector<uint64_t> death_time;
+    std::vector<uint8_t> death_time_validity;
+    int64_t death_time_null_count = 0;
+
+    // заранее под rows строк (данные ключей и значений растут сами)
+    void reserve(size_t rows) {
+        key_offsets.reserve(rows + 1);
+        value_offsets.reserve(rows + 1);
+        death_time.reserve(rows);
+        death_time_validity.reserve((rows + 7) / 8);
+    }
+
+    // больше стольки байт ключей (и отдельно значений) в батче не адресовать int32-смещениями
+    static constexpr size_t max_bytes = std::numeric_limits<int32_t>::max();
+
+    // влезет ли еще запись, не переполнив int32-смещения
+    bool fits(size_t key_size, size_t value_size) const {
+        return key_size <= max_bytes - key_data.size() && value_size <= max_bytes - value_data.size();
+    }
+
+    // Запись, которая не влезает (см. fits), не добавляется: std::length_error вместо тихо
+    // завернувшихся смещений. Экспорт начинает новый батч раньше, так что там это только ключ
+    // или значение больше 2 ГиБ само по себе.
+    // ------ сложность: длина ключа и значения (амортизированно)
+    void append(std::string_view key, std::string_view value, std::optional<uint64_t> death) {
+        if (!fits(key.size(), value.size()))
+            throw std::length_error("ColumnarBatch: key or value bytes overflow int32 offsets");
+        key_data.append(key);
+        key_offsets.push_back(static_cast<int32_t>(key_data.size()));
+        value_data.append(value);
+        value_offsets.push_back(static_cast<int32_t>(value_data.size()));
+        if (length % 8 == 0)
+            death_time_validity.push_back(0);
+        if (death)
+            death_time_validity.back() |= static_cast<uint8_t>(1u << (length % 8));
+        else
+            ++death_time_null_count;
+        death_time.push_back(death.value_or(0));
+        ++length;
+    }
+
+    std::string_view key(size_t i) const {
+        return std::string_view(key_data).substr(key_offsets[i], key_offsets[i + 1] - key_offsets[i]);
+    }
+
+    std::string_view value(size_t i) const {
+        return std::string_view(value_data).substr(value_offsets[i], value_offsets[i + 1] - value_offsets[i]);
+    }
+
+    std::optional<uint64_t> deathTime(size_t i) const {
+        if (!(death_time_validity[i / 8] >> (i % 8) & 1))
+            return std::nullopt;
+        return death_time[i];
+    }
+};
+
+struct ColumnarOptions {
+    // строк в батче (последний батч части может быть короче)
+    size_t batch_rows = 1 << 16;
+    // сколько диапазонов ключей выгружается параллельно
+    unsigned threads = std::thread::hardware_concurrency();
+};
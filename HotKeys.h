@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ---------------- потоковые скетчи для поиска горячих ключей ----------------
+
+// 64-битный хэш строки, от него через double hashing получаем нужное кол-во независимых хэшей
+inline uint64_t sketchHash(std::string_view key) {
+    uint64_t h = std::hash<std::string_view>{}(key);
+    // перемешиваем (splitmix64), std::hash бывает слабым в младших битах
+    h += 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Count-Min Sketch с консервативным обновлением: оценка частоты никогда не меньше настоящей.
+// width округляется до степени двойки
+class CountMinSketch {
+public:
+    explicit CountMinSketch(size_t width = 1 << 16, size_t depth = 4) : depth_(depth == 0 ? 1 : depth) {
+        width_ = 1;
+        while (width_ < width)
+            width_ <<= 1;
+        counters_.assign(width_ * depth_, 0);
+    }
+
+    // ------ сложность: depth
+    uint32_t add(std::string_view key, uint32_t weight = 1) {
+        uint64_t h = sketchHash(key);
+        uint32_t current = estimateHashed(h);
+        uint32_t target = current > std::numeric_limits<uint32_t>::max() - weight
+                              ? std::numeric_limits<uint32_t>::max()
+                              : current + weight;
+        // поднимаем только те счетчики, что ниже новой оценки
+        for (size_t row = 0; row < depth_; ++row) {
+            auto &cell = counters_[slot(h, row)];
+            cell = std::max(cell, target);
+        }
+        return target;
+    }
+
+    // ------ сложность: depth
+    uint32_t estimate(std::string_view key) const {
+        return estimateHashed(sketchHash(key));
+    }
+
+    // старение: делим все счетчики пополам, чтобы старая популярность выветривалась
+    // ------ сложность: width * depth
+    void halve() {
+        for (auto &cell: counters_)
+            cell >>= 1;
+    }
+
+    void clear() {
+        std::fill(counters_.begin(), counters_.end(), 0);
+    }
+
+private:
+    size_t slot(uint64_t h, size_t row) const {
+        uint64_t h1 = h & 0xffffffffULL, h2 = h >> 32;
+        return row * width_ + ((h1 + row * h2) & (width_ - 1));
+    }
+
+    uint32_t estimateHashed(uint64_t h) const {
+        uint32_t result = std::numeric_limits<uint32_t>::max();
+        for (size_t row = 0; row < depth_; ++row)
+            result = std::min(result, counters_[slot(h, row)]);
+        return result;
+    }
+
+    size_t width_;
+    size_t depth_;
+    std::vector<uint32_t> counters_;
+};
+
+struct HotKeyStat {
+    std::string key;
+    uint64_t hits;   // оценка кол-ва обращений (с учетом сэмплирования)
+    uint64_t error;  // насколько hits может быть завышено
+    uint64_t bytes;  // оценка прокачанных байт (ключ + значение)
+};
+
+// Space-Saving: держим не больше capacity счетчиков, новый элемент вытесняет самый редкий
+// и наследует его счетчик как погрешность. Любой элемент с частотой > N/capacity гарантированно в топе
+class SpaceSavingTopK {
+public:
+    explicit SpaceSavingTopK(size_t capacity) : capacity_(capacity == 0 ? 1 : capacity) {
+    }
+
+    // ------ сложность: log(capacity)
+    void add(std::string_view item, uint64_t weight, uint64_t bytes) {
+        if (auto it = counters_.find(std::string(item)); it != counters_.end()) {
+            by_count_.erase({it->second.hits, &it->first});
+            it->second.hits += weight;
+            it->second.bytes += bytes;
+            by_count_.emplace(it->second.hits, &it->first);
+            return;
+        }
+
+        Counter counter{weight, 0, bytes};
+        if (counters_.size() >= capacity_) {
+            auto victim = by_count_.begin();
+            counter.error = victim->first;
+            counter.hits += victim->first;
+            counters_.erase(*victim->second);
+            by_count_.erase(victim);
+        }
+        auto [it, _] = counters_.emplace(std::string(item), counter);
+        by_count_.emplace(counter.hits, &it->first);
+    }
+
+    // n самых частых по убыванию
+    // ------ сложность: n
+    std::vector<HotKeyStat> top(size_t n) const {
+        std::vector<HotKeyStat> result;
+        for (auto it = by_count_.rbegin(); it != by_count_.rend() && result.size() < n; ++it) {
+            const auto &counter = counters_.at(*it->second);
+            result.push_back(HotKeyStat{*it->second, counter.hits, counter.error, counter.bytes});
+        }
+        return result;
+    }
+
+    void clear() {
+        by_count_.clear();
+        counters_.clear();
+    }
+
+private:
+    struct Counter {
+        uint64_t hits;
+        uint64_t error;
+        uint64_t bytes;
+    };
+
+    size_t capacity_;
+    std::unordered_map<std::string, Counter> counters_;
+    // ключи мапы стабильны в памяти, поэтому в сете держим указатели на них
+    std::set<std::pair<uint64_t, const std::string *> > by_count_;
+};
+
+struct HotKeyOptions {
+    // учитываем в среднем каждую sample_every-ю операцию, вес такой операции = sample_every
+    uint32_t sample_every = 16;
+    // сколько ключей и префиксов держит Space-Saving
+    size_t top_capacity = 256;
+    // префиксы режутся по этому разделителю: "user:1:cart" -> "user:", "user:1:"
+    char prefix_delimiter = ':';
+    size_t max_prefix_depth = 2;
+    // ширина Count-Min Sketch для точечных оценок
+    size_t sketch_width = 1 << 16;
+};
+
+// трекер горячих ключей и префиксов на сэмплированных get/set
+class HotKeyTracker {
+public:
+    explicit HotKeyTracker(HotKeyOptions options)
+        : options_(options), keys_(options.top_capacity), prefixes_(options.top_capacity),
+          sketch_(options.sketch_width) {
+        if (options_.sample_every == 0)
+            options_.sample_every = 1;
+    }
+
+    // на несэмплированной операции стоит один xorshift
+    // ------ сложность: log(top_capacity) + длина ключа (для сэмплированных)
+    void record(std::string_view key, size_t value_size) {
+        if (options_.sample_every > 1 && nextRandom() % options_.sample_every != 0)
+            return;
+        uint64_t weight = options_.sample_every;
+        uint64_t bytes = weight * (key.size() + value_size);
+
+        keys_.add(key, weight, bytes);
+        sketch_.add(key, static_cast<uint32_t>(weight));
+
+        size_t depth = 0;
+        for (size_t pos = key.find(options_.prefix_delimiter);
+             pos != std::string_view::npos && depth < options_.max_prefix_depth;
+             pos = key.find(options_.prefix_delimiter, pos + 1), ++depth) {
+            prefixes_.add(key.substr(0, pos + 1), weight, bytes);
+        }
+    }
+
+    std::vector<HotKeyStat> topKeys(size_t n) const { return keys_.top(n); }
+    std::vector<HotKeyStat> topPrefixes(size_t n) const { return prefixes_.top(n); }
+
+    // оценка частоты произвольного ключа, даже если он выпал из топа
+    uint64_t estimate(std::string_view key) const { return sketch_.estimate(key); }
+
+    void clear() {
+        keys_.clear();
+        prefixes_.clear();
+        sketch_.clear();
+    }
+
+private:
+    uint64_t nextRandom() {
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 7;
+        rng_ ^= rng_ << 17;
+        return rng_;
+    }
+
+    HotKeyOptions options_;
+    SpaceSavingTopK keys_;
+    SpaceSavingTopK prefixes_;
+    CountMinSketch sketch_;
+    uint64_t rng_ = 0x2545f4914f6cdd1dULL;
+};
+
+// ---------------- TinyLFU фильтр допуска ----------------
+
+// обычный Bloom фильтр на k хэшей из одного 64-битного
+class BloomFilter {
+public:
+    explicit BloomFilter(size_t bits = 1 << 16, size_t hashes = 3) : hashes_(hashes == 0 ? 1 : hashes) {
+        size_t words = (bits + 63) / 64;
+        bits_.assign(words == 0 ? 1 : words, 0);
+    }
+
+    // возвращает true если элемент (возможно) уже был
+    // ------ сложность: hashes
+    bool add(std::string_view key) {
+        uint64_t h = sketchHash(key);
+        bool present = true;
+        for (size_t i = 0; i < hashes_; ++i) {
+            size_t bit = position(h, i);
+            uint64_t mask = 1ULL << (bit & 63);
+            present = present && (bits_[bit >> 6] & mask);
+            bits_[bit >> 6] |= mask;
+        }
+        return present;
+    }
+
+    bool contains(std::string_view key) const {
+        uint64_t h = sketchHash(key);
+        for (size_t i = 0; i < hashes_; ++i) {
+            size_t bit = position(h, i);
+            if (!(bits_[bit >> 6] & (1ULL << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    void clear() {
+        std::fill(bits_.begin(), bits_.end(), 0);
+    }
+
+    size_t bytes() const {
+        return bits_.size() * sizeof(uint64_t);
+    }
+
+private:
+    size_t position(uint64_t h, size_t i) const {
+        uint64_t h1 = h & 0xffffffffULL, h2 = (h >> 32) | 1;
+        return static_cast<size_t>((h1 + i * h2) % (bits_.size() * 64));
+    }
+
+    size_t hashes_;
+    std::vector<uint64_t> bits_;
+};
+
+// Count-Min Sketch на 4-битных счетчиках (по 16 в слове) - для TinyLFU больше 15 и не нужно:
+// важно только кто популярнее, а старение все равно делит пополам. 4 строки по width счетчиков,
+// то есть 2 байта на столбец против 16 у CountMinSketch
+class FrequencySketch {
+public:
+    static constexpr size_t depth = 4;
+    static constexpr uint32_t max_count = 15;
+
+    explicit FrequencySketch(size_t width) {
+        width_ = 16;
+        while (width_ < width)
+            width_ <<= 1;
+        words_.assign(width_ * depth / 16, 0);
+    }
+
+    // conservative update: поднимаем только счетчики, равные минимуму
+    // ------ сложность: depth
+    void add(std::string_view key) {
+        uint64_t h = sketchHash(key);
+        uint32_t current = estimateHashed(h);
+        if (current == max_count)
+            return;
+        for (size_t row = 0; row < depth; ++row) {
+            size_t i = slot(h, row);
+            if (counter(i) == current)
+                words_[i >> 4] += 1ULL << ((i & 15) * 4);
+        }
+    }
+
+    // ------ сложность: depth
+    uint32_t estimate(std::string_view key) const {
+        return estimateHashed(sketchHash(key));
+    }
+
+    // каждый полубайт сдвигаем вправо, выпавший в соседний бит отрезаем маской
+    // ------ сложность: width * depth / 16
+    void halve() {
+        for (auto &word: words_)
+            word = (word >> 1) & 0x7777777777777777ULL;
+    }
+
+    void clear() {
+        std::fill(words_.begin(), words_.end(), 0);
+    }
+
+    size_t bytes() const {
+        return words_.size() * sizeof(uint64_t);
+    }
+
+private:
+    size_t slot(uint64_t h, size_t row) const {
+        uint64_t h1 = h & 0xffffffffULL, h2 = (h >> 32) | 1;
+        return row * width_ + ((h1 + row * h2) & (width_ - 1));
+    }
+
+    uint32_t counter(size_t i) const {
+        return static_cast<uint32_t>(words_[i >> 4] >> ((i & 15) * 4)) & 0xf;
+    }
+
+    uint32_t estimateHashed(uint64_t h) const {
+        uint32_t result = max_count;
+        for (size_t row = 0; row < depth; ++row)
+            result = std::min(result, counter(slot(h, row)));
+        return result;
+    }
+
+    size_t width_;
+    std::vector<uint64_t> words_;
+};
+
+// TinyLFU: частоты в FrequencySketch, первое обращение к ключу оседает только в doorkeeper
+// (так одноразовые ключи из сканов не засоряют скетч). Каждые sample_size обращений
+// все делится пополам - старая популярность выветривается.
+// На ожидаемую запись: 2-4 байта скетча (ширина до степени двойки) + 1 байт doorkeeper
+class TinyLfuFilter {
+public:
+    static constexpr size_t min_entries = 64;
+
+    explicit TinyLfuFilter(size_t expected_entries)
+        : expected_(std::max(expected_entries, min_entries)), sketch_(expected_), doorkeeper_(expected_ * 8),
+          sample_size_(10 * expected_) {
+    }
+
+    // обращение на чтение; промах запоминаем, чтобы следующий за ним set того же ключа
+    // (обычное заполнение кэша) не посчитался вторым обращением
+    // ------ сложность: const
+    void recordRead(std::string_view key, bool hit) {
+        last_miss_ = hit ? 0 : sketchHash(key);
+        record(key);
+    }
+
+    // ------ сложность: const
+    void recordWrite(std::string_view key) {
+        uint64_t h = sketchHash(key);
+        if (h == last_miss_) {
+            last_miss_ = 0;
+            return;
+        }
+        record(key);
+    }
+
+    uint32_t frequency(std::string_view key) const {
+        return sketch_.estimate(key) + (doorkeeper_.contains(key) ? 1 : 0);
+    }
+
+    // пускаем новичка только если он популярнее того, кого вытеснит
+    bool admit(std::string_view candidate, std::string_view victim) const {
+        return frequency(candidate) > frequency(victim);
+    }
+
+    // годится ли фильтр под expected_entries: размеры отличаются не больше чем вдвое
+    bool sizedFor(size_t expected_entries) const {
+        size_t expected = std::max(expected_entries, min_entries);
+        return expected <= 2 * expected_ && expected_ <= 2 * expected;
+    }
+
+    // память скетча и doorkeeper
+    size_t bytes() const {
+        return sketch_.bytes() + doorkeeper_.bytes();
+    }
+
+private:
+    void record(std::string_view key) {
+        if (doorkeeper_.add(key))
+            sketch_.add(key);
+        if (++additions_ >= sample_size_) {
+            sketch_.halve();
+            doorkeeper_.clear();
+            additions_ = 0;
+        }
+    }
+
+    size_t expected_;
+    FrequencySketch sketch_;
+    BloomFilter doorkeeper_;
+    size_t sample_size_;
+    size_t additions_ = 0;
+    uint64_t last_miss_ = 0;
+};
@@ -9,10 +9,270 @@
 #include <functional>
 #include <limits>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <thread>
+#include <stdexcept>
+#include <tuple>
+#include <charconv>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include "HotKeys.h"
+#include "Snapshot.h"
+#include "RangeDigest.h"
+#include "ValuePool.h"
+#include "KeyPattern.h"
+#include "ScanResult.h"
+#include "ColumnarExport.h"
+#include "LockProfiler.h"
+
+// ---------------- подписки на изменения ключей ----------------
+
+enum class WatchEvent { Set, Remove, Expire, Evict };
+
+enum class WatchMode { Prefix, Key };
+
+// одно изменение: для Set лежит новое значение, для Remove/Expire/Evict - удаленное
+struct WatchNotification {
+    WatchEvent event;
+    std::string key;
+    std::string value;
+};
+
+using WatchId = uint64_t;
+
+// строка скана без значения: getKeyInfoSorted
+struct ScanKeyInfo {
+    std::string key;
+    size_t value_size = 0;
+    std::optional<uint64_t> ttl_left;  // секунд до смерти, nullopt - бессмертная
+};
+
+// итог агрегирующего скана: aggregateRange
+struct ScanAggregate {
+    size_t count = 0;                   // подошедших записей
+    size_t numeric = 0;                 // из них значений, которые целиком читаются как число
+    double sum = 0;                     // сумма таких значений
+    std::optional<std::string> min_key;  // первый и последний подошедший ключ
+    std::optional<std::string> max_key;
+};
+
+// Сколько байт хранилище просит у аллокатора, по структурам. Это запрошенные размеры: округление
+// и служебные байты malloc сюда не входят, их видно только по самому аллокатору (см. bench footprint).
+struct MemoryBreakdown {
+    size_t entries = 0;
+    size_t expiring = 0;       // из них с ttl, у них есть узел в expiration_set_
+    size_t map_nodes = 0;      // узлы kv_map_: заголовок rb-узла + ключ + запись
+    size_t expiry_nodes = 0;   // узлы expiration_set_: заголовок + копия ключа + время смерти
+    size_t key_heap = 0;       // ключи длиннее SSO, и в map, и их копии в expiration_set_
+    size_t value_heap = 0;     // значения длиннее SSO, общие буферы пула - один раз
+    size_t indexes = 0;        // индекс сэмплирования, дайджесты, таблица пула значений, фильтр TinyLFU
+    // срез map_nodes + indexes, в total не входит: служебное на запись, которое платится всегда, даже если
+    // sample, лимит памяти и дайджесты не используются - sample_slot, last_access и digest_slot в узле
+    // map и итератор в индексе сэмплирования
+    size_t bookkeeping = 0;
+
+    size_t total() const { return map_nodes + expiry_nodes + key_heap + value_heap + indexes; }
+};
+
+// байты строки в куче: 0, если она целиком внутри объекта (SSO)
+inline size_t stringHeapBytes(const std::string &s) {
+    auto *object = reinterpret_cast<const char *>(&s);
+    bool inline_buffer = s.data() >= object && s.data() < object + sizeof(std::string);
+    return inline_buffer ? 0 : s.capacity() + 1;
+}
+
+// один диапазон для getManySortedMulti: первые count живых записей начиная с from
+struct ScanRange {
+    std::string_view from;
+    uint32_t count;
+};
+
+// ответ getManySortedMulti: записи всех диапазонов в одном буфере, у i-го диапазона - slices[i]
+struct MultiScanResult {
+    std::vector<std::pair<std::string, std::string> > entries;
+    std::vector<std::pair<size_t, size_t> > slices;  // (начало в entries, сколько)
+
+    std::span<const std::pair<std::string, std::string> > range(size_t i) const {
+        return std::span(entries).subspan(slices[i].first, slices[i].second);
+    }
+};
+
+// предикат скана по умолчанию - подходит все
+struct AnyEntry {
+    constexpr bool operator()(std::string_view, std::string_view) const noexcept { return true; }
+};
+
+// чья запись остается, если ключ есть в обоих хранилищах при mergeFrom
+enum class MergePolicy {
+    // всегда запись из вливаемого хранилища
+    OtherWins,
+    // та, что проживет дольше (бессмертная дольше всех), при равенстве - из вливаемого
+    LaterDeathTimeWins,
+    // решает MergeResolver
+    Custom
+};
+
+// (ключ, наше значение, наше время смерти, их значение, их время смерти) -> true если берем их запись.
+// время смерти абсолютное, у бессмертных - максимум uint64_t
+using MergeResolver = std::function<bool(std::string_view, std::string_view, uint64_t, std::string_view, uint64_t)>;
+
+struct MergeStats {
+    size_t inserted = 0;  // новых ключей
+    size_t replaced = 0;  // конфликтов, где взяли их запись
+    size_t kept = 0;      // конфликтов, где осталась наша
+    size_t rejected = 0;  // не влезло по лимиту памяти
+};
+
+// кого выкидывать при превышении лимита памяти (протухшие выкидываются в первую очередь всегда)
+enum class EvictionPolicy {
+    // приближенный LRU: из нескольких случайных записей выкидываем самую давно тронутую
+    SampledLru,
+    // то же самое, но новый ключ пускается только если по TinyLFU он популярнее вытесняемого
+    TinyLfu
+};
+using WatchCallback = std::function<void(std::span<const WatchNotification>)>;
+
+// префиксное дерево подписок. по ключу спускаемся по символам и собираем всех
+// подписчиков на префиксы по пути (и на точный ключ в конце пути).
+// если подписок нет вообще - запись в хранилище ничего не платит
+class WatchTrie {
+public:
+    WatchId add(std::string_view pattern, WatchMode mode, WatchCallback callback) {
+        Node *node = &root_;
+        for (char c: pattern) {
+            auto &child = node->children[c];
+            if (!child)
+                child = std::make_unique<Node>();
+            node = child.get();
+        }
+        WatchId id = ++last_id_;
+        (mode == WatchMode::Prefix ? node->prefix_subs : node->key_subs).push_back(id);
+        subscribers_.emplace(id, Subscriber{std::string(pattern), mode,
+                                            std::make_shared<WatchCallback>(std::move(callback)), {}});
+        return id;
+    }
+
+    // отписка, недоставленная пачка отдается подписчику напоследок
+    // ------ сложность: длина паттерна
+    bool remove(WatchId id) {
+        auto it = subscribers_.find(id);
+        if (it == subscribers_.end())
+            return false;
+        deliver(it->second);
+
+        Node *node = &root_;
+        for (char c: it->second.pattern)
+            node = node->children[c].get();
+        auto &ids = it->second.mode == WatchMode::Prefix ? node->prefix_subs : node->key_subs;
+        std::erase(ids, id);
+        // пустые ветки не чистим - они дешевые, а подписки обычно переиспользуют те же префиксы
+        subscribers_.erase(it);
+        return true;
+    }
+
+    bool empty() const { return subscribers_.empty(); }
+
+    // сколько уведомлений копить на подписчика прежде чем дернуть колбэк
+    void setBatchSize(size_t batch_size) { batch_size_ = batch_size == 0 ? 1 : batch_size; }
+
+    // раскидывает событие всем подходящим подписчикам
+    // ------ сложность: длина ключа + кол-во совпавших подписок
+    void notify(WatchEvent event, std::string_view key, std::string_view value) {
+        if (subscribers_.empty())
+            return;
+        const Node *node = &root_;
+        push(node->prefix_subs, event, key, value);
+        for (char c: key) {
+            auto it = node->children.find(c);
+            if (it == node->children.end())
+                return;
+            node = it->second.get();
+            push(node->prefix_subs, event, key, value);
+        }
+        push(node->key_subs, event, key, value);
+    }
+
+    // доставляет все накопленные пачки. колбэк может подписать или отписать кого угодно,
+    // поэтому идем по копии id и каждый раз ищем подписчика заново
+    void flush() {
+        std::vector<WatchId> ids;
+        ids.reserve(subscribers_.size());
+        for (auto &[id, sub]: subscribers_)
+            ids.push_back(id);
+        for (WatchId id: ids) {
+            if (auto it = subscribers_.find(id); it != subscribers_.end())
+                deliver(it->second);
+        }
+    }
+
+private:
+    struct Node {
+        std::map<char, std::unique_ptr<Node> > children;
+        std::vector<WatchId> prefix_subs;
+        std::vector<WatchId> key_subs;
+    };
+
+    struct Subscriber {
+        std::string pattern;
+        WatchMode mode;
+        // shared_ptr: колбэк, отписавший сам себя, доживает до конца своего вызова
+        std::shared_ptr<WatchCallback> callback;
+        std::vector<WatchNotification> pending;
+    };
+
+    // колбэк может подписать/отписать кого-то (и себя) прямо во время раздачи: ids при этом меняется,
+    // поэтому идем по копии, а отписанных к моменту своей очереди пропускаем
+    void push(const std::vector<WatchId> &node_ids, WatchEvent event, std::string_view key, std::string_view value) {
+        if (node_ids.empty())
+            return;
+        auto ids = node_ids;
+        for (WatchId id: ids) {
+            auto it = subscribers_.find(id);
+            if (it == subscribers_.end())
+                continue;
+            auto &sub = it->second;
+            sub.pending.push_back(WatchNotification{event, std::string(key), std::string(value)});
+            if (sub.pending.size() >= batch_size_)
+                deliver(sub);
+        }
+    }
+
+    // колбэк может дернуть хранилище и отписать сам себя, поэтому сначала забираем пачку и колбэк себе,
+    // а после вызова sub не трогаем - его может уже не быть
+    static void deliver(Subscriber &sub) {
+        if (sub.pending.empty())
+            return;
+        auto batch = std::move(sub.pending);
+        sub.pending.clear();
+        auto callback = sub.callback;
+        (*callback)(batch);
+    }
+
+    Node root_;
+    std::unordered_map<WatchId, Subscriber> subscribers_;
+    WatchId last_id_ = 0;
+    size_t batch_size_ = 1;
+};
+
+// Часы для хранилищ, которым ttl не нужен: KVStorage<NoExpiry> выкидывает время смерти из записей,
+// сам сет протухания (пустой тип) и весь код вокруг него, часы не зовутся. ttl в set игнорируется
+// (запись бессмертна), removeOneExpiredEntry всегда пуст.
+struct NoExpiry {
+    constexpr uint64_t operator()() const noexcept { return 0; }
+};
 
 template<typename Clock>
 class KVStorage {
 public:
+    // запись, вынутая через extract (определение ниже, рядом с устройством map)
+    class NodeHandle;
+
     // Инициализирует хранилище переданным множеством записей. Размер span может быть очень большим.
     // Также принимает абстракцию часов (Clock) для возможности управления временем в тестах.
     explicit KVStorage(std::span<std::tuple<std::string /*key*/, std::string /*value*/, uint32_t /*ttl*/> > entries,
@@ -22,25 +282,44 @@ public:
         }
     }
 
+    // Полная копия записей: map, сет протухания, лимит памяти и дерево дайджестов.
+    // Подписки, учет горячих ключей и частоты TinyLFU не копируются - это наблюдение за конкретным экземпляром.
+    // Дешевая копия на запись - у ShardedKVStorage::clone().
+    // ------ сложность: n
+    KVStorage(const KVStorage &other) : clock_(other.clock_) {
+        for (auto &entry: other.kv_map_)
+            addToSampleIndex(kv_map_.emplace_hint(kv_map_.end(), entry));
+        expiration_set_ = other.expiration_set_;
+        memory_used_ = other.memory_used_;
+        eviction_samples_ = other.eviction_samples_;
+        access_tick_ = other.access_tick_;
+        setMemoryLimit(other.memory_limit_, other.eviction_policy_);
+        if (other.digests_)
+            enableRangeDigests(other.digests_->tree.depth());
+        // буферы значений и так общие, таблица нужна чтобы новые set их находили
+        if (other.value_pool_)
+            value_pool_ = std::make_unique<ValuePool>(*other.value_pool_);
+    }
+
+    KVStorage &operator=(const KVStorage &) = delete;
+
+    // Глубокая копия, то же что конструктор копирования: все записи копируются сразу, копии на запись
+    // у KVStorage нет. Дешевый снимок для "что если" - ShardedKVStorage::clone().
+    // ------ сложность: n
+    KVStorage clone() const {
+        return KVStorage(*this);
+    }
+
     ~KVStorage() = default;
 
     // Присваивает по ключу key значение value.
     // Если ttl == 0, то время жизни записи - бесконечность, иначе запись должна перестать быть доступной через ttl секунд.
     // Безусловно обновляет ttl записи.
+    // С лимитом памяти (setMemoryLimit) может вытеснить другие записи, а новый ключ может быть
+    // не принят (не влезает или отсеян TinyLFU) - тогда вернет false и ничего не поменяет.
     // ------ сложность: logn
-    void set(const std::string &key, const std::string &value, uint32_t ttl) {
-        // при ОБНОВЛЕНИИ надо удалить старые данные из сета
-        if (mapContains(key)) {
-            tryToRemoveFromSet(key);
-        }
-
-        // при необходимости добавляем время
-        uint64_t dt = getDeathTime_(ttl);
-        if (ttl != 0) {
-            expiration_set_.emplace(key, dt);
-        }
-
-        kv_map_[key] = timedKVMember{value, dt};
+    bool set(const std::string &key, const std::string &value, uint32_t ttl) {
+        return setWithDeathTime_(key, value, getDeathTime_(ttl));
     }
 
     // Удаляет запись по ключу key.
@@ -51,8 +330,7 @@ public:
         // как я понял можно удалять и протухшие, так что просто проверка на ключ делается
         if (!mapContains(skey))
             return false;
-        tryToRemoveFromSet(skey);
-        kv_map_.erase(skey);
+        eraseEntry_(skey, WatchEvent::Remove);
 
         return true;
     }
@@ -61,32 +339,211 @@ public:
     // МОЖНО ПОЛУЧИТЬ ТОЛЬКО НЕ ПРОТУХШИЕ ЗАПИСИ (у которых death_time > now)
     // ------ сложность: logn
     std::optional<std::string> get(std::string_view key) {
-        if (!keyAvailable(key)) {
+        auto it = findAvailable(key);
+        bool available = it != kv_map_.end();
+        if (admission_)
+            admission_->recordRead(key, available);
+        if (!available) {
+            if (hot_keys_)
+                hot_keys_->record(key, 0);
             return std::nullopt;
         }
-        return std::make_optional(kv_map_[std::string(key)].value);
+        auto &member = it->second;
+        member.last_access = ++access_tick_;
+        if (hot_keys_)
+            hot_keys_->record(key, member.value.size());
+        return std::make_optional(member.value.str());
+    }
+
+    // То же что get, но только читает: обращение не отмечается ни для вытеснения, ни в TinyLFU,
+    // ни в учете горячих ключей. Можно звать из нескольких потоков вместе с другими const-методами.
+    // ------ сложность: logn
+    std::optional<std::string> peek(std::string_view key) const {
+        auto it = kv_map_.find(key);
+        if (it == kv_map_.end() || it->second.death_time <= now_())
+            return std::nullopt;
+        return std::make_optional(it->second.value.str());
     }
 
     // Возвращает следующие count записей начиная с key в порядке лексикографической сортировки ключей.
     // Пример: ("a", "val1"), ("b", "val2"), ("d", "val3"), ("e", "val4")
     // getManySorted("c", 2) -> ("d", "val3"), ("e", "val4")
-    // ------ сложность: n
+    // ------ сложность: logn + count (+ пропущенные протухшие)
     std::vector<std::pair<std::string, std::string> > getManySorted(std::string_view key, uint32_t count)  {
-        if (count == 0)
-            return {};
         std::vector<std::pair<std::string, std::string> > result{};
+        scanSorted_(key, count, [&](typename KVMap::const_iterator it) {
+            result.emplace_back(it->first, it->second.value.str());
+        });
+        return result;
+    }
 
-        auto now = static_cast<uint64_t>(clock_());
-        for (auto it = kv_map_.begin(); it != kv_map_.end() && count > 0; ++it) {
-            if (it->second.death_time <= now)
-                continue;
+    // То же в переиспользуемый плоский буфер: out очищается и заполняется заново, так что при повторных
+    // вызовах с одним out аллокаций нет, пока ответ влезает в уже выделенное.
+    // ------ сложность: logn + count (+ пропущенные протухшие)
+    void getManySorted(std::string_view key, uint32_t count, ScanResult &out) {
+        out.clear();
+        scanSorted_(key, count, [&](typename KVMap::const_iterator it) {
+            out.append(it->first, it->second.value.str());
+        });
+    }
+
+    // То же, но только ключи - значения не копируются и даже не читаются.
+    // ------ сложность: logn + count (+ пропущенные протухшие)
+    std::vector<std::string> getKeysSorted(std::string_view key, uint32_t count) {
+        std::vector<std::string> result;
+        scanSorted_(key, count, [&](typename KVMap::const_iterator it) { result.push_back(it->first); });
+        return result;
+    }
+
+    // Ключ, длина значения и сколько секунд осталось жить (nullopt - бессмертная).
+    // Длина лежит в самом узле, так что память значения не трогается.
+    // ------ сложность: logn + count (+ пропущенные протухшие)
+    std::vector<ScanKeyInfo> getKeyInfoSorted(std::string_view key, uint32_t count) {
+        std::vector<ScanKeyInfo> result;
+        auto now = now_();
+        scanSorted_(key, count, [&](typename KVMap::const_iterator it) {
+            uint64_t death_time = it->second.death_time;
+            result.push_back(ScanKeyInfo{it->first, it->second.value.size(),
+                                         death_time == maxTime_ ? std::nullopt : std::make_optional(death_time - now)});
+        });
+        return result;
+    }
+
+    // Ключ и кусок значения [offset, offset + length) (обрезается по длине значения) - читается только он.
+    // ------ сложность: logn + count * length (+ пропущенные протухшие)
+    std::vector<std::pair<std::string, std::string> > getSlicesSorted(std::string_view key, uint32_t count,
+                                                                      size_t offset, size_t length) {
+        std::vector<std::pair<std::string, std::string> > result;
+        scanSorted_(key, count, [&](typename KVMap::const_iterator it) {
+            std::string_view value = it->second.value.str();
+            result.emplace_back(it->first, offset < value.size() ? value.substr(offset, length) : std::string_view());
+        });
+        return result;
+    }
+
+    // То же, что getManySorted для каждого диапазона, но за один проход: диапазоны идут по возрастанию
+    // from, и следующий ищется шагами от конца предыдущего (seek_), а от корня - только если он далеко
+    // или пересекается с предыдущим. Ответы лежат подряд в одном буфере, slices - в порядке ranges.
+    // ------ сложность: sum(min(разрыв, logn) + count)
+    MultiScanResult getManySortedMulti(std::span<const ScanRange> ranges) {
+        MultiScanResult result;
+        result.slices.resize(ranges.size());
+        std::vector<size_t> order(ranges.size());
+        size_t total = 0;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            order[i] = i;
+            total += ranges[i].count;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return ranges[a].from < ranges[b].from; });
+        result.entries.reserve(std::min(total, kv_map_.size()));
+
+        auto now = now_();
+        auto it = kv_map_.begin();
+        for (size_t i: order) {
+            const ScanRange &range = ranges[i];
+            // все ключи левее it меньше from - можно идти от it, иначе диапазоны пересеклись
+            if (it == kv_map_.begin() || std::prev(it)->first < range.from)
+                it = seek_(it, range.from, multiScanSteps_);
+            else
+                it = kv_map_.lower_bound(range.from);
+            result.slices[i].first = result.entries.size();
+            for (uint32_t count = range.count; it != kv_map_.end() && count > 0; ++it) {
+                if (it->second.death_time <= now)
+                    continue;
+                result.entries.emplace_back(it->first, it->second.value.str());
+                --count;
+            }
+            result.slices[i].second = result.entries.size() - result.slices[i].first;
+        }
+        return result;
+    }
 
-            if (it->first >= std::string(key)) {
-                result.emplace_back(it->first, it->second.value);
+    // Как getManySorted, но отдает только записи, для которых pred(key, value) == true. Предикат смотрит
+    // на запись на месте (string_view в узел), копируются только подошедшие. Если предикат не читает
+    // значение, то и память значения не трогается.
+    // ------ сложность: logn + просмотренные записи
+    template<typename Pred>
+    std::vector<std::pair<std::string, std::string> > getManySortedIf(std::string_view key, uint32_t count,
+                                                                      Pred &&pred) {
+        std::vector<std::pair<std::string, std::string> > result;
+        if (count == 0)
+            return result;
+        forEachLive_(key, std::nullopt, [&](typename KVMap::const_iterator it) {
+            const std::string &value = it->second.value.str();
+            if (pred(std::string_view(it->first), std::string_view(value))) {
+                result.emplace_back(it->first, value);
                 --count;
             }
+            return count > 0;
+        });
+        return result;
+    }
+
+    // Сколько живых записей в [from, to) подходит под pred, без единой копии. to == nullopt - до конца.
+    // ------ сложность: logn + записи в диапазоне
+    template<typename Pred = AnyEntry>
+    size_t countRange(std::string_view from, std::optional<std::string_view> to, Pred pred = Pred()) {
+        size_t count = 0;
+        forEachLive_(from, to, [&](typename KVMap::const_iterator it) {
+            count += pred(std::string_view(it->first), std::string_view(it->second.value.str()));
+            return true;
+        });
+        return count;
+    }
+
+    // Кол-во, сумма числовых значений и крайние ключи подошедших записей из [from, to).
+    // Копируются только два крайних ключа в конце, числа разбираются прямо из значения.
+    // ------ сложность: logn + записи в диапазоне (+ длина значения на каждую подошедшую)
+    template<typename Pred = AnyEntry>
+    ScanAggregate aggregateRange(std::string_view from, std::optional<std::string_view> to, Pred pred = Pred()) {
+        ScanAggregate result;
+        std::optional<typename KVMap::const_iterator> first, last;
+        forEachLive_(from, to, [&](typename KVMap::const_iterator it) {
+            std::string_view value = it->second.value.str();
+            if (!pred(std::string_view(it->first), value))
+                return true;
+            ++result.count;
+            if (!first)
+                first = it;
+            last = it;
+            double number = 0;
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+            if (error == std::errc() && end == value.data() + value.size() && !value.empty()) {
+                ++result.numeric;
+                result.sum += number;
+            }
+            return true;
+        });
+        if (first) {
+            result.min_key = (*first)->first;
+            result.max_key = (*last)->first;
         }
+        return result;
+    }
+
+    // Живые ключи под glob-шаблон (как KEYS: *, ?, [a-z], \x), не больше limit, по порядку.
+    // Литеральный префикс шаблона ищется по дереву, остаток сверяется разобранным заранее шаблоном,
+    // так что идем только по ключам с этим префиксом, а не по всему хранилищу.
+    // ------ сложность: logn + ключи с литеральным префиксом шаблона
+    std::vector<std::string> scanPattern(std::string_view glob, uint32_t limit) {
+        return scanPattern(KeyPattern(glob), limit);
+    }
 
+    // то же с шаблоном, разобранным один раз на много вызовов
+    // ------ сложность: logn + ключи с литеральным префиксом шаблона
+    std::vector<std::string> scanPattern(const KeyPattern &pattern, uint32_t limit) {
+        std::vector<std::string> result;
+        if (limit == 0)
+            return result;
+        const size_t skip = pattern.prefix().size();
+        auto end = pattern.prefixEnd();
+        forEachLive_(pattern.prefix(), end, [&](typename KVMap::const_iterator it) {
+            if (pattern.matchTail(std::string_view(it->first).substr(skip))) {
+                result.push_back(it->first);
+                --limit;
+            }
+            return limit > 0;
+        });
         return result;
     }
 
@@ -94,62 +551,989 @@ public:
     // Если на момент вызова метода протухло несколько записей, то можно удалить любую.
     // ------ сложность: logn
     std::optional<std::pair<std::string, std::string> > removeOneExpiredEntry() {
-        auto now = static_cast<uint64_t>(clock_());
+        if constexpr (!expires_) {
+            return std::nullopt;
+        } else {
+            auto now = now_();
 
-        if (expiration_set_.empty() || expiration_set_.begin()->death_time > now)
+            if (expiration_set_.empty() || expiration_set_.begin()->death_time > now)
+                return std::nullopt;
+            // ключ и значение уезжают из узла без копирования
+            auto node = extractEntry_(kv_map_.find(expiration_set_.begin()->map_key), WatchEvent::Expire, nullptr);
+            return std::make_optional(std::pair<std::string, std::string>{std::move(node.key()),
+                                                                          std::move(node.mapped().value).release()});
+        }
+    }
+
+    // ближайшее время смерти (абсолютное) среди записей с ttl, nullopt если таких нет
+    // ------ сложность: const
+    std::optional<uint64_t> nextDeathTime() const {
+        if constexpr (!expires_) {
             return std::nullopt;
-        auto key = expiration_set_.begin()->map_key;
-        auto removed = std::pair<std::string, std::string>{key, kv_map_[key].value};
+        } else {
+            if (expiration_set_.empty())
+                return std::nullopt;
+            return expiration_set_.begin()->death_time;
+        }
+    }
+
+    // Вынимает запись по ключу целиком (можно и протухшую), подписчики видят Remove.
+    // Если ключа нет - пустой NodeHandle.
+    // ------ сложность: logn
+    NodeHandle extract(std::string_view key) {
+        NodeHandle handle;
+        if (auto it = kv_map_.find(key); it != kv_map_.end())
+            handle.node_ = extractEntry_(it, WatchEvent::Remove, &handle.expiry_);
+        return handle;
+    }
+
+    // Вынимает все записи с ключами из [from, to), по возрастанию ключа. to == nullopt - до конца.
+    // ------ сложность: logn + k * logn (поиск в сете протухания)
+    std::vector<NodeHandle> extractRange(std::string_view from, std::optional<std::string_view> to = std::nullopt) {
+        std::vector<NodeHandle> result;
+        for (auto it = kv_map_.lower_bound(from); it != kv_map_.end() && (!to || it->first < *to);) {
+            auto next = std::next(it);
+            auto &handle = result.emplace_back();
+            handle.node_ = extractEntry_(it, WatchEvent::Remove, &handle.expiry_);
+            it = next;
+        }
+        return result;
+    }
+
+    // Вставляет вынутую запись с перезаписью, как set (подписчики видят Set). Без лимита памяти новый ключ
+    // встает без копирования и аллокаций, с лимитом - это обычный set, который может не принять запись.
+    // Возвращает true если запись вставлена, handle после вызова пуст.
+    // ------ сложность: logn
+    bool insert(NodeHandle &&handle) {
+        if (handle.empty())
+            return false;
+        if (memory_limit_ != 0) {
+            NodeHandle dropped = std::move(handle);
+            return setWithDeathTime_(dropped.key(), dropped.value(), dropped.deathTime());
+        }
+        adoptNode_(kv_map_.end(), std::move(handle.node_), std::move(handle.expiry_));
+        return true;
+    }
+
+    // Вставляет пачку записей, возвращает сколько вставлено. Идущие по возрастанию ключа (как из extractRange)
+    // встают по подсказке за O(1) каждая.
+    // ------ сложность: logn + k (по возрастанию), иначе k * logn
+    size_t insertRange(std::vector<NodeHandle> &&handles) {
+        size_t inserted = 0;
+        auto hint = handles.empty() || handles.front().empty() ? kv_map_.end()
+                                                               : kv_map_.lower_bound(handles.front().key());
+        for (auto &handle: handles) {
+            if (handle.empty())
+                continue;
+            if (memory_limit_ != 0) {
+                inserted += insert(std::move(handle));
+                continue;
+            }
+            hint = adoptNode_(hint, std::move(handle.node_), std::move(handle.expiry_));
+            ++inserted;
+        }
+        handles.clear();
+        return inserted;
+    }
+
+    // Возвращает min(k, живых) различных случайных живых записей, каждая живая запись равновероятна.
+    // Частичный Фишер-Йетс по слотам sample_index_: сам индекс не трогаем, перестановки живут в
+    // маленькой таблице (только тронутые слоты). Протухшие просто пропускаются и тянется следующий слот.
+    // ------ сложность: k (в среднем, пока живых записей хотя бы половина), в худшем случае n
+    std::vector<std::pair<std::string, std::string> > sample(uint32_t k) {
+        std::vector<std::pair<std::string, std::string> > result{};
+        if (k == 0 || sample_index_.empty())
+            return result;
+
+        auto now = now_();
+        size_t n = sample_index_.size();
+        // swapped[i] - какой слот сейчас стоит на месте i в виртуальной перестановке
+        std::unordered_map<size_t, size_t> swapped;
+        auto at = [&](size_t i) {
+            auto found = swapped.find(i);
+            return found == swapped.end() ? i : found->second;
+        };
+        for (size_t i = 0; i < n && result.size() < k; ++i) {
+            size_t j = std::uniform_int_distribution<size_t>(i, n - 1)(sampler_rng_);
+            size_t slot = at(j);
+            swapped[j] = at(i);
+            auto it = sample_index_[slot];
+            if (it->second.death_time <= now)
+                continue;
+            result.emplace_back(it->first, it->second.value.str());
+        }
+        return result;
+    }
+
+    // для воспроизводимых выборок
+    void seedSampler(uint64_t seed) {
+        sampler_rng_.seed(seed);
+    }
+
+    // Ограничивает занятую память: ключи + значения + entryOverhead_ байт на запись (оценка из README).
+    // Фильтр TinyLFU живет в том же лимите: записям достается лимит минус его размер.
+    // При превышении сначала вычищаются протухшие записи, потом вытесняются по policy.
+    // Если сейчас занято больше - лишнее вытесняется сразу. 0 - без ограничения.
+    // ------ сложность: logn на каждую вытесненную запись
+    void setMemoryLimit(size_t max_bytes, EvictionPolicy policy = EvictionPolicy::SampledLru) {
+        memory_limit_ = max_bytes;
+        eviction_policy_ = policy;
+        if (policy != EvictionPolicy::TinyLfu || max_bytes == 0) {
+            admission_.reset();
+        } else if (size_t expected = max_bytes / (entryOverhead_ + 64); !admission_ || !admission_->sizedFor(expected)) {
+            // размер скетча считаем из того, сколько средних записей влезет в лимит.
+            // MemoryGovernor двигает лимит на каждом опросе - пересоздаем (и теряем частоты)
+            // только когда он ушел больше чем вдвое от того, под что скетч строился
+            admission_ = std::make_unique<TinyLfuFilter>(expected);
+        }
+        if (max_bytes == 0)
+            return;
+        while (memory_used_ > entryBudget_() && evictOne_(nullptr)) {
+        }
+    }
+
+    // сколько байт занято по той же оценке, что использует лимит (вместе с фильтром TinyLFU)
+    size_t memoryUsage() const {
+        return memory_used_ + (admission_ ? admission_->bytes() : 0);
+    }
+
+    // Разбивка занятой памяти по структурам (MemoryBreakdown), в отличие от memoryUsage - не оценка
+    // из README, а размеры узлов и буферов как они есть. Заголовок rb-узла считается как 4 указателя.
+    // ------ сложность: n
+    MemoryBreakdown memoryBreakdown() const {
+        constexpr size_t rbHeader = 4 * sizeof(void *);
+        MemoryBreakdown result;
+        result.entries = kv_map_.size();
+        result.map_nodes = kv_map_.size() * (rbHeader + sizeof(typename KVMap::value_type));
+        if constexpr (expires_) {
+            result.expiring = expiration_set_.size();
+            result.expiry_nodes = expiration_set_.size() * (rbHeader + sizeof(timedSetMember));
+            for (const auto &member: expiration_set_)
+                result.key_heap += stringHeapBytes(member.map_key);
+        }
+        std::unordered_set<const std::string *> shared;
+        for (const auto &[key, member]: kv_map_) {
+            result.key_heap += stringHeapBytes(key);
+            const std::string &value = member.value.str();
+            // общий буфер: make_shared кладет строку рядом со счетчиками (~16 байт)
+            if (!member.value.shared())
+                result.value_heap += stringHeapBytes(value);
+            else if (shared.insert(&value).second)
+                result.value_heap += sizeof(std::string) + 16 + stringHeapBytes(value);
+        }
+        result.indexes = sample_index_.capacity() * sizeof(typename KVMap::iterator);
+        result.bookkeeping = kv_map_.size() * bookkeepingBytes_ + result.indexes;
+        if (digests_) {
+            result.indexes += (size_t{2} << digests_->tree.depth()) * sizeof(uint64_t);
+            for (const auto &bucket: digests_->buckets)
+                result.indexes += sizeof(bucket) + bucket.capacity() * sizeof(typename KVMap::iterator);
+        }
+        // узел multimap: указатель на следующий + (хэш, weak_ptr), плюс корзина
+        if (value_pool_)
+            result.indexes += value_pool_->buffers() * (sizeof(void *) * 2 + sizeof(uint64_t) + sizeof(std::weak_ptr<int>));
+        if (admission_)
+            result.indexes += admission_->bytes();
+        return result;
+    }
+
+    size_t memoryLimit() const {
+        return memory_limit_;
+    }
+
+    EvictionPolicy evictionPolicy() const {
+        return eviction_policy_;
+    }
+
+    // кол-во записей, включая протухшие но еще не вычищенные
+    size_t size() const {
+        return kv_map_.size();
+    }
+
+    // Вычищает до max_entries протухших записей, возвращает сколько вычистил.
+    // ------ сложность: logn на запись
+    size_t reapExpired(size_t max_entries) {
+        size_t reaped = 0;
+        if constexpr (expires_) {
+            auto now = now_();
+            while (reaped < max_entries && !expiration_set_.empty() && expiration_set_.begin()->death_time <= now) {
+                std::string key = expiration_set_.begin()->map_key;
+                eraseEntry_(key, WatchEvent::Expire);
+                ++reaped;
+            }
+        }
+        return reaped;
+    }
+
+    // сколько записей смотреть при выборе жертвы вытеснения, больше - ближе к честному LRU
+    void setEvictionSamples(uint32_t samples) {
+        eviction_samples_ = samples == 0 ? 1 : samples;
+    }
+
+    // Сохраняет живые записи в файл снапшота (формат в Snapshot.h), время смерти - абсолютное.
+    // Ошибки записи - std::runtime_error.
+    // ------ сложность: n
+    void saveSnapshot(const std::filesystem::path &path, size_t chunk_bytes = 1 << 20) const {
+        auto now = now_();
+        SnapshotWriter writer(path, chunk_bytes);
+        for (const auto &[key, member]: kv_map_) {
+            if (member.death_time > now)
+                writer.add(key, member.value.str(), member.death_time);
+        }
+        writer.finish();
+    }
+
+    // Добавляет (с перезаписью) все записи снапшота, протухшие к текущему моменту пропускаются.
+    // Чанки проверяются по CRC32C и декодируются в готовые узлы параллельно в threads потоках,
+    // целиком протухшие чанки пропускаются без чтения. Потом узлы одним проходом вставляются
+    // по подсказке (ключи уже отсортированы). Битый снапшот - std::runtime_error, хранилище не меняется.
+    // ------ сложность: n / threads + n (вставка по подсказке, если ключи не пересекаются с текущими)
+    void loadSnapshot(const std::filesystem::path &path, unsigned threads = std::thread::hardware_concurrency()) {
+        SnapshotFile file(path);
+        file.adviseAll(MADV_SEQUENTIAL);
+        auto now = now_();
+
+        std::vector<KVMap> decoded(file.chunks());
+        parallelFor(file.chunks(), threads, [&](size_t c) {
+            if (file.chunk(c).max_death_time <= now)
+                return;
+            if (!file.verifyChunk(c))
+                throw std::runtime_error("KVStorage::loadSnapshot: chunk " + std::to_string(c) + " of "
+                                         + path.string() + " is corrupted");
+            auto &out = decoded[c];
+            file.forEachInChunk(c, [&](const SnapshotRecord &record) {
+                if (record.death_time > now)
+                    out.emplace_hint(out.end(), std::string(record.key()),
+                                     timedKVMember{std::string(record.value()), record.death_time});
+            });
+        });
+
+        for (auto &chunk: decoded) {
+            if (chunk.empty())
+                continue;
+            auto hint = kv_map_.lower_bound(chunk.begin()->first);
+            while (!chunk.empty())
+                hint = adoptNode_(hint, chunk.extract(chunk.begin()));
+        }
+    }
+
+    // Выгружает все живые записи колонками (ColumnarExport.h) батчами по options.batch_rows строк.
+    // Ключи режутся на части по выборке из индекса сэмплирования, части выгружаются параллельно
+    // в options.threads потоках: sink(part, batch) зовется из разных потоков, внутри части батчи идут
+    // по порядку ключей, части с меньшим номером - с меньшими ключами. Хранилище на время выгрузки
+    // менять нельзя (чтение map из нескольких потоков безопасно, запись - нет).
+    // ------ сложность: n / threads + parts * logn
+    void exportColumnar(const std::function<void(size_t part, ColumnarBatch &&batch)> &sink,
+                        ColumnarOptions options = ColumnarOptions()) const {
+        size_t batch_rows = std::max<size_t>(options.batch_rows, 1);
+        unsigned threads = std::max(1u, options.threads);
+        // по 4 части на поток - чтобы неровные части не оставляли потоки без дела
+        size_t parts = std::min<size_t>(threads == 1 ? 1 : size_t{4} * threads, sample_index_.size());
+        std::vector<std::string_view> bounds;
+        for (size_t p = 1; p < parts; ++p)
+            bounds.push_back(sample_index_[p * sample_index_.size() / parts]->first);
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        parallelFor(bounds.size() + 1, threads, [&](size_t part) {
+            std::string_view from = part == 0 ? std::string_view() : bounds[part - 1];
+            auto to = part == bounds.size() ? std::nullopt : std::make_optional(bounds[part]);
+            ColumnarBatch batch;
+            batch.reserve(batch_rows);
+            forEachLive_(from, to, [&](typename KVMap::const_iterator it) {
+                const std::string &value = it->second.value.str();
+                // байты батча упираются в int32-смещения раньше batch_rows - режем батч до переполнения
+                if (batch.length == static_cast<int64_t>(batch_rows)
+                    || (batch.length > 0 && !batch.fits(it->first.size(), value.size()))) {
+                    sink(part, std::exchange(batch, ColumnarBatch()));
+                    batch.reserve(batch_rows);
+                }
+                uint64_t death = it->second.death_time;
+                batch.append(it->first, value, death == maxTime_ ? std::nullopt : std::make_optional(death));
+                return true;
+            });
+            if (batch.length > 0)
+                sink(part, std::move(batch));
+        });
+    }
+
+    // Включает дедупликацию значений: значения от min_size байт с одинаковым содержимым хранятся
+    // одним общим буфером со счетчиком ссылок (ValuePool.h). Уже лежащие значения тоже сливаются.
+    // Лимит памяти по-прежнему считает каждое значение целиком - это оценка сверху.
+    // ------ сложность: сумма длин значений
+    void enableValueDedup(size_t min_size = 32) {
+        value_pool_ = std::make_unique<ValuePool>(min_size);
+        for (auto &[key, member]: kv_map_)
+            value_pool_->internInPlace(member.value);
+    }
+
+    // новые значения снова хранятся отдельно, уже общие остаются общими
+    void disableValueDedup() {
+        value_pool_.reset();
+    }
+
+    // Включает дерево дайджестов по 2^depth диапазонам хэшей ключей - для сверки реплик через syncFrom.
+    // Дальше дерево само обновляется на set, remove, вытеснении и вычистке протухших.
+    // Цена: O(depth) на каждое изменение и 8 байт на запись в корзине листа.
+    // ------ сложность: n * depth
+    void enableRangeDigests(uint32_t depth = 12) {
+        digests_ = std::make_unique<DigestState>(depth);
+        for (auto it = kv_map_.begin(); it != kv_map_.end(); ++it)
+            digestInsert_(it);
+    }
+
+    void disableRangeDigests() {
+        digests_.reset();
+    }
+
+    // дайджест всего хранилища, nullopt если дерево выключено
+    std::optional<uint64_t> rootDigest() const {
+        return digests_ ? std::make_optional(digests_->tree.root()) : std::nullopt;
+    }
+
+    // Вливает other в это хранилище одним проходом по обоим map в порядке ключей: новые ключи переезжают
+    // узлами без копий и встают по подсказке, сет протухания other вливается целиком (std::set::merge).
+    // Если ключ есть в обоих, решает policy (для Custom - resolver). Подписчики этого хранилища видят Set
+    // на каждую принятую запись, подписчики other - ничего, other после вызова пуст.
+    // С лимитом памяти каждая принятая запись идет через обычный set и может не влезть.
+    // Часы у хранилищ должны совпадать (время смерти абсолютное).
+    // ------ сложность: m * min(расстояние, 32 + logn) + (конфликты + записи other с ttl) * log(n + m)
+    MergeStats mergeFrom(KVStorage &&other, MergePolicy policy, const MergeResolver &resolver = {}) {
+        if (policy == MergePolicy::Custom && !resolver)
+            throw std::invalid_argument("KVStorage::mergeFrom: MergePolicy::Custom needs a resolver");
+        if (&other == this)
+            return {};
+        auto takeTheirs = [&](typename KVMap::iterator ours, typename KVMap::iterator theirs) {
+            switch (policy) {
+                case MergePolicy::OtherWins:
+                    return true;
+                case MergePolicy::LaterDeathTimeWins:
+                    return theirs->second.death_time >= ours->second.death_time;
+                case MergePolicy::Custom:
+                    break;
+            }
+            return resolver(ours->first, ours->second.value.str(), ours->second.death_time,
+                            theirs->second.value.str(), theirs->second.death_time);
+        };
+
+        MergeStats stats;
+        auto hint = kv_map_.begin();
+        for (auto theirs = other.kv_map_.begin(); theirs != other.kv_map_.end();) {
+            auto next = std::next(theirs);
+            hint = seek_(hint, theirs->first);
+            bool conflict = hint != kv_map_.end() && hint->first == theirs->first;
+
+            if (conflict && !takeTheirs(hint, theirs)) {
+                other.dropExpiry_(theirs);
+                ++stats.kept;
+            } else if (memory_limit_ != 0) {
+                // вытеснение может задеть что угодно, подсказку ищем заново
+                other.dropExpiry_(theirs);
+                bool accepted = setWithDeathTime_(theirs->first, theirs->second.value.str(), theirs->second.death_time);
+                if (!accepted)
+                    ++stats.rejected;
+                else if (conflict)
+                    ++stats.replaced;
+                else
+                    ++stats.inserted;
+                hint = kv_map_.lower_bound(theirs->first);
+            } else if (conflict) {
+                // узел наш, значение забираем; их запись в сете протухания приедет со всем сетом
+                dropExpiry_(hint);
+                if (digests_)
+                    digests_->tree.remove(digests_->tree.leafOf(hint->first), digestOf_(hint));
+                memory_used_ += theirs->second.value.size();
+                memory_used_ -= hint->second.value.size();
+                hint->second.value = std::move(theirs->second.value);
+                if (value_pool_)
+                    value_pool_->internInPlace(hint->second.value);
+                hint->second.death_time = theirs->second.death_time;
+                hint->second.last_access = ++access_tick_;
+                if (digests_)
+                    digests_->tree.add(digests_->tree.leafOf(hint->first), digestOf_(hint));
+                watchers_.notify(WatchEvent::Set, hint->first, hint->second.value.str());
+                ++stats.replaced;
+            } else {
+                registerAdopted_(kv_map_.insert(hint, other.kv_map_.extract(theirs)));
+                ++stats.inserted;
+            }
+            theirs = next;
+        }
+        // в other остались только записи, чьи ключи у нас уже есть - их сета протухания там уже нет
+        if constexpr (expires_)
+            expiration_set_.merge(other.expiration_set_);
+        other.dropAll_();
+        return stats;
+    }
 
-        remove(key);
+    // Делает это хранилище копией source, трогая только разошедшиеся диапазоны. Деревья сравниваются
+    // сверху вниз, по каждому разошедшемуся листу реплика отдает свои (ключ, дайджест записи), а source
+    // в ответ - записи, которых у реплики нет или которые отличаются, и ключи на удаление.
+    // Обмен считается в байтах, как если бы реплики были по разные стороны сети.
+    // У обоих должно быть включено дерево одной глубины, иначе std::invalid_argument.
+    // ------ сложность: diff * depth + размер разошедшихся листьев
+    RangeSyncStats syncFrom(const KVStorage &source) {
+        if (!digests_ || !source.digests_ || digests_->tree.depth() != source.digests_->tree.depth())
+            throw std::invalid_argument("KVStorage::syncFrom: both replicas need range digests of the same depth");
+        RangeSyncStats stats;
+        const auto &mine = digests_->tree, &theirs = source.digests_->tree;
 
-        return std::make_optional(removed);
+        std::vector<size_t> frontier{1}, differing;
+        while (!frontier.empty()) {
+            std::vector<size_t> next;
+            for (size_t i: frontier) {
+                ++stats.digests_compared;
+                stats.bytes_exchanged += 2 * sizeof(uint64_t);
+                if (mine.node(i) == theirs.node(i))
+                    continue;
+                if (i >= mine.leaves()) {
+                    differing.push_back(i - mine.leaves());
+                } else {
+                    next.push_back(2 * i);
+                    next.push_back(2 * i + 1);
+                }
+            }
+            frontier = std::move(next);
+        }
+
+        for (size_t leaf: differing) {
+            ++stats.ranges_differ;
+            // реплика -> source: что лежит у нее в листе
+            std::unordered_map<std::string_view, uint64_t> replica_has;
+            for (auto it: digests_->buckets[leaf]) {
+                replica_has.emplace(it->first, digestOf_(it));
+                stats.bytes_exchanged += it->first.size() + sizeof(uint64_t);
+            }
+            // source -> реплика: недостающие и отличающиеся записи, потом лишние ключи
+            std::vector<std::tuple<std::string, std::string, uint64_t> > to_set;
+            for (auto it: source.digests_->buckets[leaf]) {
+                auto found = replica_has.find(it->first);
+                bool same = found != replica_has.end() && found->second == source.digestOf_(it);
+                if (found != replica_has.end())
+                    replica_has.erase(found);
+                if (same)
+                    continue;
+                to_set.emplace_back(it->first, it->second.value.str(), it->second.death_time);
+                stats.bytes_exchanged += it->first.size() + it->second.value.size() + sizeof(uint64_t);
+            }
+            std::vector<std::string> to_remove;
+            for (auto &[key, digest]: replica_has) {
+                to_remove.emplace_back(key);
+                stats.bytes_exchanged += key.size();
+            }
+
+            for (auto &[key, value, dt]: to_set)
+                setWithDeathTime_(key, value, dt);
+            for (auto &key: to_remove)
+                remove(key);
+            stats.entries_sent += to_set.size();
+            stats.entries_removed += to_remove.size();
+        }
+        return stats;
+    }
+
+    // Подписывается на изменения ключей с префиксом pattern (или ровно ключа pattern при WatchMode::Key).
+    // События: set, remove и протухание (срабатывает когда запись вычищает removeOneExpiredEntry).
+    // Колбэк получает пачку уведомлений, размер пачки задается setWatchBatchSize.
+    // ------ сложность: длина паттерна
+    WatchId watch(std::string_view pattern, WatchMode mode, WatchCallback callback) {
+        return watchers_.add(pattern, mode, std::move(callback));
+    }
+
+    // то же самое, но уведомления просто складываются в очередь юзера
+    WatchId watch(std::string_view pattern, WatchMode mode, std::vector<WatchNotification> *queue) {
+        return watchers_.add(pattern, mode, [queue](std::span<const WatchNotification> batch) {
+            queue->insert(queue->end(), batch.begin(), batch.end());
+        });
+    }
+
+    // Снимает подписку, недоставленные уведомления отдаются сразу. false - если такой подписки нет.
+    bool unwatch(WatchId id) {
+        return watchers_.remove(id);
+    }
+
+    // При частых записях выгоднее копить уведомления и отдавать пачками по batch_size штук.
+    // По умолчанию 1 - каждое событие доставляется сразу.
+    void setWatchBatchSize(size_t batch_size) {
+        watchers_.setBatchSize(batch_size);
+    }
+
+    // Доставляет все недобранные пачки.
+    void flushWatches() {
+        watchers_.flush();
+    }
+
+    // Включает учет горячих ключей и префиксов на get/set. Учитывается только сэмпл операций,
+    // так что на несэмплированной операции цена - один вызов генератора случайных чисел.
+    // Повторный вызов сбрасывает накопленную статистику.
+    void enableHotKeyTracking(HotKeyOptions options = HotKeyOptions()) {
+        hot_keys_ = std::make_unique<HotKeyTracker>(options);
+    }
+
+    void disableHotKeyTracking() {
+        hot_keys_.reset();
+    }
+
+    // n самых нагруженных ключей/префиксов по убыванию. Пусто если учет выключен.
+    // ------ сложность: n
+    std::vector<HotKeyStat> hotKeys(size_t n) const {
+        return hot_keys_ ? hot_keys_->topKeys(n) : std::vector<HotKeyStat>{};
+    }
+
+    std::vector<HotKeyStat> hotPrefixes(size_t n) const {
+        return hot_keys_ ? hot_keys_->topPrefixes(n) : std::vector<HotKeyStat>{};
+    }
+
+    // оценка кол-ва обращений к ключу (Count-Min Sketch), 0 если учет выключен
+    uint64_t estimateKeyHits(std::string_view key) const {
+        return hot_keys_ ? hot_keys_->estimate(key) : 0;
     }
 
 private:
+    static constexpr bool expires_ = !std::is_same_v<Clock, NoExpiry>;
+
+    // текущее время, без ttl часы не трогаем вообще
+    uint64_t now_() const {
+        if constexpr (expires_)
+            return static_cast<uint64_t>(clock_());
+        else
+            return 0;
+    }
+
+    // Общий обход сканов: до count живых записей начиная с первого ключа >= key, по порядку.
+    // ------ сложность: logn + count (+ пропущенные протухшие)
+    template<typename Fn>
+    void scanSorted_(std::string_view key, uint32_t count, Fn &&fn) const {
+        auto now = now_();
+        // сразу прыгаем на первый ключ >= key, раньше тут был проход с начала map
+        for (auto it = kv_map_.lower_bound(key); it != kv_map_.end() && count > 0; ++it) {
+            if (it->second.death_time <= now)
+                continue;
+            fn(it);
+            --count;
+        }
+    }
+
+    // Живые записи с ключами из [from, to) по порядку, пока fn возвращает true.
+    // ------ сложность: logn + просмотренные записи
+    template<typename Fn>
+    void forEachLive_(std::string_view from, std::optional<std::string_view> to, Fn &&fn) const {
+        auto now = now_();
+        for (auto it = kv_map_.lower_bound(from); it != kv_map_.end() && (!to || it->first < *to); ++it) {
+            if (it->second.death_time <= now)
+                continue;
+            if (!fn(it))
+                return;
+        }
+    }
+
     // возвращает время смерти с учетом ttl относительно текущего момента
     // ------ сложность: const
     uint64_t getDeathTime_(uint32_t ttl) const {
-        return (ttl == 0) ? maxTime_ : static_cast<uint64_t>(ttl) + static_cast<uint64_t>(clock_());
+        if constexpr (!expires_)
+            return maxTime_;
+        else
+            return (ttl == 0) ? maxTime_ : static_cast<uint64_t>(ttl) + now_();
     }
 
+    // время смерти в записи без ttl: пустой тип, всегда "бессмертен" и с [[no_unique_address]] места не занимает
+    struct NoDeathTime {
+        constexpr NoDeathTime(uint64_t = 0) noexcept {
+        }
+
+        constexpr operator uint64_t() const noexcept { return std::numeric_limits<uint64_t>::max(); }
+    };
+    using DeathTime = std::conditional_t<expires_, uint64_t, NoDeathTime>;
+
     struct timedSetMember {
         std::string map_key;
         uint64_t death_time{};
     };
 
+    // sample_slot, last_access и digest_slot есть у каждой записи и поддерживаются на каждой записи
+    // (и sample_index_ вместе с ними), даже если sample, лимит памяти и дайджесты не включены: включаются
+    // они на ходу, а поля узла на ходу не добавить. Это 16 байт в узле + 8 в индексе, видно в
+    // memoryBreakdown().bookkeeping.
     struct timedKVMember {
-        std::string value;
-        uint64_t death_time{};
+        StoredValue value;
+        [[no_unique_address]] DeathTime death_time{};
+        // позиция в sample_index_
+        size_t sample_slot{};
+        // логическое время последнего обращения, для вытеснения
+        uint32_t last_access{};
+        // позиция в корзине своего листа дерева дайджестов
+        uint32_t digest_slot{};
     };
+    static constexpr size_t bookkeepingBytes_ = sizeof(timedKVMember::sample_slot) + sizeof(timedKVMember::last_access)
+                                                + sizeof(timedKVMember::digest_slot);
 
     // основное хранилище, less<> ибо мы сравниваем иногда string со string_view
-    std::map<std::string, timedKVMember, std::less<> > kv_map_;
+    using KVMap = std::map<std::string, timedKVMember, std::less<> >;
+    KVMap kv_map_;
+
+    struct timedSetComparator;
+    // без ttl сета протухания нет вовсе: пустой тип и пустой узел вместо std::set
+    struct NoExpirySet {
+        struct node_type {
+        };
+    };
+    using ExpirySet = std::conditional_t<expires_, std::set<timedSetMember, timedSetComparator>, NoExpirySet>;
+
+public:
+    // Запись, вынутая из хранилища (extract) вместе со своими узлами map и сета протухания: переезжает
+    // в другое хранилище через insert без копирования строк и без аллокаций. Время смерти абсолютное,
+    // так что часы у хранилищ должны совпадать.
+    class NodeHandle {
+    public:
+        NodeHandle() = default;
+
+        bool empty() const { return node_.empty(); }
+        explicit operator bool() const { return !empty(); }
+
+        const std::string &key() const { return node_.key(); }
+        const std::string &value() const { return node_.mapped().value.str(); }
+        uint64_t deathTime() const { return node_.mapped().death_time; }
+
+    private:
+        friend class KVStorage;
+
+        typename KVMap::node_type node_;
+        // пустой у бессмертных записей
+        [[no_unique_address]] typename ExpirySet::node_type expiry_;
+    };
+
+private:
+
+    // все записи kv_map_ в произвольном порядке, нужен для случайной выборки за O(1) на элемент.
+    // итераторы map не инвалидируются при вставке/удалении других элементов, удаление - swap с последним
+    std::vector<typename KVMap::iterator> sample_index_;
+    // minstd, а не mt19937: 8 байт состояния вместо 2.5 КБ, у ShardedKVStorage таких хранилищ - по куску на ~256 записей
+    std::minstd_rand sampler_rng_{0x5eed};
 
     // храним в порядке возрастания времени смерти значения
     // std::function<bool(const timedSetMember &, const timedSetMember &)>
     // cmp_ = [](const timedSetMember &lhs, const timedSetMember &rhs) { return lhs.death_time < rhs.death_time; };
+    // для поиска в сете без копии ключа
+    struct timedSetProbe {
+        std::string_view map_key;
+        uint64_t death_time{};
+    };
+
     struct timedSetComparator {
-        bool operator()(const timedSetMember &lhs, const timedSetMember &rhs) const {
+        using is_transparent = void;
+
+        template<typename Lhs, typename Rhs>
+        bool operator()(const Lhs &lhs, const Rhs &rhs) const {
             return lhs.death_time < rhs.death_time
-            || (lhs.death_time == rhs.death_time && lhs.map_key < rhs.map_key);
+            || (lhs.death_time == rhs.death_time && std::string_view(lhs.map_key) < std::string_view(rhs.map_key));
         }
     };
-    std::set<timedSetMember, timedSetComparator> expiration_set_;
+    [[no_unique_address]] ExpirySet expiration_set_;
+
+    // подписчики на изменения
+    WatchTrie watchers_;
+
+    // ограничение памяти, 0 - нет ограничения
+    static constexpr size_t entryOverhead_ = 136;
+    // getManySortedMulti: сколько шагов от конца прошлого диапазона пробуем до поиска от корня.
+    // Меньше, чем в mergeFrom: там ключи идут плотно, а диапазоны дашбордов обычно далеко друг от друга
+    static constexpr int multiScanSteps_ = 8;
+    size_t memory_used_ = 0;
+    size_t memory_limit_ = 0;
+    EvictionPolicy eviction_policy_ = EvictionPolicy::SampledLru;
+    uint32_t eviction_samples_ = 5;
+    // счетчик обращений, переполнение не страшно - сравниваем разности
+    uint32_t access_tick_ = 0;
+    std::unique_ptr<TinyLfuFilter> admission_;
+
+    // учет горячих ключей, nullptr - выключен
+    std::unique_ptr<HotKeyTracker> hot_keys_;
+
+    // дерево дайджестов и записи каждого листа (удаление - swap с последним), nullptr - выключено
+    struct DigestState {
+        explicit DigestState(uint32_t depth) : tree(depth), buckets(tree.leaves()) {
+        }
+
+        MerkleTree tree;
+        std::vector<std::vector<typename KVMap::iterator> > buckets;
+    };
+    std::unique_ptr<DigestState> digests_;
+
+    // общие буферы одинаковых значений, nullptr - выключено
+    std::unique_ptr<ValuePool> value_pool_;
 
     // часы выбранные юзером
     Clock clock_;
     // в целом это время достижимо, и при сравнении death_time > now мы получим протухание...
-    uint64_t maxTime_ = std::numeric_limits<uint64_t>::max();
+    static constexpr uint64_t maxTime_ = std::numeric_limits<uint64_t>::max();
 
     // удаляет связанное с данным key значение из сета expiration_set_
     // мы ЗАРАНЕЕ обязаны проверить что ключ СУЩЕСТВУЕТ, иначе бред!!!
     // ------ сложность: logn
     void tryToRemoveFromSet(const std::string &key) {
-        // возможно до этого было ttl=0 -> этой записи в сете не будет
-        auto tmp = timedSetMember{key, kv_map_[key].death_time};
-        if (auto it = expiration_set_.find(tmp); it != expiration_set_.end())
-            expiration_set_.erase(it);
+        if constexpr (expires_) {
+            // возможно до этого было ttl=0 -> этой записи в сете не будет
+            auto tmp = timedSetMember{key, kv_map_[key].death_time};
+            if (auto it = expiration_set_.find(tmp); it != expiration_set_.end())
+                expiration_set_.erase(it);
+        }
+    }
+
+    // set с уже посчитанным абсолютным временем смерти (maxTime_ - бессмертная запись)
+    // ------ сложность: logn
+    bool setWithDeathTime_(const std::string &key, std::string_view value, uint64_t dt) {
+        if (admission_)
+            admission_->recordWrite(key);
+        auto existing = kv_map_.find(key);
+        if (memory_limit_ != 0 && !makeRoom_(key, value.size(), existing))
+            return false;
+
+        // при ОБНОВЛЕНИИ надо удалить старые данные из сета
+        if (existing != kv_map_.end()) {
+            tryToRemoveFromSet(key);
+            memory_used_ -= existing->second.value.size();
+            if (digests_)
+                digests_->tree.remove(digests_->tree.leafOf(key), digestOf_(existing));
+        } else {
+            memory_used_ += key.size() + entryOverhead_;
+        }
+
+        // при необходимости добавляем время
+        if constexpr (expires_) {
+            if (dt != maxTime_)
+                expiration_set_.emplace(key, dt);
+        }
+
+        auto [it, inserted] = kv_map_.try_emplace(key);
+        if (auto buffer = value_pool_ ? value_pool_->intern(value) : nullptr)
+            it->second.value.share(std::move(buffer));
+        else
+            it->second.value.assign(value);
+        it->second.death_time = dt;
+        it->second.last_access = ++access_tick_;
+        memory_used_ += value.size();
+        if (inserted)
+            addToSampleIndex(it);
+        if (digests_ && inserted)
+            digestInsert_(it);
+        else if (digests_)
+            digests_->tree.add(digests_->tree.leafOf(key), digestOf_(it));
+        if (hot_keys_)
+            hot_keys_->record(key, value.size());
+        watchers_.notify(WatchEvent::Set, key, value);
+        return true;
+    }
+
+    // Вставляет готовый узел (с перезаписью, как set). hint - место, перед которым узел скорее всего встанет,
+    // возвращает место для следующего по порядку ключа. Узлы по возрастанию ключа вставляются за O(1) каждый.
+    // expiry - узел сета протухания из другого хранилища, если есть - встает вместо новой аллокации.
+    // ------ сложность: const амортизированно при верной подсказке, иначе logn
+    typename KVMap::iterator adoptNode_(typename KVMap::iterator hint, typename KVMap::node_type node,
+                                        typename ExpirySet::node_type expiry = {}) {
+        // с лимитом памяти нужен обычный set со всеми проверками и вытеснением
+        if (memory_limit_ != 0) {
+            setWithDeathTime_(node.key(), node.mapped().value.str(), node.mapped().death_time);
+            return kv_map_.upper_bound(node.key());
+        }
+
+        auto it = kv_map_.insert(hint, std::move(node));
+        // при неудаче (ключ уже есть) узел остается у нас - перезаписываем как set
+        if (node) {
+            setWithDeathTime_(it->first, node.mapped().value.str(), node.mapped().death_time);
+            return std::next(it);
+        }
+        if constexpr (expires_) {
+            if (it->second.death_time != maxTime_ && expiry)
+                expiration_set_.insert(std::move(expiry));
+            else if (it->second.death_time != maxTime_)
+                expiration_set_.emplace(it->first, it->second.death_time);
+        }
+        registerAdopted_(it);
+        return std::next(it);
+    }
+
+    // учет только что вставленного узла везде, кроме сета протухания
+    // ------ сложность: const (+ depth с деревом дайджестов)
+    void registerAdopted_(typename KVMap::iterator it) {
+        if (value_pool_)
+            value_pool_->internInPlace(it->second.value);
+        it->second.last_access = ++access_tick_;
+        addToSampleIndex(it);
+        if (digests_)
+            digestInsert_(it);
+        memory_used_ += it->first.size() + it->second.value.size() + entryOverhead_;
+        watchers_.notify(WatchEvent::Set, it->first, it->second.value.str());
+    }
+
+    // первый ключ >= key начиная с hint (hint не правее ответа): до steps шагов вперед, а если ответ
+    // дальше - обычный поиск. Шаги по соседним узлам дешевле спуска от корня по холодному дереву
+    // ------ сложность: min(расстояние, steps + logn)
+    typename KVMap::iterator seek_(typename KVMap::iterator hint, std::string_view key, int steps = 32) {
+        for (int step = 0; step < steps; ++step, ++hint) {
+            if (hint == kv_map_.end() || hint->first >= key)
+                return hint;
+        }
+        return kv_map_.lower_bound(key);
+    }
+
+    // ------ сложность: logn
+    void dropExpiry_(typename KVMap::const_iterator it) {
+        if constexpr (expires_) {
+            if (it->second.death_time == maxTime_)
+                return;
+            if (auto set_it = expiration_set_.find(timedSetProbe{it->first, it->second.death_time});
+                set_it != expiration_set_.end())
+                expiration_set_.erase(set_it);
+        }
+    }
+
+    // забыть все записи разом, без оповещений (после того как их забрали узлами)
+    void dropAll_() {
+        kv_map_.clear();
+        if constexpr (expires_)
+            expiration_set_.clear();
+        sample_index_.clear();
+        memory_used_ = 0;
+        if (digests_)
+            digests_ = std::make_unique<DigestState>(digests_->tree.depth());
+    }
+
+    uint64_t digestOf_(typename KVMap::const_iterator it) const {
+        return entryDigest(it->first, it->second.value.str(), it->second.death_time);
+    }
+
+    // ------ сложность: depth
+    void digestInsert_(typename KVMap::iterator it) {
+        size_t leaf = digests_->tree.leafOf(it->first);
+        digests_->tree.add(leaf, digestOf_(it));
+        auto &bucket = digests_->buckets[leaf];
+        it->second.digest_slot = static_cast<uint32_t>(bucket.size());
+        bucket.push_back(it);
+    }
+
+    // ------ сложность: depth
+    void digestErase_(typename KVMap::iterator it) {
+        size_t leaf = digests_->tree.leafOf(it->first);
+        digests_->tree.remove(leaf, digestOf_(it));
+        auto &bucket = digests_->buckets[leaf];
+        uint32_t slot = it->second.digest_slot;
+        bucket[slot] = bucket.back();
+        bucket[slot]->second.digest_slot = slot;
+        bucket.pop_back();
+    }
+
+    // ------ сложность: const
+    void addToSampleIndex(typename KVMap::iterator it) {
+        it->second.sample_slot = sample_index_.size();
+        sample_index_.push_back(it);
+    }
+
+    // ------ сложность: const
+    void removeFromSampleIndex(typename KVMap::iterator it) {
+        size_t slot = it->second.sample_slot;
+        sample_index_[slot] = sample_index_.back();
+        sample_index_[slot]->second.sample_slot = slot;
+        sample_index_.pop_back();
+    }
+
+    // кандидат на вытеснение, запись protect не трогаем. Сперва протухшая с головы expiration_set_,
+    // иначе самая давно тронутая из eviction_samples_ случайных
+    // ------ сложность: logn + eviction_samples_
+    typename KVMap::iterator pickVictim_(const std::string *protect) {
+        auto now = now_();
+        if constexpr (expires_) {
+            if (!expiration_set_.empty() && expiration_set_.begin()->death_time <= now
+                && (!protect || expiration_set_.begin()->map_key != *protect))
+                return kv_map_.find(expiration_set_.begin()->map_key);
+        }
+
+        auto victim = kv_map_.end();
+        uint32_t victim_age = 0;
+        if (sample_index_.empty())
+            return victim;
+        std::uniform_int_distribution<size_t> pick(0, sample_index_.size() - 1);
+        for (uint32_t i = 0; i < eviction_samples_; ++i) {
+            auto it = sample_index_[pick(sampler_rng_)];
+            if (protect && it->first == *protect)
+                continue;
+            if (it->second.death_time <= now)
+                return it;
+            uint32_t age = access_tick_ - it->second.last_access;
+            if (victim == kv_map_.end() || age > victim_age) {
+                victim = it;
+                victim_age = age;
+            }
+        }
+        return victim;
+    }
+
+    // вытесняет одну запись, false - вытеснять некого
+    // ------ сложность: logn
+    bool evictOne_(const std::string *protect) {
+        auto victim = pickVictim_(protect);
+        if (victim == kv_map_.end())
+            return false;
+        bool expired = victim->second.death_time <= now_();
+        std::string victim_key = victim->first;
+        eraseEntry_(victim_key, expired ? WatchEvent::Expire : WatchEvent::Evict);
+        return true;
+    }
+
+    // сколько из лимита остается записям за вычетом фильтра TinyLFU
+    size_t entryBudget_() const {
+        size_t filter = admission_ ? admission_->bytes() : 0;
+        return memory_limit_ > filter ? memory_limit_ - filter : 0;
+    }
+
+    // освобождает место под запись key с value_size байт значения (existing - текущая запись по key, если есть).
+    // false - не влезает вовсе или новый ключ не прошел TinyLFU
+    // ------ сложность: logn на каждую вытесненную запись
+    bool makeRoom_(const std::string &key, size_t value_size, typename KVMap::iterator existing) {
+        size_t new_size = key.size() + value_size + entryOverhead_;
+        size_t old_size = existing == kv_map_.end() ? 0 : key.size() + existing->second.value.size() + entryOverhead_;
+        size_t budget = entryBudget_();
+        if (new_size > budget)
+            return false;
+
+        while (memory_used_ - old_size + new_size > budget) {
+            auto victim = pickVictim_(&key);
+            if (victim == kv_map_.end())
+                return false;
+            bool expired = victim->second.death_time <= now_();
+            // обновления существующих ключей и вытеснение протухших фильтр не касается
+            if (admission_ && existing == kv_map_.end() && !expired && !admission_->admit(key, victim->first))
+                return false;
+            std::string victim_key = victim->first;
+            eraseEntry_(victim_key, expired ? WatchEvent::Expire : WatchEvent::Evict);
+        }
+        return true;
+    }
+
+    // удаляет существующую запись отовсюду и оповещает подписчиков
+    // ------ сложность: logn
+    void eraseEntry_(const std::string &key, WatchEvent event) {
+        extractEntry_(kv_map_.find(key), event, nullptr);
+    }
+
+    // то же, но узел записи отдается наружу, а узел сета протухания - в *expiry (если не nullptr)
+    // ------ сложность: logn
+    typename KVMap::node_type extractEntry_(typename KVMap::iterator it, WatchEvent event,
+                                            typename ExpirySet::node_type *expiry) {
+        if constexpr (expires_) {
+            if (it->second.death_time != maxTime_) {
+                auto set_it = expiration_set_.find(timedSetProbe{it->first, it->second.death_time});
+                if (set_it != expiration_set_.end() && expiry)
+                    *expiry = expiration_set_.extract(set_it);
+                else if (set_it != expiration_set_.end())
+                    expiration_set_.erase(set_it);
+            }
+        }
+        removeFromSampleIndex(it);
+        if (digests_)
+            digestErase_(it);
+        memory_used_ -= it->first.size() + it->second.value.size() + entryOverhead_;
+        auto node = kv_map_.extract(it);
+        watchers_.notify(event, node.key(), node.mapped().value.str());
+        return node;
     }
 
     // ------ сложность: logn
@@ -157,21 +1541,505 @@ private:
         return kv_map_.contains(key);
     }
 
-    // может ли юзер получить данные по ключу? (не может если протухла запись или ключа нет)
+    // запись, которую юзер может получить по ключу, или end() (если протухла запись или ключа нет);
+    // get читает значение через этот же итератор, второго поиска нет
     // ------ сложность: logn
-    bool keyAvailable(std::string_view key) {
-        std::string skey = std::string(key);
-        auto now = static_cast<uint64_t>(clock_());
+    typename KVMap::iterator findAvailable(std::string_view key) {
+        auto it = kv_map_.find(key);
         // ключ существует вообще?
-        if (!mapContains(skey))
-            return false;
+        if (it == kv_map_.end())
+            return it;
+        // время смерти лежит и в самой записи (у ttl=0 это maxTime_), в сет за ним ходить незачем
+        return it->second.death_time > now_() ? it : kv_map_.end();
+    }
+};
+
+// ---------------- шардирование по диапазонам ключей ----------------
 
-        timedSetMember tmp = timedSetMember{skey, kv_map_[skey].death_time};
-        if (auto it = expiration_set_.find(tmp); it != expiration_set_.end()) {
-            return it->death_time > now;
+struct ShardingOptions {
+    // шард больше стольки записей делится пополам
+    size_t split_entries = 1 << 16;
+    // шард меньше стольки записей сливается с соседом, если вместе они не больше split_entries / 2
+    size_t merge_entries = 1 << 13;
+    // по скольким случайным ключам ищется середина куска при делении
+    uint32_t split_samples = 64;
+    // записей в куске шарда - это единица копирования при записи после clone(). Не больше split_entries / 2
+    size_t chunk_entries = 256;
+};
+
+// Хранилище из шардов, каждый владеет своим интервалом ключей [lower, upper), так что порядок
+// ключей сохраняется и скан трогает только шарды, которые пересекает. Шард, переросший split_entries,
+// делится по границе куска около середины, а маленькие соседи сливаются - прямо на той операции, что
+// перешла порог. Внутри шард - упорядоченные куски-KVStorage по chunk_entries записей (переросший кусок
+// делится по медиане случайной выборки), при делении и слиянии шардов куски переезжают целиком.
+// Потокобезопасно: каталог шардов под shared_mutex, каждый шард под своим mutex. Операция берет каталог
+// только чтобы найти шард и отпускает его до захвата шарда, так что деление/слияние блокирует только
+// свои шарды, а операция, которая ждала шард пока его делили, просто ищет шард заново.
+// getManySorted через несколько шардов не атомарен - каждый шард читается в своей критической секции.
+// Копия (clone() или конструктор копирования) делит с оригиналом все куски и стоит O(шарды + куски):
+// кусок копируется при первой записи в него с любой из сторон (copy-on-write), остальные остаются общими.
+template<typename Clock>
+class ShardedKVStorage {
+public:
+    explicit ShardedKVStorage(ShardingOptions options = ShardingOptions(), Clock clock = Clock())
+        : options_(options), clock_(clock) {
+        auto shard = std::make_shared<Shard>("", std::nullopt);
+        shard->chunks.emplace("", ChunkRef{std::make_shared<Chunk>(clock_), std::nullopt});
+        shards_.emplace("", std::move(shard));
+    }
+
+    // Снимок other: куски общие, пока в них не пишут. Каждый шард копируется под своим mutex,
+    // между шардами согласованность как у getManySorted.
+    // ------ сложность: шарды + куски
+    ShardedKVStorage(const ShardedKVStorage &other) : options_(other.options_), clock_(other.clock_) {
+        // под maintenance other не делится и не сливается, так что набор шардов не меняется
+        std::lock_guard maintenance(other.maintenance_mutex_);
+        for (auto &shard: other.snapshot_()) {
+            std::lock_guard lock(shard->mutex);
+            auto copy = std::make_shared<Shard>(shard->lower, shard->upper);
+            copy->chunks = shard->chunks;
+            copy->entries = shard->entries;
+            for (auto &[lower, ref]: copy->chunks) {
+                ref.chunk->owners.fetch_add(1);
+                if (ref.death)
+                    copy->deaths.emplace(*ref.death, &lower);
+            }
+            shards_.emplace(shard->lower, std::move(copy));
         }
+        shard_count_.store(shards_.size());
+    }
 
-        // ключ есть, в сете его нет значит ttl=0
-        return true;
+    ShardedKVStorage &operator=(const ShardedKVStorage &) = delete;
+
+    // копия на запись, см. конструктор копирования
+    // ------ сложность: шарды + куски
+    ShardedKVStorage clone() const {
+        return ShardedKVStorage(*this);
+    }
+
+    // ------ сложность: log(shards) + logn (+ кусок, если он общий с копией или делится; + n шарда, если он делится)
+    bool set(const std::string &key, const std::string &value, uint32_t ttl) {
+        return onShard_(key, [&](KVStorage<Clock> &store) { return store.set(key, value, ttl); });
+    }
+
+    // ------ сложность: log(shards) + logn (+ кусок, если он общий с копией)
+    bool remove(std::string_view key) {
+        return onShard_(key, [&](KVStorage<Clock> &store) { return store.remove(key); });
+    }
+
+    // ------ сложность: log(shards) + logn
+    std::optional<std::string> get(std::string_view key) {
+        // peek ничего не пишет в кусок, так что общий с копией читается как есть; пороги не проверяем
+        return onShard_(key, [&](KVStorage<Clock> &store) { return store.peek(key); }, false);
+    }
+
+    // ------ сложность: (затронутые шарды) * (log(shards) + logn) + затронутые куски + count
+    std::vector<std::pair<std::string, std::string> > getManySorted(std::string_view key, uint32_t count) {
+        std::vector<std::pair<std::string, std::string> > result;
+        std::string cursor(key);
+        while (count > 0) {
+            auto [shard, lock] = lockedShard_(cursor);
+            // все ключи следующих кусков больше cursor, так что каждый отдает записи с начала
+            for (auto it = chunkOf_(*shard, cursor); it != shard->chunks.end() && count > 0; ++it) {
+                auto part = it->second.chunk->store.getManySorted(cursor, count);
+                count -= static_cast<uint32_t>(part.size());
+                std::move(part.begin(), part.end(), std::back_inserter(result));
+            }
+            if (!shard->upper)
+                break;
+            cursor = *shard->upper;
+        }
+        return result;
+    }
+
+    // протухшая запись из первого шарда, где она есть
+    // ------ сложность: shards * log(куски) + logn (+ кусок, если он общий с копией)
+    std::optional<std::pair<std::string, std::string> > removeOneExpiredEntry() {
+        auto now = static_cast<uint64_t>(clock_());
+        for (auto &shard: snapshot_()) {
+            std::unique_lock lock(shard->mutex);
+            if (shard->deaths.empty() || shard->deaths.begin()->first > now || !owned_(shard))
+                continue;
+            auto it = shard->chunks.find(*shard->deaths.begin()->second);
+            auto expired = writeChunk_(*shard, it, [](KVStorage<Clock> &store) { return store.removeOneExpiredEntry(); });
+            size_t entries = shard->entries;
+            lock.unlock();
+            rebalance_(shard, entries);
+            if (expired)
+                return expired;
+        }
+        return std::nullopt;
+    }
+
+    // ------ сложность: shards
+    size_t size() const {
+        size_t total = 0;
+        for (auto &shard: snapshot_()) {
+            std::lock_guard lock(shard->mutex);
+            if (owned_(shard))
+                total += shard->entries;
+        }
+        return total;
+    }
+
+    size_t shardCount() const {
+        std::shared_lock lock(directory_mutex_);
+        return shards_.size();
+    }
+
+    // ------ сложность: shards
+    size_t chunkCount() const {
+        return sumChunks_([](const Chunk &) { return size_t{1}; }, false);
+    }
+
+    // сколько кусков все еще общие с копиями (или оригиналом)
+    // ------ сложность: шарды + куски
+    size_t sharedChunkCount() const {
+        return sumChunks_([](const Chunk &) { return size_t{1}; }, true);
+    }
+
+    // оценка памяти записей по всем кускам, как у KVStorage::memoryUsage
+    // ------ сложность: шарды + куски
+    size_t memoryUsage() const {
+        return sumChunks_([](const Chunk &chunk) { return chunk.store.memoryUsage(); }, false);
+    }
+
+    // из memoryUsage - то, что лежит в общих с копиями кусках. Остальное копия держит сама
+    // ------ сложность: шарды + куски
+    size_t sharedMemoryUsage() const {
+        return sumChunks_([](const Chunk &chunk) { return chunk.store.memoryUsage(); }, true);
+    }
+
+    // нижние границы шардов по возрастанию, первая всегда ""
+    std::vector<std::string> shardBoundaries() const {
+        std::shared_lock lock(directory_mutex_);
+        std::vector<std::string> result;
+        for (auto &[lower, shard]: shards_)
+            result.push_back(lower);
+        return result;
+    }
+
+    // Профиль блокировок (LockProfiler.h): каталог, maintenance и каждый шард, включая новые от деления.
+    // Счетчики шарда живут вместе с ним: после деления или слияния отсчет с нуля.
+    void enableLockProfiling(bool on = true) {
+        profiling_.store(on);
+        directory_mutex_.profile(on);
+        maintenance_mutex_.profile(on);
+        for (auto &shard: snapshot_())
+            shard->mutex.profile(on);
+    }
+
+    // Счетчики всех блокировок по убыванию суммарного ожидания - горячие шарды первыми.
+    // ------ сложность: shards * log(shards)
+    std::vector<LockReport> lockProfile() const {
+        std::vector<LockReport> result;
+        result.push_back(directory_mutex_.report("directory"));
+        result.push_back(maintenance_mutex_.report("maintenance"));
+        for (auto &shard: snapshot_())
+            result.push_back(shard->mutex.report("shard \"" + shard->lower + "\""));
+        std::stable_sort(result.begin(), result.end(),
+                         [](const LockReport &a, const LockReport &b) { return a.wait_ns > b.wait_ns; });
+        return result;
+    }
+
+    // проходит по всем шардам и делит/сливает тех, кто за порогами, пока кол-во шардов меняется
+    // ------ сложность: shards * (куски шарда) за проход
+    void rebalance() {
+        for (size_t before = 0; before != shardCount();) {
+            before = shardCount();
+            for (auto &shard: snapshot_()) {
+                std::unique_lock lock(shard->mutex);
+                if (!owned_(shard))
+                    continue;
+                size_t entries = shard->entries;
+                lock.unlock();
+                rebalance_(shard, entries);
+            }
+        }
+    }
+
+private:
+    using ShardMutex = ProfiledMutex<std::mutex>;
+
+    struct Chunk {
+        explicit Chunk(Clock clock) : store({}, clock) {
+        }
+
+        // личная копия общего куска
+        Chunk(const Chunk &other) : store(other.store) {
+        }
+
+        // сколько шардов (всех копий хранилища) держат кусок, больше 1 - менять нельзя
+        std::atomic<size_t> owners{1};
+        KVStorage<Clock> store;
+    };
+    using ChunkPtr = std::shared_ptr<Chunk>;
+
+    struct ChunkRef {
+        ChunkPtr chunk;
+        // ближайшее время смерти в куске, под которым он записан в Shard::deaths
+        std::optional<uint64_t> death;
+    };
+    // нижняя граница куска -> кусок, кусок владеет ключами до границы следующего
+    using ChunkMap = std::map<std::string, ChunkRef, std::less<> >;
+
+    struct Shard {
+        Shard(std::string lower_bound, std::optional<std::string> upper_bound)
+            : lower(std::move(lower_bound)), upper(std::move(upper_bound)) {
+        }
+
+        ~Shard() {
+            for (auto &[bound, ref]: chunks)
+                ref.chunk->owners.fetch_sub(1);
+        }
+
+        mutable ShardMutex mutex;
+        const std::string lower;
+        // дальше все под mutex
+        std::optional<std::string> upper;  // nullopt - до бесконечности
+        // первый кусок всегда с границей lower, даже пустой
+        ChunkMap chunks;
+        // (ближайшее время смерти, граница куска) для кусков с ttl-записями - откуда брать протухшие.
+        // Граница - ключ узла chunks: узел не переезжает и при переносе в другой шард (extract/insert)
+        std::set<std::pair<uint64_t, const std::string *> > deaths;
+        size_t entries = 0;
+    };
+    using ShardPtr = std::shared_ptr<Shard>;
+
+    // шард, чей интервал содержит key (по каталогу, без захвата самого шарда)
+    ShardPtr findShard_(std::string_view key) const {
+        std::shared_lock lock(directory_mutex_);
+        return std::prev(shards_.upper_bound(key))->second;
+    }
+
+    // шард все еще наш: его не поделили и не слили
+    bool owned_(const ShardPtr &shard) const {
+        return findShard_(shard->lower) == shard;
+    }
+
+    // захваченный шард, который точно содержит key: пока мы ждали, его могли поделить или слить.
+    // Каталог при этом берем уже под шардом - наоборот никто не делает, так что без deadlock
+    std::pair<ShardPtr, std::unique_lock<ShardMutex> > lockedShard_(std::string_view key) const {
+        for (;;) {
+            auto shard = findShard_(key);
+            std::unique_lock lock(shard->mutex);
+            if (findShard_(key) == shard)
+                return {std::move(shard), std::move(lock)};
+        }
+    }
+
+    // кусок захваченного шарда, куда попадает key
+    static typename ChunkMap::iterator chunkOf_(Shard &shard, std::string_view key) {
+        return std::prev(shard.chunks.upper_bound(key));
+    }
+
+    template<typename Fn>
+    auto onShard_(std::string_view key, Fn &&fn, bool writes = true) {
+        auto [shard, lock] = lockedShard_(key);
+        auto it = chunkOf_(*shard, key);
+        if (!writes)
+            return fn(it->second.chunk->store);
+        auto result = writeChunk_(*shard, it, fn);
+        size_t entries = shard->entries;
+        lock.unlock();
+        rebalance_(shard, entries);
+        return result;
+    }
+
+    // запись в кусок захваченного шарда: общий сначала подменяем личной копией. Счетчик владельцев
+    // старого уменьшаем только после копирования - до этого другая сторона его не тронет
+    // ------ сложность: запись (+ кусок, если он общий)
+    template<typename Fn>
+    auto writeChunk_(Shard &shard, typename ChunkMap::iterator it, Fn &&fn) {
+        auto &ref = it->second;
+        if (ref.chunk->owners.load() > 1) {
+            auto own = std::make_shared<Chunk>(*ref.chunk);
+            ref.chunk->owners.fetch_sub(1);
+            ref.chunk = std::move(own);
+        }
+        size_t before = ref.chunk->store.size();
+        auto result = fn(ref.chunk->store);
+        shard.entries = shard.entries - before + ref.chunk->store.size();
+        tidyChunk_(shard, it);
+        return result;
+    }
+
+    size_t chunkLimit_() const {
+        return std::clamp<size_t>(options_.chunk_entries, 2, std::max<size_t>(options_.split_entries / 2, 2));
+    }
+
+    // после записи в личный кусок: переросший делится по медиане выборки, маленький забирает правого
+    // соседа (если тот тоже личный), пустой исчезает (кроме первого - его граница совпадает с шардом)
+    // ------ сложность: кусок
+    void tidyChunk_(Shard &shard, typename ChunkMap::iterator it) {
+        auto &store = it->second.chunk->store;
+        size_t limit = chunkLimit_();
+        if (store.size() > limit) {
+            auto sample = store.sample(options_.split_samples);
+            if (sample.size() >= 2) {
+                std::vector<std::string> keys;
+                for (auto &[key, value]: sample)
+                    keys.push_back(std::move(key));
+                std::nth_element(keys.begin(), keys.begin() + keys.size() / 2, keys.end());
+                std::string middle = std::move(keys[keys.size() / 2]);
+                auto next = std::next(it);
+                auto chunk = std::make_shared<Chunk>(clock_);
+                chunk->store.insertRange(next == shard.chunks.end()
+                                             ? store.extractRange(middle)
+                                             : store.extractRange(middle, std::string_view(next->first)));
+                auto added = shard.chunks.emplace(std::move(middle), ChunkRef{std::move(chunk), std::nullopt}).first;
+                noteDeath_(shard, added);
+            }
+        } else if (store.size() < limit / 4) {
+            auto next = std::next(it);
+            if (next != shard.chunks.end() && next->second.chunk->owners.load() == 1
+                && store.size() + next->second.chunk->store.size() <= limit / 2) {
+                store.insertRange(next->second.chunk->store.extractRange(""));
+                forgetDeath_(shard, next);
+                shard.chunks.erase(next);
+            } else if (store.size() == 0 && it != shard.chunks.begin()) {
+                forgetDeath_(shard, it);
+                shard.chunks.erase(it);
+                return;
+            }
+        }
+        noteDeath_(shard, it);
+    }
+
+    // перезаписать кусок в Shard::deaths под его текущим ближайшим временем смерти
+    // ------ сложность: log(куски)
+    static void noteDeath_(Shard &shard, typename ChunkMap::iterator it) {
+        auto next = it->second.chunk->store.nextDeathTime();
+        if (next == it->second.death)
+            return;
+        forgetDeath_(shard, it);
+        if (next)
+            shard.deaths.emplace(*next, &it->first);
+        it->second.death = next;
+    }
+
+    static void forgetDeath_(Shard &shard, typename ChunkMap::iterator it) {
+        if (it->second.death)
+            shard.deaths.erase({*it->second.death, &it->first});
+        it->second.death.reset();
+    }
+
+    // сумма fn по кускам (только общим, если shared_only)
+    template<typename Fn>
+    size_t sumChunks_(Fn &&fn, bool shared_only) const {
+        size_t total = 0;
+        for (auto &shard: snapshot_()) {
+            std::lock_guard lock(shard->mutex);
+            if (!owned_(shard))
+                continue;
+            for (auto &[bound, ref]: shard->chunks) {
+                if (!shared_only || ref.chunk->owners.load() > 1)
+                    total += fn(*ref.chunk);
+            }
+        }
+        return total;
+    }
+
+    std::vector<ShardPtr> snapshot_() const {
+        std::shared_lock lock(directory_mutex_);
+        std::vector<ShardPtr> result;
+        for (auto &[lower, shard]: shards_)
+            result.push_back(shard);
+        return result;
     }
+
+    // дешевая проверка порогов на каждой операции, сама перестройка - только если никто другой ей не занят
+    void rebalance_(const ShardPtr &shard, size_t entries) {
+        bool split = entries > options_.split_entries;
+        bool merge = entries < options_.merge_entries && shard_count_.load(std::memory_order_relaxed) > 1;
+        if (!split && !merge)
+            return;
+        std::unique_lock maintenance(maintenance_mutex_, std::try_to_lock);
+        if (!maintenance.owns_lock())
+            return;
+        if (split)
+            split_(shard);
+        else
+            merge_(shard);
+    }
+
+    // куски из [from, end) шарда from_shard переезжают в to_shard вместе с отметками о времени смерти
+    // ------ сложность: переезжающие куски * log(куски)
+    static void moveChunks_(Shard &from_shard, typename ChunkMap::iterator from, Shard &to_shard) {
+        while (from != from_shard.chunks.end()) {
+            auto node = from_shard.chunks.extract(from++);
+            if (auto death = node.mapped().death) {
+                from_shard.deaths.erase({*death, &node.key()});
+                to_shard.deaths.emplace(*death, &node.key());
+            }
+            to_shard.entries += node.mapped().chunk->store.size();
+            from_shard.entries -= node.mapped().chunk->store.size();
+            to_shard.chunks.insert(std::move(node));
+        }
+    }
+
+    // делит по границе куска, на которой набирается половина записей. Записи не трогаются,
+    // так что делятся и шарды с общими кусками
+    // ------ сложность: куски шарда * log(куски)
+    void split_(const ShardPtr &shard) {
+        std::lock_guard lock(shard->mutex);
+        if (!owned_(shard) || shard->entries <= options_.split_entries || shard->chunks.size() < 2)
+            return;
+        auto middle = std::next(shard->chunks.begin());
+        for (size_t below = shard->chunks.begin()->second.chunk->store.size();
+             std::next(middle) != shard->chunks.end() && below < shard->entries / 2; ++middle)
+            below += middle->second.chunk->store.size();
+
+        auto upper = std::make_shared<Shard>(middle->first, shard->upper);
+        upper->mutex.profile(profiling_.load(std::memory_order_relaxed));
+        moveChunks_(*shard, middle, *upper);
+        shard->upper = upper->lower;
+        // публикуем пока держим старый шард: кто придет за верхней половиной, дождется и перечитает каталог
+        std::unique_lock directory(directory_mutex_);
+        shards_.emplace(upper->lower, std::move(upper));
+        shard_count_.store(shards_.size(), std::memory_order_relaxed);
+    }
+
+    // сливает шард с правым соседом, а если его нет - с левым
+    // ------ сложность: куски шардов * log(куски)
+    void merge_(const ShardPtr &shard) {
+        ShardPtr left, right;
+        {
+            std::shared_lock directory(directory_mutex_);
+            auto it = shards_.find(shard->lower);
+            if (it == shards_.end() || it->second != shard)
+                return;
+            if (std::next(it) != shards_.end()) {
+                left = shard;
+                right = std::next(it)->second;
+            } else if (it != shards_.begin()) {
+                left = std::prev(it)->second;
+                right = shard;
+            } else {
+                return;
+            }
+        }
+        // scoped_lock берет оба без deadlock, других владельцев двух шардов сразу нет
+        std::scoped_lock lock(left->mutex, right->mutex);
+        if (!owned_(left) || !owned_(right) || left->upper != std::optional<std::string>(right->lower))
+            return;
+        if (left->entries + right->entries > options_.split_entries / 2)
+            return;
+        moveChunks_(*right, right->chunks.begin(), *left);
+        left->upper = right->upper;
+        std::unique_lock directory(directory_mutex_);
+        shards_.erase(right->lower);
+        shard_count_.store(shards_.size(), std::memory_order_relaxed);
+    }
+
+    ShardingOptions options_;
+    Clock clock_;
+    // нижняя граница -> шард
+    std::map<std::string, ShardPtr, std::less<> > shards_;
+    mutable ProfiledMutex<std::shared_mutex> directory_mutex_;
+    // деление/слияние идут по одному, копирование хранилища ждет их
+    mutable ProfiledMutex<std::mutex> maintenance_mutex_;
+    std::atomic<size_t> shard_count_{1};
+    // включен ли профиль блокировок - для шардов, которые появятся позже
+    std::atomic<bool> profiling_{false};
 };
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// ---------------- шаблоны ключей в стиле KEYS ----------------
+//
+// Синтаксис как у redis: * - любая строка, ? - любой байт, [abc] / [a-z] / [^a] - класс,
+// \x - байт x как есть. Шаблон разбирается один раз: литеральный префикс до первого
+// спецсимвола уходит в поиск по упорядоченному индексу, остаток - в список токенов.
+
+class KeyPattern {
+public:
+    explicit KeyPattern(std::string_view glob) {
+        size_t i = 0;
+        // префикс: литералы до первого спецсимвола
+        for (; i < glob.size(); ++i) {
+            char c = glob[i];
+            if (c == '*' || c == '?' || (c == '[' && classEnd(glob, i)))
+                break;
+            if (c == '\\' && i + 1 < glob.size())
+                c = glob[++i];
+            prefix_ += c;
+        }
+        while (i < glob.size()) {
+            char c = glob[i];
+            Token token;
+            if (c == '*') {
+                token.kind = Token::Star;
+                // подряд идущие звезды ничего не добавляют
+                if (!tokens_.empty() && tokens_.back().kind == Token::Star) {
+                    ++i;
+                    continue;
+                }
+                ++i;
+            } else if (c == '?') {
+                token.kind = Token::Any;
+                ++i;
+            } else if (c == '[' && classEnd(glob, i)) {
+                size_t end = *classEnd(glob, i);
+                token.kind = Token::Class;
+                token.set = parseClass(glob.substr(i + 1, end - i - 1));
+                i = end + 1;
+            } else {
+                if (c == '\\' && i + 1 < glob.size())
+                    c = glob[++i];
+                token.kind = Token::Literal;
+                token.byte = static_cast<unsigned char>(c);
+                ++i;
+            }
+            tokens_.push_back(token);
+        }
+    }
+
+    // с чего начинаются все подходящие ключи
+    const std::string &prefix() const { return prefix_; }
+
+    // первый ключ после всех, начинающихся с prefix; nullopt - таких нет (префикс пуст или из одних 0xff)
+    std::optional<std::string> prefixEnd() const {
+        std::string end = prefix_;
+        while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xff)
+            end.pop_back();
+        if (end.empty())
+            return std::nullopt;
+        end.back() = static_cast<char>(static_cast<unsigned char>(end.back()) + 1);
+        return end;
+    }
+
+    // шаблон без спецсимволов - ровно один ключ
+    bool literal() const { return tokens_.empty(); }
+
+    // ------ сложность: длина ключа * число звезд в худшем случае, обычно длина ключа
+    bool matches(std::string_view key) const {
+        if (key.substr(0, prefix_.size()) != prefix_)
+            return false;
+        return matchTail(key.substr(prefix_.size()));
+    }
+
+    // ключ, про который уже известно, что он начинается с prefix()
+    // ------ сложность: как у matches
+    bool matchTail(std::string_view tail) const {
+        // жадно, с откатом к последней звезде: она забирает на байт больше
+        size_t t = 0, k = 0;
+        size_t star = SIZE_MAX, star_k = 0;
+        while (k < tail.size()) {
+            if (t < tokens_.size() && tokens_[t].kind == Token::Star) {
+                star = t++;
+                star_k = k;
+            } else if (t < tokens_.size() && tokens_[t].accepts(static_cast<unsigned char>(tail[k]))) {
+                ++t;
+                ++k;
+            } else if (star != SIZE_MAX) {
+                t = star + 1;
+                k = ++star_k;
+            } else {
+                return false;
+            }
+        }
+        while (t < tokens_.size() && tokens_[t].kind == Token::Star)
+            ++t;
+        return t == tokens_.size();
+    }
+
+private:
+    struct Token {
+        enum Kind : uint8_t { Literal, Any, Class, Star } kind = Literal;
+        unsigned char byte = 0;
+        std::bitset<256> set;
+
+        bool accepts(unsigned char c) const {
+            switch (kind) {
+                case Literal: return c == byte;
+                case Any: return true;
+                case Class: return set.test(c);
+                default: return false;
+            }
+        }
+    };
+
+    // позиция закрывающей ] для класса, открытого в i; без нее [ - обычный байт
+    static std::optional<size_t> classEnd(std::string_view glob, size_t i) {
+        size_t j = i + 1;
+        if (j < glob.size() && glob[j] == '^')
+            ++j;
+        for (; j < glob.size(); ++j) {
+            if (glob[j] == '\\')
+                ++j;
+            else if (glob[j] == ']')
+                return j;
+        }
+        return std::nullopt;
+    }
+
+    static std::bitset<256> parseClass(std::string_view body) {
+        std::bitset<256> set;
+        bool negate = !body.empty() && body[0] == '^';
+        if (negate)
+            body.remove_prefix(1);
+        for (size_t i = 0; i < body.size(); ++i) {
+            unsigned char from = static_cast<unsigned char>(body[i]);
+            if (body[i] == '\\' && i + 1 < body.size())
+                from = static_cast<unsigned char>(body[++i]);
+            unsigned char to = from;
+            if (i + 2 < body.size() && body[i + 1] == '-') {
+                i += 2;
+                to = static_cast<unsigned char>(body[i]);
+                if (body[i] == '\\' && i + 1 < body.size())
+                    to = static_cast<unsigned char>(body[++i]);
+                if (from > to)
+                    std::swap(from, to);
+            }
+            for (unsigned c = from; c <= to; ++c)
+                set.set(c);
+        }
+        return negate ? ~set : set;
+    }
+
+    std::string prefix_;
+    std::vector<Token> tokens_;
+};
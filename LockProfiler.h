@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// ---------------- профилировщик блокировок ----------------
+//
+// ProfiledMutex - обертка над мьютексом с тем же интерфейсом (unique_lock, lock_guard, scoped_lock,
+// shared_lock работают как раньше). Выключенный стоит одну relaxed-загрузку флага на lock/unlock.
+// Включенный сначала пробует try_lock и засекает время только если пришлось ждать, а время удержания -
+// от захвата до unlock. Для разделяемых захватов считается только ожидание: удержание у них не одно.
+
+// счетчики одной блокировки, обновляются без захвата
+struct LockStats {
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};     // захватов, которым пришлось ждать
+    std::atomic<uint64_t> wait_ns{0};
+    std::atomic<uint64_t> hold_ns{0};       // только для исключительных захватов
+    std::atomic<uint64_t> max_wait_ns{0};
+};
+
+// снимок LockStats с именем блокировки
+struct LockReport {
+    std::string name;
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    uint64_t wait_ns = 0;
+    uint64_t hold_ns = 0;
+    uint64_t max_wait_ns = 0;
+};
+
+template<typename Mutex>
+class ProfiledMutex {
+public:
+    void lock() {
+        if (!enabled_.load(std::memory_order_relaxed)) {
+            mutex_.lock();
+            return;
+        }
+        waitFor_([&] { return mutex_.try_lock(); }, [&] { mutex_.lock(); });
+        locked_at_ = now_();
+    }
+
+    bool try_lock() {
+        if (!mutex_.try_lock())
+            return false;
+        if (enabled_.load(std::memory_order_relaxed)) {
+            stats_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+            locked_at_ = now_();
+        }
+        return true;
+    }
+
+    void unlock() {
+        // locked_at_ пишется и читается только владельцем, 0 - захватили при выключенном профиле
+        if (locked_at_ != 0) {
+            stats_.hold_ns.fetch_add(now_() - locked_at_, std::memory_order_relaxed);
+            locked_at_ = 0;
+        }
+        mutex_.unlock();
+    }
+
+    void lock_shared() requires requires(Mutex &m) { m.lock_shared(); } {
+        if (!enabled_.load(std::memory_order_relaxed)) {
+            mutex_.lock_shared();
+            return;
+        }
+        waitFor_([&] { return mutex_.try_lock_shared(); }, [&] { mutex_.lock_shared(); });
+    }
+
+    bool try_lock_shared() requires requires(Mutex &m) { m.try_lock_shared(); } {
+        return mutex_.try_lock_shared();
+    }
+
+    void unlock_shared() requires requires(Mutex &m) { m.unlock_shared(); } {
+        mutex_.unlock_shared();
+    }
+
+    void profile(bool on) { enabled_.store(on, std::memory_order_relaxed); }
+    bool profiled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    LockReport report(std::string name) const {
+        return LockReport{std::move(name),
+                          stats_.acquisitions.load(std::memory_order_relaxed),
+                          stats_.contended.load(std::memory_order_relaxed),
+                          stats_.wait_ns.load(std::memory_order_relaxed),
+                          stats_.hold_ns.load(std::memory_order_relaxed),
+                          stats_.max_wait_ns.load(std::memory_order_relaxed)};
+    }
+
+private:
+    static uint64_t now_() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // без очереди захват бесплатный, иначе ждем и считаем сколько
+    template<typename TryLock, typename Lock>
+    void waitFor_(TryLock &&try_lock, Lock &&lock) {
+        stats_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (try_lock())
+            return;
+        uint64_t start = now_();
+        lock();
+        uint64_t waited = now_() - start;
+        stats_.contended.fetch_add(1, std::memory_order_relaxed);
+        stats_.wait_ns.fetch_add(waited, std::memory_order_relaxed);
+        uint64_t max = stats_.max_wait_ns.load(std::memory_order_relaxed);
+        while (waited > max && !stats_.max_wait_ns.compare_exchange_weak(max, waited, std::memory_order_relaxed)) {
+        }
+    }
+
+    Mutex mutex_;
+    std::atomic<bool> enabled_{false};
+    uint64_t locked_at_ = 0;
+    LockStats stats_;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+
+// ---------------- подстройка под лимит памяти cgroup v2 ----------------
+
+struct GovernorOptions {
+    // каталог cgroup с memory.current / memory.max / memory.pressure
+    std::filesystem::path cgroup_dir = "/sys/fs/cgroup";
+    // до какой доли memory.max держим cgroup в спокойном состоянии
+    double target_fraction = 0.85;
+    // PSI "some avg10" (в процентах), начиная с которого считаем что память под давлением
+    double pressure_threshold = 10.0;
+    // под давлением цель опускается на столько долей за каждые pressure_threshold процентов
+    double pressure_backoff = 0.05;
+    // ниже этой доли цель не опускается
+    double min_target_fraction = 0.5;
+    // хранилище не ужимается меньше этого (0 - можно ужать до пустого)
+    size_t min_store_bytes = 0;
+    // сколько протухших вычищать за poll в спокойном состоянии, под давлением удваивается
+    size_t min_reap_per_poll = 64;
+    size_t max_reap_per_poll = 1 << 20;
+};
+
+struct GovernorReport {
+    bool available = false;       // файлы cgroup прочитались
+    uint64_t current = 0;         // memory.current
+    uint64_t max = 0;             // memory.max, 0 - "max" (без лимита)
+    double pressure_avg10 = 0;    // PSI some avg10
+    uint64_t target = 0;          // куда governor хочет держать memory.current
+    size_t store_limit = 0;       // выставленный хранилищу лимит
+    size_t reaped = 0;            // вычищено протухших за poll
+    size_t evicted = 0;           // вытеснено живых за poll
+
+    // какая доля memory.max занята
+    double usage() const { return max == 0 ? 0 : static_cast<double>(current) / static_cast<double>(max); }
+};
+
+// Периодически (poll) читает состояние cgroup и подстраивает хранилище:
+// лимит памяти хранилища = его текущий размер + (цель - memory.current), так что
+// чужая память процесса тоже учитывается. Под давлением (PSI) цель опускается,
+// а вычистка протухших становится агрессивнее.
+class MemoryGovernor {
+public:
+    explicit MemoryGovernor(GovernorOptions options = GovernorOptions()) : options_(std::move(options)),
+                                                                         reap_budget_(options_.min_reap_per_poll) {
+    }
+
+    // каталог cgroup текущего процесса по /proc/self/cgroup (строка "0::/path" в cgroup v2)
+    static std::optional<std::filesystem::path> detectCgroupDir() {
+        std::ifstream in("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.rfind("0::", 0) == 0)
+                return std::filesystem::path("/sys/fs/cgroup") / std::filesystem::path(line.substr(3)).relative_path();
+        }
+        return std::nullopt;
+    }
+
+    // ------ сложность: logn на каждую вычищенную/вытесненную запись
+    template<typename Storage>
+    GovernorReport poll(Storage &store) {
+        GovernorReport report;
+        auto current = readNumber("memory.current");
+        if (!current)
+            return report;
+        report.available = true;
+        report.current = *current;
+        report.max = readMax().value_or(0);
+        report.pressure_avg10 = readPressure().value_or(0);
+
+        bool pressured = report.pressure_avg10 >= options_.pressure_threshold;
+        if (report.max == 0) {
+            // лимита нет - только обычная вычистка
+            report.reaped = store.reapExpired(options_.min_reap_per_poll);
+            return report;
+        }
+
+        double fraction = options_.target_fraction;
+        if (pressured) {
+            fraction -= options_.pressure_backoff * (report.pressure_avg10 / options_.pressure_threshold);
+            fraction = std::max(fraction, options_.min_target_fraction);
+        }
+        report.target = static_cast<uint64_t>(fraction * static_cast<double>(report.max));
+
+        // протухшие - самое дешевое что можно отдать, аппетит растет пока не отпустит
+        bool over = report.current > report.target;
+        reap_budget_ = (over || pressured)
+                           ? std::min(reap_budget_ * 2, options_.max_reap_per_poll)
+                           : std::max(reap_budget_ / 2, options_.min_reap_per_poll);
+        size_t before = store.memoryUsage();
+        report.reaped = store.reapExpired(reap_budget_);
+        uint64_t freed = before - store.memoryUsage();
+        uint64_t current_after = report.current > freed ? report.current - freed : 0;
+
+        // лимит хранилищу: сколько у него есть плюс сколько еще можно (или минус сколько надо отдать)
+        size_t store_now = store.memoryUsage();
+        int64_t slack = static_cast<int64_t>(report.target) - static_cast<int64_t>(current_after);
+        int64_t limit = static_cast<int64_t>(store_now) + slack;
+        limit = std::max<int64_t>(limit, static_cast<int64_t>(options_.min_store_bytes));
+        // 0 у хранилища означает "без лимита", так что ужимаем максимум до одного байта
+        report.store_limit = static_cast<size_t>(std::max<int64_t>(limit, 1));
+
+        size_t entries_before = store.size();
+        store.setMemoryLimit(report.store_limit, store.evictionPolicy());
+        report.evicted = entries_before - store.size();
+        return report;
+    }
+
+private:
+    std::optional<std::string> readFile(const char *name) const {
+        std::ifstream in(options_.cgroup_dir / name);
+        if (!in)
+            return std::nullopt;
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        return buffer.str();
+    }
+
+    std::optional<uint64_t> readNumber(const char *name) const {
+        auto text = readFile(name);
+        if (!text)
+            return std::nullopt;
+        try {
+            return std::stoull(*text);
+        } catch (const std::exception &) {
+            return std::nullopt;
+        }
+    }
+
+    // "max" значит без лимита
+    std::optional<uint64_t> readMax() const {
+        auto text = readFile("memory.max");
+        if (!text || text->rfind("max", 0) == 0)
+            return std::nullopt;
+        return readNumber("memory.max");
+    }
+
+    // формат: "some avg10=1.23 avg60=... avg300=... total=...\nfull avg10=..."
+    std::optional<double> readPressure() const {
+        auto text = readFile("memory.pressure");
+        if (!text)
+            return std::nullopt;
+        auto pos = text->find("some avg10=");
+        if (pos == std::string::npos)
+            return std::nullopt;
+        try {
+            return std::stod(text->substr(pos + 11));
+        } catch (const std::exception &) {
+            return std::nullopt;
+        }
+    }
+
+    GovernorOptions options_;
+    size_t reap_budget_;
+};
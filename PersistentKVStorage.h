@@ -0,0 +1,554 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---------------- хранилище целиком в mmap-файле ----------------
+//
+// Все узлы индекса, ключи и значения лежат в файле, ссылки между ними - смещения от начала файла,
+// поэтому файл можно отобразить по любому адресу и сразу работать. Индекс - skip list по ключу,
+// у каждого узла вторая башня для списка по времени смерти (только для записей с ttl).
+//
+// Согласованность: истиной считается нижний уровень списка по ключу и ссылка узла на блок значения.
+// Оба меняются одной выровненной 8-байтной записью после того, как все что на них ссылается уже
+// записано. Верхние уровни, список по времени смерти и списки свободных блоков - производные:
+// если файл закрыли не чисто (флаг clean в заголовке), при открытии они пересобираются одним
+// проходом по нижнему уровню, а недостижимые блоки возвращаются в свободные. После чистого
+// закрытия открытие - это только mmap.
+// При Durability::PerWrite те же шаги разделяются msync, что дает ту же гарантию и при падении ОС.
+
+enum class Durability {
+    // порядок записи соблюдается, на диск сбрасывает ОС (или sync()). Переживает падение процесса
+    None,
+    // msync после каждого шага публикации, переживает падение машины. Медленно
+    PerWrite
+};
+
+struct PersistentOptions {
+    // начальный размер файла, дальше растет удвоением
+    size_t initial_size = 1 << 20;
+    Durability durability = Durability::None;
+};
+
+template<typename Clock>
+class PersistentKVStorage {
+public:
+    // Открывает (или создает) файл хранилища. Ошибки ввода-вывода и чужой формат - std::runtime_error.
+    explicit PersistentKVStorage(const std::filesystem::path &path, Clock clock = Clock(),
+                                 PersistentOptions options = PersistentOptions())
+        : clock_(clock), options_(options) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0)
+            throw std::runtime_error("PersistentKVStorage: can't open " + path.string());
+        struct stat st{};
+        if (::fstat(fd_, &st) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("PersistentKVStorage: can't stat " + path.string());
+        }
+
+        try {
+            if (st.st_size == 0) {
+                create(std::max<size_t>(options_.initial_size, heapStart_ + (1 << 12)));
+            } else {
+                map(static_cast<size_t>(st.st_size));
+                if (header()->magic != magic_ || header()->version != version_)
+                    throw std::runtime_error("PersistentKVStorage: " + path.string() + " is not a storage file");
+                if (header()->clean == 0) {
+                    recover();
+                    recovered_ = true;
+                }
+            }
+        } catch (...) {
+            if (base_)
+                ::munmap(base_, mapped_);
+            ::close(fd_);
+            throw;
+        }
+        // с этого момента файл считается открытым на запись: падение будет видно при следующем открытии
+        header()->clean = 0;
+        syncRange(0, sizeof(FileHeader));
+    }
+
+    PersistentKVStorage(const PersistentKVStorage &) = delete;
+    PersistentKVStorage &operator=(const PersistentKVStorage &) = delete;
+
+    // чистое закрытие: все на диск, потом флаг clean
+    ~PersistentKVStorage() {
+        ::msync(base_, mapped_, MS_SYNC);
+        header()->clean = 1;
+        ::msync(base_, sizeof(FileHeader), MS_SYNC);
+        ::munmap(base_, mapped_);
+        ::close(fd_);
+    }
+
+    // Семантика как у KVStorage::set: ttl == 0 - бесконечность.
+    // ------ сложность: logn
+    void set(std::string_view key, std::string_view value, uint32_t ttl) {
+        uint64_t dt = (ttl == 0) ? maxTime_ : static_cast<uint64_t>(ttl) + static_cast<uint64_t>(clock_());
+        uint64_t preds[maxHeight_];
+        uint64_t found = findKey(key, preds);
+
+        // значение пишется целиком до того, как на него сошлются
+        uint64_t value_off = allocate(sizeof(ValueBlock) + value.size());
+        auto *block = valueAt(value_off);
+        block->death_time = dt;
+        block->size = value.size();
+        std::memcpy(block->data(), value.data(), value.size());
+        syncBlock(value_off);
+
+        if (found != 0) {
+            uint64_t old_value = node(found)->value_off;
+            uint64_t old_dt = valueAt(old_value)->death_time;
+            if (old_dt != maxTime_)
+                unlinkExpiry(found, old_dt, key);
+            publish(&node(found)->value_off, value_off);
+            syncBlock(found);
+            if (dt != maxTime_)
+                linkExpiry(found, dt, key);
+            release(old_value);
+            return;
+        }
+
+        uint16_t height = randomHeight();
+        uint64_t node_off = allocate(nodeSize(height, key.size()));
+        auto *n = node(node_off);
+        n->value_off = value_off;
+        n->key_len = static_cast<uint32_t>(key.size());
+        n->height = height;
+        for (uint16_t lvl = 0; lvl < height; ++lvl) {
+            next(node_off)[lvl] = next(preds[lvl])[lvl];
+            expNext(node_off)[lvl] = 0;
+        }
+        std::memcpy(keyData(node_off), key.data(), key.size());
+        syncBlock(node_off);
+
+        // публикация: нижний уровень одной записью, остальное - подсказки для поиска
+        publish(&next(preds[0])[0], node_off);
+        syncBlock(preds[0]);
+        for (uint16_t lvl = 1; lvl < height; ++lvl)
+            next(preds[lvl])[lvl] = node_off;
+        if (dt != maxTime_)
+            linkExpiry(node_off, dt, key);
+        ++header()->entries;
+    }
+
+    // ------ сложность: logn
+    bool remove(std::string_view key) {
+        uint64_t preds[maxHeight_];
+        uint64_t found = findKey(key, preds);
+        if (found == 0)
+            return false;
+        eraseNode(found, preds);
+        return true;
+    }
+
+    // ------ сложность: logn
+    std::optional<std::string> get(std::string_view key) {
+        auto view = getView(key);
+        if (!view)
+            return std::nullopt;
+        return std::string(*view);
+    }
+
+    // Значение без копирования, прямо из отображенного файла.
+    // Действительно до следующего изменения хранилища (файл может переотобразиться при росте).
+    // ------ сложность: logn
+    std::optional<std::string_view> getView(std::string_view key) {
+        uint64_t preds[maxHeight_];
+        uint64_t found = findKey(key, preds);
+        if (found == 0)
+            return std::nullopt;
+        auto *block = valueAt(node(found)->value_off);
+        if (!alive(block->death_time, static_cast<uint64_t>(clock_())))
+            return std::nullopt;
+        return std::string_view(block->data(), block->size);
+    }
+
+    // ------ сложность: logn + count
+    std::vector<std::pair<std::string, std::string> > getManySorted(std::string_view key, uint32_t count) {
+        std::vector<std::pair<std::string, std::string> > result{};
+        if (count == 0)
+            return result;
+        uint64_t preds[maxHeight_];
+        findKey(key, preds);
+        auto now = static_cast<uint64_t>(clock_());
+        for (uint64_t off = next(preds[0])[0]; off != 0 && result.size() < count; off = next(off)[0]) {
+            auto *block = valueAt(node(off)->value_off);
+            if (!alive(block->death_time, now))
+                continue;
+            result.emplace_back(std::string(keyOf(off)), std::string(block->data(), block->size));
+        }
+        return result;
+    }
+
+    // ------ сложность: logn
+    std::optional<std::pair<std::string, std::string> > removeOneExpiredEntry() {
+        uint64_t first = expNext(header()->head)[0];
+        if (first == 0)
+            return std::nullopt;
+        auto *block = valueAt(node(first)->value_off);
+        if (block->death_time > static_cast<uint64_t>(clock_()))
+            return std::nullopt;
+        auto removed = std::pair<std::string, std::string>{std::string(keyOf(first)),
+                                                           std::string(block->data(), block->size)};
+        remove(removed.first);
+        return std::make_optional(removed);
+    }
+
+    // кол-во записей, включая протухшие
+    size_t size() const {
+        return header()->entries;
+    }
+
+    // размер файла
+    size_t fileSize() const {
+        return mapped_;
+    }
+
+    // сбросить все на диск, не закрывая
+    void sync() {
+        ::msync(base_, mapped_, MS_SYNC);
+    }
+
+    // true если при открытии файл оказался закрыт не чисто и пришлось восстанавливаться
+    bool recovered() const {
+        return recovered_;
+    }
+
+private:
+    static constexpr uint64_t magic_ = 0x3145524f5453564bULL;  // "KVSTORE1"
+    static constexpr uint32_t version_ = 1;
+    static constexpr uint16_t maxHeight_ = 16;
+    static constexpr size_t heapStart_ = 4096;
+    static constexpr uint32_t minClass_ = 5;  // блоки от 32 байт
+    static constexpr uint32_t classCount_ = 48;
+    static constexpr uint64_t maxTime_ = std::numeric_limits<uint64_t>::max();
+
+    struct FileHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t clean;
+        uint64_t heap_top;
+        uint64_t head;  // узел-страж высоты maxHeight_
+        uint64_t entries;
+        uint64_t free_heads[classCount_];
+    };
+    static_assert(sizeof(FileHeader) <= heapStart_);
+
+    // перед каждым блоком - его класс размера (блок занимает 2^size_class байт вместе с заголовком)
+    struct BlockHeader {
+        uint32_t size_class;
+        uint32_t used;
+    };
+
+    struct NodeHeader {
+        uint64_t value_off;
+        uint32_t key_len;
+        uint16_t height;
+        uint16_t reserved;
+        // дальше next[height], exp_next[height], байты ключа
+    };
+
+    struct ValueBlock {
+        uint64_t death_time;
+        uint64_t size;
+        char *data() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    // ---------- отображение файла ----------
+
+    void create(size_t size) {
+        if (::ftruncate(fd_, static_cast<off_t>(size)) != 0)
+            throw std::runtime_error("PersistentKVStorage: can't size file");
+        map(size);
+        auto *h = header();
+        std::memset(h, 0, sizeof(FileHeader));
+        h->magic = magic_;
+        h->version = version_;
+        h->heap_top = heapStart_;
+        h->head = allocate(nodeSize(maxHeight_, 0));
+        auto *head = node(h->head);
+        head->value_off = 0;
+        head->key_len = 0;
+        head->height = maxHeight_;
+        for (uint16_t lvl = 0; lvl < maxHeight_; ++lvl)
+            next(h->head)[lvl] = expNext(h->head)[lvl] = 0;
+    }
+
+    void map(size_t size) {
+        void *addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("PersistentKVStorage: mmap failed");
+        base_ = static_cast<char *>(addr);
+        mapped_ = size;
+    }
+
+    // файл растет удвоением, адрес отображения может поменяться - поэтому везде смещения
+    void grow(size_t needed) {
+        size_t size = mapped_;
+        while (size < needed)
+            size *= 2;
+        if (::ftruncate(fd_, static_cast<off_t>(size)) != 0)
+            throw std::runtime_error("PersistentKVStorage: can't grow file");
+        // msync не сбрасывает размер файла
+        if (options_.durability == Durability::PerWrite && ::fdatasync(fd_) != 0)
+            throw std::runtime_error("PersistentKVStorage: can't sync file size");
+        void *addr = ::mremap(base_, mapped_, size, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("PersistentKVStorage: mremap failed");
+        base_ = static_cast<char *>(addr);
+        mapped_ = size;
+    }
+
+    FileHeader *header() const { return reinterpret_cast<FileHeader *>(base_); }
+    BlockHeader *blockOf(uint64_t off) const { return reinterpret_cast<BlockHeader *>(base_ + off) - 1; }
+    NodeHeader *node(uint64_t off) const { return reinterpret_cast<NodeHeader *>(base_ + off); }
+    ValueBlock *valueAt(uint64_t off) const { return reinterpret_cast<ValueBlock *>(base_ + off); }
+    uint64_t *next(uint64_t off) const { return reinterpret_cast<uint64_t *>(node(off) + 1); }
+    uint64_t *expNext(uint64_t off) const { return next(off) + node(off)->height; }
+    char *keyData(uint64_t off) const { return reinterpret_cast<char *>(expNext(off) + node(off)->height); }
+    std::string_view keyOf(uint64_t off) const { return {keyData(off), node(off)->key_len}; }
+
+    static size_t nodeSize(uint16_t height, size_t key_len) {
+        return sizeof(NodeHeader) + 2 * height * sizeof(uint64_t) + key_len;
+    }
+
+    static bool alive(uint64_t death_time, uint64_t now) {
+        return death_time == maxTime_ || death_time > now;
+    }
+
+    // ---------- аллокатор: классы по степеням двойки, свободные блоки в односвязных списках ----------
+
+    static uint32_t sizeClass(size_t payload) {
+        uint32_t cls = minClass_;
+        while ((size_t{1} << cls) < payload + sizeof(BlockHeader))
+            ++cls;
+        return cls;
+    }
+
+    // ------ сложность: const (амортизированно)
+    uint64_t allocate(size_t payload) {
+        uint32_t cls = sizeClass(payload);
+        auto *h = header();
+        if (uint64_t off = h->free_heads[cls]; off != 0) {
+            h->free_heads[cls] = *reinterpret_cast<uint64_t *>(base_ + off);
+            blockOf(off)->used = 1;
+            return off;
+        }
+        size_t block_size = size_t{1} << cls;
+        if (h->heap_top + block_size > mapped_) {
+            grow(h->heap_top + block_size);
+            h = header();
+        }
+        uint64_t block = h->heap_top;
+        auto *bh = reinterpret_cast<BlockHeader *>(base_ + block);
+        bh->size_class = cls;
+        bh->used = 1;
+        h->heap_top += block_size;
+        // новая граница кучи должна быть на диске раньше, чем на блок кто-то сошлется
+        syncRange(0, sizeof(FileHeader));
+        return block + sizeof(BlockHeader);
+    }
+
+    void release(uint64_t off) {
+        auto *bh = blockOf(off);
+        bh->used = 0;
+        *reinterpret_cast<uint64_t *>(base_ + off) = header()->free_heads[bh->size_class];
+        header()->free_heads[bh->size_class] = off;
+    }
+
+    // ---------- порядок записи ----------
+
+    static void publish(uint64_t *slot, uint64_t value) {
+        std::atomic_ref<uint64_t>(*slot).store(value, std::memory_order_release);
+    }
+
+    void syncRange(uint64_t off, size_t len) {
+        if (options_.durability != Durability::PerWrite)
+            return;
+        auto page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        uint64_t begin = off / page * page;
+        ::msync(base_ + begin, off + len - begin, MS_SYNC);
+    }
+
+    void syncBlock(uint64_t off) {
+        syncRange(off - sizeof(BlockHeader), size_t{1} << blockOf(off)->size_class);
+    }
+
+    // ---------- skip list ----------
+
+    uint16_t randomHeight() {
+        uint16_t height = 1;
+        // p = 1/4
+        while (height < maxHeight_ && (rng_() & 3) == 0)
+            ++height;
+        return height;
+    }
+
+    // ищет key, в preds - последний узел меньше key на каждом уровне. 0 - ключа нет
+    // ------ сложность: logn
+    uint64_t findKey(std::string_view key, uint64_t *preds) const {
+        uint64_t x = header()->head;
+        for (int lvl = maxHeight_ - 1; lvl >= 0; --lvl) {
+            for (uint64_t n = next(x)[lvl]; n != 0 && keyOf(n) < key; n = next(x)[lvl])
+                x = n;
+            preds[lvl] = x;
+        }
+        uint64_t candidate = next(x)[0];
+        return (candidate != 0 && keyOf(candidate) == key) ? candidate : 0;
+    }
+
+    // порядок списка по времени смерти: (death_time, key)
+    bool expLess(uint64_t off, uint64_t dt, std::string_view key) const {
+        uint64_t other = valueAt(node(off)->value_off)->death_time;
+        return other < dt || (other == dt && keyOf(off) < key);
+    }
+
+    void findExpiry(uint64_t dt, std::string_view key, uint64_t *preds) const {
+        uint64_t x = header()->head;
+        for (int lvl = maxHeight_ - 1; lvl >= 0; --lvl) {
+            for (uint64_t n = expNext(x)[lvl]; n != 0 && expLess(n, dt, key); n = expNext(x)[lvl])
+                x = n;
+            preds[lvl] = x;
+        }
+    }
+
+    // узел к этому моменту уже указывает на значение со временем dt
+    void linkExpiry(uint64_t off, uint64_t dt, std::string_view key) {
+        uint64_t preds[maxHeight_];
+        findExpiry(dt, key, preds);
+        for (uint16_t lvl = 0; lvl < node(off)->height; ++lvl) {
+            expNext(off)[lvl] = expNext(preds[lvl])[lvl];
+            expNext(preds[lvl])[lvl] = off;
+        }
+    }
+
+    void unlinkExpiry(uint64_t off, uint64_t dt, std::string_view key) {
+        uint64_t preds[maxHeight_];
+        findExpiry(dt, key, preds);
+        for (uint16_t lvl = 0; lvl < node(off)->height; ++lvl) {
+            if (expNext(preds[lvl])[lvl] == off)
+                expNext(preds[lvl])[lvl] = expNext(off)[lvl];
+        }
+    }
+
+    void eraseNode(uint64_t off, uint64_t *preds) {
+        uint64_t value_off = node(off)->value_off;
+        uint64_t dt = valueAt(value_off)->death_time;
+        if (dt != maxTime_)
+            unlinkExpiry(off, dt, keyOf(off));
+        // сначала исчезает из нижнего уровня, только потом память можно переиспользовать
+        publish(&next(preds[0])[0], next(off)[0]);
+        syncBlock(preds[0]);
+        for (uint16_t lvl = 1; lvl < node(off)->height; ++lvl) {
+            if (next(preds[lvl])[lvl] == off)
+                next(preds[lvl])[lvl] = next(off)[lvl];
+        }
+        release(value_off);
+        release(off);
+        --header()->entries;
+    }
+
+    // ---------- восстановление после нечистого закрытия ----------
+
+    // ------ сложность: n logn (сортировки по времени смерти и по смещению) + число свободных блоков
+    void recover() {
+        auto *h = header();
+        uint64_t head = h->head;
+
+        // нижний уровень - истина, все остальное строим по нему
+        std::vector<uint64_t> nodes;
+        for (uint64_t off = next(head)[0]; off != 0; off = next(off)[0])
+            nodes.push_back(off);
+
+        uint64_t last[maxHeight_];
+        std::fill(last, last + maxHeight_, head);
+        for (uint64_t off: nodes) {
+            for (uint16_t lvl = 1; lvl < node(off)->height; ++lvl) {
+                next(last[lvl])[lvl] = off;
+                last[lvl] = off;
+            }
+        }
+        for (uint16_t lvl = 1; lvl < maxHeight_; ++lvl)
+            next(last[lvl])[lvl] = 0;
+
+        std::vector<std::pair<uint64_t, uint64_t> > expiring;
+        for (uint64_t off: nodes) {
+            uint64_t dt = valueAt(node(off)->value_off)->death_time;
+            if (dt != maxTime_)
+                expiring.emplace_back(dt, off);
+        }
+        std::sort(expiring.begin(), expiring.end(), [this](const auto &lhs, const auto &rhs) {
+            return lhs.first < rhs.first || (lhs.first == rhs.first && keyOf(lhs.second) < keyOf(rhs.second));
+        });
+        std::fill(last, last + maxHeight_, head);
+        for (auto [dt, off]: expiring) {
+            for (uint16_t lvl = 0; lvl < node(off)->height; ++lvl) {
+                expNext(last[lvl])[lvl] = off;
+                last[lvl] = off;
+            }
+        }
+        for (uint16_t lvl = 0; lvl < maxHeight_; ++lvl)
+            expNext(last[lvl])[lvl] = 0;
+
+        // свободное место: все, что не занято достижимыми блоками. Заголовкам остальных блоков и heap_top
+        // из заголовка файла не верим - при падении ОС они могли не дойти до диска, а блоки за старой
+        // границей кучи уже достижимы. Поэтому промежутки между живыми блоками нарезаются заново
+        std::vector<uint64_t> live{head};
+        for (uint64_t off: nodes) {
+            live.push_back(off);
+            live.push_back(node(off)->value_off);
+        }
+        std::sort(live.begin(), live.end());
+        std::fill(h->free_heads, h->free_heads + classCount_, 0);
+        uint64_t top = heapStart_;
+        for (uint64_t off: live) {
+            carveFree(top, off - sizeof(BlockHeader));
+            blockOf(off)->used = 1;
+            top = off - sizeof(BlockHeader) + (size_t{1} << blockOf(off)->size_class);
+        }
+        h->heap_top = std::max<uint64_t>(h->heap_top, top);
+        carveFree(top, h->heap_top);
+        h->entries = nodes.size();
+    }
+
+    // [from, to) - свободные блоки наибольших классов, что влезают. Все блоки кратны 2^minClass_
+    void carveFree(uint64_t from, uint64_t to) {
+        while (from < to) {
+            uint32_t cls = minClass_;
+            while (cls + 1 < classCount_ && (size_t{1} << (cls + 1)) <= to - from)
+                ++cls;
+            auto *bh = reinterpret_cast<BlockHeader *>(base_ + from);
+            bh->size_class = cls;
+            bh->used = 0;
+            uint64_t off = from + sizeof(BlockHeader);
+            *reinterpret_cast<uint64_t *>(base_ + off) = header()->free_heads[cls];
+            header()->free_heads[cls] = off;
+            from += size_t{1} << cls;
+        }
+    }
+
+    Clock clock_;
+    PersistentOptions options_;
+    int fd_ = -1;
+    char *base_ = nullptr;
+    size_t mapped_ = 0;
+    bool recovered_ = false;
+    std::mt19937_64 rng_{0x5eed};
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "HotKeys.h"
+
+// ---------------- дерево хэшей для сверки реплик ----------------
+//
+// Пространство хэшей ключей делится на 2^depth равных диапазонов (листьев), как token ranges
+// в Dynamo/Cassandra: у двух реплик границы совпадают сами собой, без договоренностей.
+// Дайджест листа - сумма по модулю 2^64 хэшей записей (ключ, значение, время смерти) в нем,
+// дайджест узла - сумма детей. Сумма обратима, поэтому set/remove меняют O(depth) узлов,
+// а пересчитывать ничего не надо.
+
+// хэш записи целиком: расходятся реплики по любому из трех полей
+inline uint64_t entryDigest(std::string_view key, std::string_view value, uint64_t death_time) {
+    uint64_t h = sketchHash(key);
+    h ^= std::rotl(sketchHash(value), 21);
+    h ^= std::rotl(death_time * 0x9e3779b97f4a7c15ULL, 42);
+    // и еще раз перемешать, иначе сумма по листу слишком линейна
+    h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+class MerkleTree {
+public:
+    // узлы в куче: 1 - корень, дети i - 2i и 2i+1, листья - [2^depth, 2^(depth+1))
+    explicit MerkleTree(uint32_t depth) : depth_(depth), nodes_(size_t{2} << depth, 0) {
+    }
+
+    uint32_t depth() const { return depth_; }
+    size_t leaves() const { return size_t{1} << depth_; }
+
+    // в какой лист попадает ключ - старшие биты его хэша
+    size_t leafOf(std::string_view key) const {
+        return depth_ == 0 ? 0 : static_cast<size_t>(sketchHash(key) >> (64 - depth_));
+    }
+
+    // ------ сложность: depth
+    void add(size_t leaf, uint64_t digest) {
+        for (size_t i = leaves() + leaf; i > 0; i >>= 1)
+            nodes_[i] += digest;
+    }
+
+    // ------ сложность: depth
+    void remove(size_t leaf, uint64_t digest) {
+        for (size_t i = leaves() + leaf; i > 0; i >>= 1)
+            nodes_[i] -= digest;
+    }
+
+    // дайджест узла по номеру в куче
+    uint64_t node(size_t i) const { return nodes_[i]; }
+
+    uint64_t root() const { return nodes_[1]; }
+
+private:
+    uint32_t depth_;
+    std::vector<uint64_t> nodes_;
+};
+
+// что стоила сверка двух реплик
+struct RangeSyncStats {
+    size_t digests_compared = 0;  // пар дайджестов сравнено
+    size_t ranges_differ = 0;     // листьев, которые разошлись
+    size_t entries_sent = 0;      // записей отправлено на реплику
+    size_t entries_removed = 0;   // лишних записей удалено на реплике
+    size_t bytes_exchanged = 0;   // дайджесты + ключи реплики + записи источника
+};
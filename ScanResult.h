@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// ---------------- плоский буфер под результат скана ----------------
+//
+// Все ключи и значения лежат подряд в одной строке, границы - в массиве смещений:
+// ключ i - [offsets[2i], offsets[2i+1]), значение i - [offsets[2i+1], offsets[2i+2]).
+// clear() не отдает память, так что буфер, переиспользуемый между вызовами, после
+// прогрева не аллоцирует вообще. string_view живут до следующего clear/append.
+
+class ScanResult {
+public:
+    ScanResult() { offsets_.push_back(0); }
+
+    size_t size() const { return offsets_.size() / 2; }
+    bool empty() const { return size() == 0; }
+
+    std::string_view key(size_t i) const { return slice(2 * i); }
+    std::string_view value(size_t i) const { return slice(2 * i + 1); }
+
+    std::pair<std::string_view, std::string_view> operator[](size_t i) const { return {key(i), value(i)}; }
+
+    // байт ключей и значений
+    size_t bytes() const { return data_.size(); }
+
+    // ------ сложность: O(1), память остается за буфером
+    void clear() {
+        data_.clear();
+        offsets_.resize(1);
+    }
+
+    // заранее под entries записей и bytes байт
+    void reserve(size_t entries, size_t bytes) {
+        offsets_.reserve(2 * entries + 1);
+        data_.reserve(bytes);
+    }
+
+    // ------ сложность: длина ключа и значения (амортизированно)
+    void append(std::string_view key, std::string_view value) {
+        data_.append(key);
+        offsets_.push_back(data_.size());
+        data_.append(value);
+        offsets_.push_back(data_.size());
+    }
+
+private:
+    std::string_view slice(size_t i) const {
+        return std::string_view(data_).substr(offsets_[i], offsets_[i + 1] - offsets_[i]);
+    }
+
+    std::string data_;
+    std::vector<size_t> offsets_;
+};
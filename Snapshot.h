@@ -0,0 +1,495 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// ---------------- CRC32C ----------------
+//
+// На x86 с SSE4.2 и на ARMv8 с CRC - аппаратная инструкция (выбирается в рантайме на x86),
+// иначе табличный вариант.
+
+inline uint32_t crc32cSoftware(const unsigned char *data, size_t size, uint32_t crc) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78U : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(const unsigned char *data, size_t size,
+                                                                  uint32_t crc) {
+    uint64_t wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = static_cast<uint32_t>(wide);
+    for (; size > 0; ++data, --size)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+
+inline bool crc32cHardwareAvailable() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+inline uint32_t crc32cHardware(const unsigned char *data, size_t size, uint32_t crc) {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; ++data, --size)
+        crc = __crc32cb(crc, *data);
+    return crc;
+}
+
+inline bool crc32cHardwareAvailable() {
+    return true;
+}
+#else
+inline uint32_t crc32cHardware(const unsigned char *data, size_t size, uint32_t crc) {
+    return crc32cSoftware(data, size, crc);
+}
+
+inline bool crc32cHardwareAvailable() {
+    return false;
+}
+#endif
+
+// продолжает crc предыдущего куска: crc32c(b, crc32c(a)) == crc32c(a + b)
+// ------ сложность: size
+inline uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    crc = crc32cHardwareAvailable() ? crc32cHardware(bytes, size, crc) : crc32cSoftware(bytes, size, crc);
+    return ~crc;
+}
+
+// ---------------- формат снапшота ----------------
+//
+// [SnapshotHeader][чанк]...[чанк][uint64 смещения записей в порядке ключей][ChunkInfo]...
+// чанк: подряд идущие записи, запись: SnapshotRecord, ключ, значение, добивка до 8 байт.
+// Записи лежат по возрастанию ключа, death_time абсолютное (по тем же часам, что у хранилища),
+// уже протухшие в снапшот не пишутся. Каждый чанк декодируется независимо: в каталоге чанков
+// его границы, диапазон ключей (первая и последняя запись), мин/макс время смерти и CRC32C.
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entries;
+    uint64_t index_offset;      // где начинается массив смещений
+    uint64_t chunk_count;
+    uint64_t directory_offset;  // где начинается каталог чанков
+    uint32_t directory_crc;
+    uint32_t index_crc;
+};
+
+struct SnapshotRecord {
+    uint64_t death_time;
+    uint32_t key_len;
+    uint32_t value_len;
+    // дальше ключ и значение
+
+    std::string_view key() const { return {reinterpret_cast<const char *>(this + 1), key_len}; }
+    std::string_view value() const { return {reinterpret_cast<const char *>(this + 1) + key_len, value_len}; }
+};
+
+struct ChunkInfo {
+    uint64_t offset;       // первая запись чанка
+    uint64_t bytes;
+    uint64_t first_entry;  // номер первой записи в индексе
+    uint64_t entries;
+    uint64_t min_death_time;
+    uint64_t max_death_time;  // <= now - чанк целиком протух
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+inline constexpr uint64_t snapshotMagic = 0x31504153564b4e53ULL;  // "SNKVSAP1"
+inline constexpr uint32_t snapshotVersion = 2;
+
+inline size_t snapshotRecordSize(size_t key_len, size_t value_len) {
+    return (sizeof(SnapshotRecord) + key_len + value_len + 7) / 8 * 8;
+}
+
+// пишет снапшот, записи обязаны приходить по возрастанию ключа.
+// чанк закрывается как только в нем набирается chunk_bytes байт
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::filesystem::path &path, size_t chunk_bytes = 1 << 20)
+        : out_(path, std::ios::binary | std::ios::trunc), chunk_bytes_(chunk_bytes == 0 ? 1 : chunk_bytes) {
+        if (!out_)
+            throw std::runtime_error("SnapshotWriter: can't open " + path.string());
+        SnapshotHeader header{};
+        out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        offset_ = sizeof(header);
+    }
+
+    void add(std::string_view key, std::string_view value, uint64_t death_time) {
+        if (key.size() > std::numeric_limits<uint32_t>::max() || value.size() > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("SnapshotWriter: entry is too large");
+        if (chunk_.entries == 0) {
+            chunk_.offset = offset_;
+            chunk_.first_entry = index_.size();
+            chunk_.min_death_time = std::numeric_limits<uint64_t>::max();
+        }
+
+        SnapshotRecord record{death_time, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+        size_t size = snapshotRecordSize(key.size(), value.size());
+        static constexpr char zeros[8]{};
+        write(&record, sizeof(record));
+        write(key.data(), key.size());
+        write(value.data(), value.size());
+        write(zeros, size - sizeof(record) - key.size() - value.size());
+
+        index_.push_back(offset_);
+        offset_ += size;
+        chunk_.bytes += size;
+        ++chunk_.entries;
+        chunk_.min_death_time = std::min(chunk_.min_death_time, death_time);
+        chunk_.max_death_time = std::max(chunk_.max_death_time, death_time);
+        if (chunk_.bytes >= chunk_bytes_)
+            closeChunk();
+    }
+
+    // дописывает индекс, каталог чанков и заголовок
+    void finish() {
+        closeChunk();
+        const char *index = reinterpret_cast<const char *>(index_.data());
+        const char *directory = reinterpret_cast<const char *>(chunks_.data());
+        size_t index_bytes = index_.size() * sizeof(uint64_t), directory_bytes = chunks_.size() * sizeof(ChunkInfo);
+        out_.write(index, static_cast<std::streamsize>(index_bytes));
+        out_.write(directory, static_cast<std::streamsize>(directory_bytes));
+
+        SnapshotHeader header{snapshotMagic, snapshotVersion, 0, index_.size(), offset_,
+                              chunks_.size(), offset_ + index_bytes,
+                              crc32c(directory, directory_bytes), crc32c(index, index_bytes)};
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out_.flush();
+        if (!out_)
+            throw std::runtime_error("SnapshotWriter: write failed");
+    }
+
+private:
+    void write(const void *data, size_t size) {
+        out_.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        chunk_.crc = crc32c(data, size, chunk_.crc);
+    }
+
+    void closeChunk() {
+        if (chunk_.entries == 0)
+            return;
+        chunks_.push_back(chunk_);
+        chunk_ = ChunkInfo{};
+    }
+
+    std::ofstream out_;
+    size_t chunk_bytes_;
+    std::vector<uint64_t> index_;
+    std::vector<ChunkInfo> chunks_;
+    ChunkInfo chunk_{};
+    uint64_t offset_ = 0;
+};
+
+// fn(i) для i in [0, count) в threads потоках, первое исключение пробрасывается наружу
+template<typename Fn>
+void parallelFor(size_t count, unsigned threads, Fn &&fn) {
+    threads = std::max(1u, std::min<unsigned>(threads, static_cast<unsigned>(std::max<size_t>(count, 1))));
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&] {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &thread: pool)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// снапшот, отображенный в память только на чтение
+class SnapshotFile {
+public:
+    explicit SnapshotFile(const std::filesystem::path &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("SnapshotFile: can't open " + path.string());
+        struct stat st{};
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+            ::close(fd);
+            throw std::runtime_error("SnapshotFile: " + path.string() + " is not a snapshot");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void *addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("SnapshotFile: mmap failed");
+        base_ = static_cast<const char *>(addr);
+
+        // каталог и индекс проверяем сразу: по смещениям из индекса get читает прямо из отображения.
+        // индекс - 8 байт на запись, против чанков это мелочь. чанки - в verify / при загрузке
+        const auto *h = header();
+        if (h->magic != snapshotMagic || h->version != snapshotVersion
+            || h->entries > size_ / sizeof(uint64_t) || h->chunk_count > size_ / sizeof(ChunkInfo)
+            || h->index_offset > size_ - h->entries * sizeof(uint64_t)
+            || h->directory_offset > size_ - h->chunk_count * sizeof(ChunkInfo)
+            || crc32c(base_ + h->directory_offset, h->chunk_count * sizeof(ChunkInfo)) != h->directory_crc
+            || !indexValid()) {
+            ::munmap(const_cast<char *>(base_), size_);
+            throw std::runtime_error("SnapshotFile: " + path.string() + " is not a snapshot or is corrupted");
+        }
+    }
+
+    SnapshotFile(const SnapshotFile &) = delete;
+    SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+    ~SnapshotFile() {
+        ::munmap(const_cast<char *>(base_), size_);
+    }
+
+    size_t entries() const { return header()->entries; }
+    size_t chunks() const { return header()->chunk_count; }
+    size_t fileSize() const { return size_; }
+
+    const ChunkInfo &chunk(size_t i) const {
+        return reinterpret_cast<const ChunkInfo *>(base_ + header()->directory_offset)[i];
+    }
+
+    const SnapshotRecord &record(size_t i) const {
+        return *reinterpret_cast<const SnapshotRecord *>(base_ + index()[i]);
+    }
+
+    // записи чанка подряд, без индекса: fn(const SnapshotRecord &)
+    // ------ сложность: размер чанка
+    template<typename Fn>
+    void forEachInChunk(size_t c, Fn &&fn) const {
+        const auto &info = chunk(c);
+        uint64_t off = info.offset;
+        for (uint64_t i = 0; i < info.entries; ++i) {
+            const auto &record = *reinterpret_cast<const SnapshotRecord *>(base_ + off);
+            fn(record);
+            off += snapshotRecordSize(record.key_len, record.value_len);
+        }
+    }
+
+    // ------ сложность: размер чанка
+    bool verifyChunk(size_t c) const {
+        const auto &info = chunk(c);
+        return info.offset + info.bytes <= header()->index_offset
+               && crc32c(base_ + info.offset, info.bytes) == info.crc;
+    }
+
+    // проверяет индекс и все чанки
+    // ------ сложность: размер файла / threads
+    bool verify(unsigned threads = 1) const {
+        if (crc32c(index(), entries() * sizeof(uint64_t)) != header()->index_crc)
+            return false;
+        std::atomic<bool> ok{true};
+        parallelFor(chunks(), threads, [&](size_t c) {
+            if (!verifyChunk(c))
+                ok = false;
+        });
+        return ok;
+    }
+
+    // чанк, в котором лежит запись номер i
+    // ------ сложность: log(кол-во чанков)
+    size_t chunkOf(size_t i) const {
+        size_t lo = 0, hi = chunks();
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (chunk(mid).first_entry <= i)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // первая запись с ключом >= key
+    // ------ сложность: logn
+    size_t lowerBound(std::string_view key) const {
+        size_t lo = 0, hi = entries();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (record(mid).key() < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // подсказка ядру про диапазон записей [from, to)
+    void advise(size_t from, size_t to, int advice) const {
+        if (from >= to)
+            return;
+        auto page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        uint64_t begin = index()[from] / page * page;
+        const auto &last = record(to - 1);
+        uint64_t end = index()[to - 1] + snapshotRecordSize(last.key_len, last.value_len);
+        ::madvise(const_cast<char *>(base_) + begin, end - begin, advice);
+    }
+
+    void adviseAll(int advice) const {
+        ::madvise(const_cast<char *>(base_), size_, advice);
+    }
+
+private:
+    const SnapshotHeader *header() const { return reinterpret_cast<const SnapshotHeader *>(base_); }
+    const uint64_t *index() const { return reinterpret_cast<const uint64_t *>(base_ + header()->index_offset); }
+
+    // CRC индекса и каждая запись (заголовок, ключ и значение по длинам из заголовка) целиком между
+    // заголовком файла и индексом, по возрастанию и без наложений на следующую
+    // ------ сложность: n
+    bool indexValid() const {
+        const auto *h = header();
+        if (crc32c(index(), h->entries * sizeof(uint64_t)) != h->index_crc)
+            return false;
+        uint64_t previous = sizeof(SnapshotHeader);
+        for (size_t i = 0; i < h->entries; ++i) {
+            uint64_t off = index()[i];
+            if (off < previous || off > h->index_offset || h->index_offset - off < sizeof(SnapshotRecord))
+                return false;
+            // длины 32-битные, так что размер записи в uint64 не переполнится
+            const auto &r = record(i);
+            uint64_t size = snapshotRecordSize(r.key_len, r.value_len);
+            if (h->index_offset - off < size)
+                return false;
+            previous = off + size;
+        }
+        return true;
+    }
+
+    const char *base_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Хранилище только на чтение поверх снапшота: индекс - массив смещений в самом файле, значения
+// отдаются как string_view прямо в page cache. Открытие - mmap, память растет с рабочим набором.
+template<typename Clock>
+class SnapshotKVStorage {
+public:
+    explicit SnapshotKVStorage(const std::filesystem::path &path, Clock clock = Clock())
+        : file_(path), clock_(clock) {
+        // точечные чтения по всему файлу - readahead только мешает
+        file_.adviseAll(MADV_RANDOM);
+    }
+
+    // Значение по ключу, живет пока жив SnapshotKVStorage.
+    // ------ сложность: logn
+    std::optional<std::string_view> get(std::string_view key) const {
+        size_t i = file_.lowerBound(key);
+        if (i == file_.entries())
+            return std::nullopt;
+        const auto &record = file_.record(i);
+        if (record.key() != key || !alive(record.death_time, static_cast<uint64_t>(clock_())))
+            return std::nullopt;
+        return record.value();
+    }
+
+    // То же что KVStorage::getManySorted, но без копий. Диапазон заранее помечается
+    // MADV_SEQUENTIAL + MADV_WILLNEED, чтобы ядро читало его крупно и наперед, после скана
+    // ему возвращается MADV_RANDOM - иначе точечные чтения там потом тянули бы readahead.
+    // ------ сложность: logn + count
+    std::vector<std::pair<std::string_view, std::string_view> > getManySorted(std::string_view key,
+                                                                             uint32_t count) const {
+        std::vector<std::pair<std::string_view, std::string_view> > result{};
+        if (count == 0)
+            return result;
+        size_t from = file_.lowerBound(key);
+        // протухшие пропускаются, так что диапазон для подсказки - с запасом
+        size_t to = std::min(file_.entries(), from + 2 * static_cast<size_t>(count));
+        file_.advise(from, to, MADV_SEQUENTIAL);
+        file_.advise(from, to, MADV_WILLNEED);
+
+        auto now = static_cast<uint64_t>(clock_());
+        size_t c = file_.chunkOf(from);
+        for (size_t i = from; i < file_.entries() && result.size() < count; ++i) {
+            // целиком протухшие чанки перепрыгиваем по каталогу, не трогая их страницы
+            while (c + 1 < file_.chunks() && file_.chunk(c + 1).first_entry <= i)
+                ++c;
+            const auto &info = file_.chunk(c);
+            if (info.max_death_time <= now) {
+                i = info.first_entry + info.entries - 1;
+                continue;
+            }
+            const auto &record = file_.record(i);
+            if (alive(record.death_time, now))
+                result.emplace_back(record.key(), record.value());
+        }
+        file_.advise(from, to, MADV_RANDOM);
+        return result;
+    }
+
+    // кол-во записей в снапшоте, включая протухшие с момента записи
+    size_t size() const {
+        return file_.entries();
+    }
+
+    // открытие проверяет только каталог и индекс, CRC чанков - здесь
+    bool verify(unsigned threads = std::thread::hardware_concurrency()) const {
+        return file_.verify(threads);
+    }
+
+private:
+    static bool alive(uint64_t death_time, uint64_t now) {
+        return death_time == std::numeric_limits<uint64_t>::max() || death_time > now;
+    }
+
+    SnapshotFile file_;
+    Clock clock_;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+
+#include "HotKeys.h"
+
+// ---------------- дедупликация одинаковых значений ----------------
+
+// Значение записи: либо своя строка, либо общий неизменяемый буфер из ValuePool.
+// Общий буфер живет, пока на него ссылается хоть одна запись (в любом хранилище).
+class StoredValue {
+public:
+    StoredValue() = default;
+
+    StoredValue(std::string value) : value_(std::move(value)) {
+    }
+
+    const std::string &str() const {
+        return value_.index() == 0 ? std::get<0>(value_) : *std::get<1>(value_);
+    }
+
+    size_t size() const { return str().size(); }
+
+    bool shared() const { return value_.index() == 1; }
+
+    // своя строка переиспользует свой буфер, общий просто отпускается
+    void assign(std::string_view value) {
+        if (value_.index() == 0)
+            std::get<0>(value_).assign(value);
+        else
+            value_.emplace<0>(value);
+    }
+
+    void share(std::shared_ptr<const std::string> buffer) {
+        value_ = std::move(buffer);
+    }
+
+    // забрать строку: своя отдается без копии, общая копируется
+    std::string release() && {
+        return value_.index() == 0 ? std::move(std::get<0>(value_)) : *std::get<1>(value_);
+    }
+
+private:
+    std::variant<std::string, std::shared_ptr<const std::string> > value_;
+};
+
+// Таблица буферов по содержимому. Хранит только weak_ptr, так что освобождение значения - это просто
+// уменьшение счетчика ссылок, а мертвые ячейки вычищаются пачкой, когда таблица выросла вдвое.
+// Ключ таблицы - 64-битный хэш, содержимое сравнивается только у живых буферов с тем же хэшем.
+class ValuePool {
+public:
+    // значения короче min_size не трогаем: до 15 байт строка и так без аллокации,
+    // а на коротких хэш и weak_ptr дороже экономии
+    explicit ValuePool(size_t min_size = 32) : min_size_(min_size) {
+    }
+
+    size_t minSize() const { return min_size_; }
+
+    // общий буфер с таким содержимым или nullptr, если значение короче порога
+    // ------ сложность: длина значения (амортизированно)
+    std::shared_ptr<const std::string> intern(std::string_view value) {
+        if (value.size() < min_size_)
+            return nullptr;
+        uint64_t h = sketchHash(value);
+        auto [begin, end] = table_.equal_range(h);
+        auto dead = table_.end();
+        for (auto it = begin; it != end; ++it) {
+            if (auto buffer = it->second.lock()) {
+                if (*buffer == value)
+                    return buffer;
+            } else {
+                dead = it;
+            }
+        }
+        auto buffer = std::make_shared<const std::string>(value);
+        if (dead != table_.end()) {
+            dead->second = buffer;
+        } else {
+            table_.emplace(h, buffer);
+            if (table_.size() >= sweep_at_)
+                sweep();
+        }
+        return buffer;
+    }
+
+    // своя строка значения уходит в общий буфер (если длинная)
+    void internInPlace(StoredValue &value) {
+        if (value.shared() || value.size() < min_size_)
+            return;
+        value.share(intern(value.str()));
+    }
+
+    // ячеек в таблице, включая еще не вычищенные мертвые
+    size_t buffers() const { return table_.size(); }
+
+    // ------ сложность: размер таблицы
+    void sweep() {
+        std::erase_if(table_, [](const auto &cell) { return cell.second.expired(); });
+        sweep_at_ = std::max<size_t>(table_.size() * 2, 1024);
+    }
+
+private:
+    size_t min_size_;
+    std::unordered_multimap<uint64_t, std::weak_ptr<const std::string> > table_;
+    size_t sweep_at_ = 1024;
+};
@@ -0,0 +1,1494 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <unordered_map>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+#include <malloc.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "KVStorage.cpp"
+#include "MemoryGovernor.h"
+#include "PersistentKVStorage.h"
+#include <sys/wait.h>
+
+// запуск: KVStorageBench [-n кол-во_операций] [секция...], без секций гоняются все
+// собирать лучше в Release, иначе цифры ни о чем
+
+struct BenchTime {
+    uint64_t now = 0;
+};
+
+// часы которыми бенчмарк управляет сам, как FakeClock в тестах
+struct BenchClock {
+    BenchTime *time;
+    uint64_t operator()() const noexcept { return time->now; }
+};
+
+using BenchStorage = KVStorage<BenchClock>;
+using BenchEntry = std::tuple<std::string, std::string, uint32_t>;
+
+static size_t g_ops = 200'000;
+// сюда складываются результаты, которые иначе компилятор выкинул бы
+static volatile uint64_t g_sink = 0;
+
+// счетчик аллокаций на весь процесс: секции смотрят разницу до/после
+static std::atomic<uint64_t> g_allocations{0};
+
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+// noinline: иначе gcc видит free() в месте delete-выражения и ругается на несовпадение с new
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// аллокаций на одну итерацию fn(i)
+template<typename Fn>
+static double allocsPerOp(size_t ops, Fn &&fn) {
+    uint64_t before = g_allocations.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < ops; ++i)
+        fn(i);
+    return static_cast<double>(g_allocations.load(std::memory_order_relaxed) - before)
+           / static_cast<double>(ops == 0 ? 1 : ops);
+}
+
+// --json: по строке JSON на метрику, для сбора результатов скриптами
+static bool g_json = false;
+
+static std::string jsonString(std::string_view text) {
+    std::string out = "\"";
+    for (char c: text) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + '"';
+}
+
+static void report(std::string_view section, std::string_view metric, double value, std::string_view unit) {
+    if (g_json) {
+        std::printf("{\"section\": %s, \"metric\": %s, \"value\": %.4f, \"unit\": %s}\n",
+                    jsonString(section).c_str(), jsonString(metric).c_str(), value, jsonString(unit).c_str());
+        return;
+    }
+    std::printf("%-12.*s %-40.*s %14.2f %.*s\n",
+                static_cast<int>(section.size()), section.data(),
+                static_cast<int>(metric.size()), metric.data(),
+                value,
+                static_cast<int>(unit.size()), unit.data());
+}
+
+// наносекунд на одну итерацию fn(i), i in [0, ops)
+template<typename Fn>
+static double nsPerOp(size_t ops, Fn &&fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i)
+        fn(i);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count())
+           / static_cast<double>(ops == 0 ? 1 : ops);
+}
+
+// Аппаратные счетчики через perf_event_open: только user space этого процесса, каждый счетчик
+// отдельным fd. Если счетчиков в ядре/VM нет или не пускает perf_event_paranoid - счетчик просто
+// недоступен (fd -1), замеры идут без него. При мультиплексировании значения масштабируются
+// по time_enabled / time_running.
+class PerfCounters {
+public:
+    static constexpr size_t count = 5;
+
+    PerfCounters() {
+        auto cache = [](uint64_t cache_id) {
+            return cache_id | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        const std::array<std::pair<uint32_t, uint64_t>, count> events = {{
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL)},
+            {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        }};
+        for (size_t i = 0; i < count; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds_[i] < 0 && error_ == 0)
+                error_ = errno;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd: fds_) {
+            if (fd >= 0)
+                ::close(fd);
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    static constexpr std::array<std::string_view, count> names = {
+        "cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"
+    };
+
+    bool any() const {
+        return std::any_of(fds_.begin(), fds_.end(), [](int fd) { return fd >= 0; });
+    }
+
+    // errno первого счетчика, который не открылся (0 - открылись все)
+    int error() const { return error_; }
+
+    void start() {
+        for (int fd: fds_) {
+            if (fd >= 0) {
+                ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // значения с момента start, nullopt - счетчик недоступен или ни разу не был на PMU
+    std::array<std::optional<double>, count> stop() {
+        std::array<std::optional<double>, count> result;
+        for (size_t i = 0; i < count; ++i) {
+            if (fds_[i] < 0)
+                continue;
+            ::ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t data[3] = {};  // value, time_enabled, time_running
+            if (::read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+                continue;
+            result[i] = static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]);
+        }
+        return result;
+    }
+
+private:
+    std::array<int, count> fds_{};
+    int error_ = 0;
+};
+
+// счетчики открываются один раз на процесс, о недоступных - одна строка в stderr
+static PerfCounters &perfCounters() {
+    static PerfCounters counters;
+    static bool warned = false;
+    if (counters.error() != 0 && !warned) {
+        std::fprintf(stderr, "perf_event_open: %s - %s\n", std::strerror(counters.error()),
+                     counters.any() ? "part of the counters is unavailable" : "counters are unavailable");
+        warned = true;
+    }
+    return counters;
+}
+
+// ns на операцию и доступные счетчики на операцию
+template<typename Fn>
+static void reportCounters(std::string_view section, std::string_view metric, size_t ops, Fn &&fn) {
+    PerfCounters &counters = perfCounters();
+    counters.start();
+    double ns = nsPerOp(ops, fn);
+    auto values = counters.stop();
+    double n = static_cast<double>(ops == 0 ? 1 : ops);
+    report(section, std::string(metric) + ", time", ns, "ns/op");
+    for (size_t i = 0; i < PerfCounters::count; ++i) {
+        if (values[i])
+            report(section, std::string(metric) + ", " + std::string(PerfCounters::names[i]), *values[i] / n, "/op");
+    }
+}
+
+static std::string benchKey(size_t i) {
+    return "key:" + std::to_string(i);
+}
+
+static BenchStorage makeStorage(BenchTime &time) {
+    std::vector<BenchEntry> entries;
+    return BenchStorage(entries, BenchClock{&time});
+}
+
+// ---------------- секции ----------------
+
+// сколько стоит set при 0 / 1k / 100k подписок, которые на записываемые ключи не попадают,
+// и при подписках, делящих с ключами длинный общий префикс
+static void benchWatch() {
+    for (size_t watchers: {size_t{0}, size_t{1'000}, size_t{100'000}}) {
+        for (bool shared_prefix: {false, true}) {
+            if (watchers == 0 && shared_prefix)
+                continue;
+            BenchTime time;
+            auto store = makeStorage(time);
+            for (size_t w = 0; w < watchers; ++w) {
+                auto pattern = (shared_prefix ? "key:" : "watch:") + std::to_string(w) + ":";
+                store.watch(pattern, WatchMode::Prefix, [](std::span<const WatchNotification>) {});
+            }
+            double ns = nsPerOp(g_ops, [&](size_t i) { store.set(benchKey(i), "value", 0); });
+            report("watch", "set, watchers=" + std::to_string(watchers) + (shared_prefix ? " (shared prefix)" : ""),
+                   ns, "ns/op");
+        }
+    }
+
+    // один подписчик на все ключи: цена доставки поштучно и пачками
+    for (size_t batch: {size_t{1}, size_t{64}, size_t{1024}}) {
+        BenchTime time;
+        auto store = makeStorage(time);
+        size_t delivered = 0;
+        store.setWatchBatchSize(batch);
+        store.watch("key:", WatchMode::Prefix, [&](std::span<const WatchNotification> b) { delivered += b.size(); });
+        double ns = nsPerOp(g_ops, [&](size_t i) { store.set(benchKey(i), "value", 0); });
+        store.flushWatches();
+        report("watch", "set, 1 matching watcher, batch=" + std::to_string(batch), ns, "ns/op");
+    }
+}
+
+// цена учета горячих ключей на get при разной частоте сэмплирования
+static void benchHotKeys() {
+    BenchTime time;
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < g_ops; ++i)
+        store.set(benchKey(i), "value", 0);
+
+    double off = nsPerOp(g_ops, [&](size_t i) { store.get(benchKey((i * 7919) % g_ops)); });
+    report("hotkeys", "get, tracking off", off, "ns/op");
+    for (uint32_t every: {1u, 16u, 128u}) {
+        store.enableHotKeyTracking(HotKeyOptions{.sample_every = every});
+        double ns = nsPerOp(g_ops, [&](size_t i) { store.get(benchKey((i * 7919) % g_ops)); });
+        report("hotkeys", "get, sample_every=" + std::to_string(every), ns, "ns/op");
+    }
+}
+
+// sample(k) через индекс выборки против честного прохода по map до случайной позиции
+static void benchSample() {
+    BenchTime time;
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < g_ops; ++i)
+        store.set(benchKey(i), "value", i % 2 == 0 ? 0 : 10);
+
+    const size_t rounds = 10'000;
+    double fresh = nsPerOp(rounds, [&](size_t) { store.sample(16); });
+    report("sample", "sample(16), all live, n=" + std::to_string(g_ops), fresh, "ns/op");
+
+    time.now = 10;  // половина протухла
+    double half = nsPerOp(rounds, [&](size_t) { store.sample(16); });
+    report("sample", "sample(16), half expired", half, "ns/op");
+
+    // так пришлось бы делать без индекса: getManySorted целиком и выбрать из него
+    const size_t walk_rounds = 10;
+    std::mt19937_64 rng(1);
+    double walk = nsPerOp(walk_rounds, [&](size_t) {
+        auto all = store.getManySorted("", std::numeric_limits<uint32_t>::max());
+        std::vector<std::pair<std::string, std::string> > picked;
+        std::sample(all.begin(), all.end(), std::back_inserter(picked), 16, rng);
+    });
+    report("sample", "O(n) walk + std::sample(16)", walk, "ns/op");
+}
+
+// zipf(s) на [0, n) через таблицу CDF
+class ZipfGenerator {
+public:
+    ZipfGenerator(size_t n, double s, uint64_t seed) : rng_(seed) {
+        cdf_.reserve(n);
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i), s);
+            cdf_.push_back(sum);
+        }
+        for (auto &c: cdf_)
+            c /= sum;
+    }
+
+    size_t next() {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+        return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    }
+
+private:
+    std::mt19937_64 rng_;
+    std::vector<double> cdf_;
+};
+
+// трасса zipf-обращений вперемешку со сканами одноразовых ключей
+static std::vector<std::string> zipfScanTrace(size_t ops, size_t universe) {
+    ZipfGenerator zipf(universe, 0.99, 7);
+    std::vector<std::string> trace;
+    trace.reserve(ops);
+    size_t scan_id = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        // каждые 10k обращений - скан на 2k новых ключей
+        if (i % 10'000 == 9'999) {
+            for (size_t j = 0; j < 2'000 && trace.size() < ops; ++j)
+                trace.push_back("scan:" + std::to_string(scan_id++));
+            i += 1'999;
+            continue;
+        }
+        trace.push_back(benchKey(zipf.next()));
+    }
+    return trace;
+}
+
+// честный LRU для сравнения, в записях (все записи одного размера)
+static double lruHitRatio(const std::vector<std::string> &trace, size_t capacity) {
+    std::list<std::string> order;
+    std::unordered_map<std::string, std::list<std::string>::iterator> where;
+    size_t hits = 0;
+    for (auto &key: trace) {
+        if (auto it = where.find(key); it != where.end()) {
+            ++hits;
+            order.splice(order.begin(), order, it->second);
+            continue;
+        }
+        order.push_front(key);
+        where[key] = order.begin();
+        if (order.size() > capacity) {
+            where.erase(order.back());
+            order.pop_back();
+        }
+    }
+    return static_cast<double>(hits) / static_cast<double>(trace.size());
+}
+
+// кэш поверх хранилища: get, при промахе set
+static double storeHitRatio(const std::vector<std::string> &trace, size_t capacity, EvictionPolicy policy) {
+    BenchTime time;
+    auto store = makeStorage(time);
+    // все ключи трассы одной длины до 12 символов, так что размер записи почти постоянный
+    store.set("probe:000000", "value", 0);
+    size_t entry = store.memoryUsage();
+    store.remove("probe:000000");
+    store.setMemoryLimit(capacity * entry, policy);
+
+    size_t hits = 0;
+    for (auto &key: trace) {
+        if (store.get(key)) {
+            ++hits;
+            continue;
+        }
+        store.set(key, "value", 0);
+    }
+    return static_cast<double>(hits) / static_cast<double>(trace.size());
+}
+
+static void benchAdmission() {
+    const size_t universe = 100'000;
+    auto trace = zipfScanTrace(g_ops * 5, universe);
+    for (size_t capacity: {universe / 100, universe / 20}) {
+        auto suffix = ", capacity=" + std::to_string(capacity);
+        report("admission", "hit ratio, exact LRU" + suffix, 100 * lruHitRatio(trace, capacity), "%");
+        report("admission", "hit ratio, SampledLru" + suffix,
+               100 * storeHitRatio(trace, capacity, EvictionPolicy::SampledLru), "%");
+        report("admission", "hit ratio, TinyLfu" + suffix,
+               100 * storeHitRatio(trace, capacity, EvictionPolicy::TinyLfu), "%");
+    }
+}
+
+// RSS процесса в байтах
+static uint64_t currentRss() {
+    std::ifstream in("/proc/self/statm");
+    uint64_t pages = 0, resident = 0;
+    in >> pages >> resident;
+    return resident * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+// fn в отдельном процессе (свой RSS, выход без деструкторов), ждем его.
+// stdout сбрасываем до fork: иначе недописанный буфер родителя ребенок напечатает еще раз
+template<typename Fn>
+static void inChild(Fn &&fn) {
+    std::fflush(stdout);
+    if (pid_t child = ::fork(); child == 0) {
+        fn();
+        std::fflush(stdout);
+        ::_exit(0);
+    } else if (child > 0) {
+        int status = 0;
+        ::waitpid(child, &status, 0);
+    }
+}
+
+// Насколько близко к лимиту можно жить: поддельный cgroup, где memory.current - настоящий RSS,
+// memory.max - RSS на старте плюс бюджет. Пишем без остановки, governor зовется каждые interval записей,
+// смотрим пиковую долю memory.max.
+static void benchGovernor() {
+    auto dir = std::filesystem::temp_directory_path() / ("kvstorage_bench_cgroup_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    auto write = [&](const char *name, uint64_t value) { std::ofstream(dir / name) << value << "\n"; };
+    std::ofstream(dir / "memory.pressure") << "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+
+    const std::string value(100, 'v');
+    for (double fraction: {0.80, 0.90, 0.95}) {
+        for (size_t interval: {size_t{1'000}, size_t{10'000}}) {
+            BenchTime time;
+            uint64_t peak = 0, max = 0;
+            {
+                auto store = makeStorage(time);
+                // бюджет - примерно половина того, что хотел бы занять поток записей
+                max = currentRss() + g_ops * (value.size() + 64) / 2;
+                write("memory.max", max);
+                MemoryGovernor governor(GovernorOptions{.cgroup_dir = dir, .target_fraction = fraction});
+                for (size_t i = 0; i < g_ops * 2; ++i) {
+                    store.set(benchKey(i), value, 0);
+                    if (i % interval == 0) {
+                        uint64_t rss = currentRss();
+                        peak = std::max(peak, rss);
+                        write("memory.current", rss);
+                        governor.poll(store);
+                    }
+                }
+                peak = std::max(peak, currentRss());
+            }
+            report("governor", "peak RSS/max, target=" + std::to_string(fraction).substr(0, 4)
+                               + ", poll every " + std::to_string(interval),
+                   100.0 * static_cast<double>(peak) / static_cast<double>(max), "%");
+        }
+    }
+    std::filesystem::remove_all(dir);
+}
+
+template<typename Fn>
+static double millis(Fn &&fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// открытие файлового хранилища после чистого закрытия и после падения против загрузки
+// тех же записей в обычный KVStorage
+static void benchPersistent() {
+    auto path = std::filesystem::temp_directory_path() / ("kvstorage_bench_heap_" + std::to_string(::getpid()));
+    std::filesystem::remove(path);
+    BenchTime time;
+    const std::string value(100, 'v');
+
+    double build = millis([&] {
+        PersistentKVStorage<BenchClock> store(path, BenchClock{&time}, PersistentOptions{.initial_size = 64 << 20});
+        for (size_t i = 0; i < g_ops; ++i)
+            store.set(benchKey(i), value, i % 4 == 0 ? 100 : 0);
+    });
+    report("persistent", "build " + std::to_string(g_ops) + " entries + clean close", build, "ms");
+    report("persistent", "file size", static_cast<double>(std::filesystem::file_size(path)) / (1 << 20), "MiB");
+
+    double clean = millis([&] {
+        PersistentKVStorage<BenchClock> store(path, BenchClock{&time});
+        store.get(benchKey(g_ops / 2));
+    });
+    report("persistent", "reopen after clean close + first get", clean, "ms");
+
+    // падение: дочерний процесс открывает, пишет и выходит без деструктора
+    inChild([&] {
+        auto *store = new PersistentKVStorage<BenchClock>(path, BenchClock{&time});
+        store->set("crash", value, 0);
+    });
+    double crashed = millis([&] {
+        PersistentKVStorage<BenchClock> store(path, BenchClock{&time});
+        store.get(benchKey(g_ops / 2));
+    });
+    report("persistent", "reopen after crash (recovery pass)", crashed, "ms");
+    std::filesystem::remove(path);
+
+    std::vector<BenchEntry> entries;
+    entries.reserve(g_ops);
+    for (size_t i = 0; i < g_ops; ++i)
+        entries.emplace_back(benchKey(i), value, i % 4 == 0 ? 100 : 0);
+    std::unique_ptr<BenchStorage> loaded;
+    double load = millis([&] { loaded = std::make_unique<BenchStorage>(entries, BenchClock{&time}); });
+    report("persistent", "KVStorage load from entries", load, "ms");
+}
+
+// снапшот: открыть как SnapshotKVStorage против загрузки в KVStorage, точечные чтения, RSS
+static void benchSnapshot() {
+    auto path = std::filesystem::temp_directory_path() / ("kvstorage_bench_snapshot_" + std::to_string(::getpid()));
+    BenchTime time;
+    const std::string value(256, 'v');
+    {
+        auto store = makeStorage(time);
+        for (size_t i = 0; i < g_ops; ++i)
+            store.set(benchKey(i), value, 0);
+        store.saveSnapshot(path);
+    }
+    report("snapshot", "file size", static_cast<double>(std::filesystem::file_size(path)) / (1 << 20), "MiB");
+
+    uint64_t rss_before = currentRss();
+    std::unique_ptr<SnapshotKVStorage<BenchClock> > view;
+    double open = millis([&] { view = std::make_unique<SnapshotKVStorage<BenchClock> >(path, BenchClock{&time}); });
+    report("snapshot", "SnapshotKVStorage open", open, "ms");
+    // рабочий набор - 1% ключей
+    size_t hot = std::max<size_t>(g_ops / 100, 1);
+    double view_get = nsPerOp(g_ops, [&](size_t i) { view->get(benchKey((i * 7919) % hot)); });
+    report("snapshot", "SnapshotKVStorage get (1% working set)", view_get, "ns/op");
+    report("snapshot", "SnapshotKVStorage RSS growth",
+           static_cast<double>(currentRss() - rss_before) / (1 << 20), "MiB");
+    view.reset();
+
+    auto store = makeStorage(time);
+    double load = millis([&] { store.loadSnapshot(path); });
+    report("snapshot", "KVStorage loadSnapshot", load, "ms");
+    double store_get = nsPerOp(g_ops, [&](size_t i) { store.get(benchKey((i * 7919) % hot)); });
+    report("snapshot", "KVStorage get (1% working set)", store_get, "ns/op");
+    // RSS тут не показателен - malloc переиспользует память от сборки снапшота, берем оценку хранилища
+    report("snapshot", "KVStorage memoryUsage", static_cast<double>(store.memoryUsage()) / (1 << 20), "MiB");
+    std::filesystem::remove(path);
+}
+
+// загрузка чанкового снапшота по числу потоков, пропуск протухших чанков, скорость CRC32C
+static void benchSnapshotLoad() {
+    auto path = std::filesystem::temp_directory_path() / ("kvstorage_bench_chunks_" + std::to_string(::getpid()));
+    BenchTime time;
+    const std::string value(512, 'v');
+    {
+        auto store = makeStorage(time);
+        // первая половина ключей (по порядку) живет 10 секунд
+        for (size_t i = 0; i < g_ops; ++i)
+            store.set("key:" + std::to_string(1'000'000'000 + i), value, i < g_ops / 2 ? 10 : 0);
+        store.saveSnapshot(path);
+    }
+    double gib = static_cast<double>(std::filesystem::file_size(path)) / (1 << 30);
+
+    for (unsigned threads: {1u, 2u, 4u, 8u}) {
+        auto store = makeStorage(time);
+        double ms = millis([&] { store.loadSnapshot(path, threads); });
+        report("snapload", "load, threads=" + std::to_string(threads), gib / (ms / 1000), "GiB/s");
+    }
+    time.now = 10;
+    {
+        auto store = makeStorage(time);
+        double ms = millis([&] { store.loadSnapshot(path, 1); });
+        report("snapload", "load, half the chunks expired, threads=1", gib / (ms / 1000), "GiB/s");
+    }
+
+    std::string buffer(64 << 20, 'x');
+    double hw = millis([&] { g_sink = crc32c(buffer.data(), buffer.size()); });
+    double sw = millis([&] {
+        g_sink = crc32cSoftware(reinterpret_cast<const unsigned char *>(buffer.data()), buffer.size(), ~0U);
+    });
+    report("snapload", crc32cHardwareAvailable() ? "crc32c, hardware" : "crc32c (no hardware support)",
+           0.0625 / (hw / 1000), "GiB/s");
+    report("snapload", "crc32c, table", 0.0625 / (sw / 1000), "GiB/s");
+    std::filesystem::remove(path);
+}
+
+// сверка реплик по дереву дайджестов: сколько байт уходит против полной пересылки при разной доле
+// разошедшихся ключей, и сколько дерево добавляет к set
+static void benchMerkle() {
+    BenchTime time;
+    const std::string value(128, 'v');
+    size_t full_dump = 0;
+    for (size_t i = 0; i < g_ops; ++i)
+        full_dump += benchKey(i).size() + value.size() + sizeof(uint64_t);
+    report("merkle", "full dump", static_cast<double>(full_dump) / 1024, "KiB");
+
+    for (double fraction: {0.0001, 0.001, 0.01, 0.1}) {
+        auto primary = makeStorage(time), replica = makeStorage(time);
+        primary.enableRangeDigests(16);
+        replica.enableRangeDigests(16);
+        for (size_t i = 0; i < g_ops; ++i) {
+            primary.set(benchKey(i), value, 0);
+            replica.set(benchKey(i), value, 0);
+        }
+        size_t diverged = std::max<size_t>(static_cast<size_t>(fraction * static_cast<double>(g_ops)), 1);
+        for (size_t i = 0; i < diverged; ++i)
+            primary.set(benchKey((i * 7919) % g_ops), "changed", 0);
+        RangeSyncStats stats;
+        double ms = millis([&] { stats = replica.syncFrom(primary); });
+        std::string label = "diverged " + std::to_string(diverged) + " keys";
+        report("merkle", label + ", exchanged", static_cast<double>(stats.bytes_exchanged) / 1024, "KiB");
+        report("merkle", label + ", sync time", ms, "ms");
+    }
+
+    for (bool digests: {false, true}) {
+        auto store = makeStorage(time);
+        if (digests)
+            store.enableRangeDigests(16);
+        double ns = nsPerOp(g_ops, [&](size_t i) { store.set(benchKey(i), value, 0); });
+        report("merkle", digests ? "set, digests on" : "set, digests off", ns, "ns/op");
+    }
+}
+
+// перенос всех записей между хранилищами: get+set+remove против extract/insert узлов
+static void benchMigrate() {
+    BenchTime time;
+    const std::string value(64, 'v');
+    auto fill = [&](BenchStorage &store) {
+        // половина с ttl, чтобы переезжал и сет протухания
+        for (size_t i = 0; i < g_ops; ++i)
+            store.set(benchKey(i), value, i % 2 == 0 ? 1000 : 0);
+    };
+    auto run = [&](std::string_view label, auto &&migrate) {
+        auto from = makeStorage(time), to = makeStorage(time);
+        fill(from);
+        double ms = millis([&] { migrate(from, to); });
+        report("migrate", label, ms * 1e6 / static_cast<double>(g_ops), "ns/entry");
+    };
+
+    run("get + set + remove", [&](BenchStorage &from, BenchStorage &to) {
+        for (size_t i = 0; i < g_ops; ++i) {
+            auto key = benchKey(i);
+            to.set(key, *from.get(key), i % 2 == 0 ? 1000 : 0);
+            from.remove(key);
+        }
+    });
+    run("extract + insert", [&](BenchStorage &from, BenchStorage &to) {
+        for (size_t i = 0; i < g_ops; ++i)
+            to.insert(from.extract(benchKey(i)));
+    });
+    run("extractRange + insertRange", [&](BenchStorage &from, BenchStorage &to) {
+        to.insertRange(from.extractRange(""));
+    });
+}
+
+// для сравнения: hash-шардирование, скан - k-way слияние сканов всех шардов
+class HashShardedStorage {
+public:
+    HashShardedStorage(size_t shards, BenchTime &time) {
+        for (size_t i = 0; i < shards; ++i)
+            shards_.push_back(std::make_unique<Shard>(time));
+    }
+
+    void set(const std::string &key, const std::string &value) {
+        auto &shard = shardFor(key);
+        std::lock_guard lock(shard.mutex);
+        shard.store.set(key, value, 0);
+    }
+
+    std::vector<std::pair<std::string, std::string> > getManySorted(std::string_view key, uint32_t count) {
+        std::vector<std::vector<std::pair<std::string, std::string> > > parts;
+        for (auto &shard: shards_) {
+            std::lock_guard lock(shard->mutex);
+            parts.push_back(shard->store.getManySorted(key, count));
+        }
+        // (ключ, шард, позиция) - минимальный сверху
+        using Head = std::tuple<std::string_view, size_t, size_t>;
+        std::priority_queue<Head, std::vector<Head>, std::greater<> > heads;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (!parts[i].empty())
+                heads.emplace(parts[i][0].first, i, 0);
+        }
+        std::vector<std::pair<std::string, std::string> > result;
+        while (!heads.empty() && result.size() < count) {
+            auto [k, shard, pos] = heads.top();
+            heads.pop();
+            result.push_back(std::move(parts[shard][pos]));
+            if (pos + 1 < parts[shard].size())
+                heads.emplace(parts[shard][pos + 1].first, shard, pos + 1);
+        }
+        return result;
+    }
+
+private:
+    struct Shard {
+        explicit Shard(BenchTime &time) : store(makeStorage(time)) {
+        }
+
+        std::mutex mutex;
+        BenchStorage store;
+    };
+
+    Shard &shardFor(std::string_view key) {
+        return *shards_[std::hash<std::string_view>{}(key) % shards_.size()];
+    }
+
+    std::vector<std::unique_ptr<Shard> > shards_;
+};
+
+// сканы по range-шардам против hash-шардов с тем же кол-вом шардов, и стоимость set с делением шардов
+static void benchSharding() {
+    BenchTime time;
+    const std::string value(32, 'v');
+    const size_t shards = 16;
+    ShardedKVStorage<BenchClock> ranged(ShardingOptions{std::max<size_t>(g_ops / shards, 64), 1}, BenchClock{&time});
+    HashShardedStorage hashed(shards, time);
+    double ranged_set = nsPerOp(g_ops, [&](size_t i) { ranged.set(benchKey(i), value, 0); });
+    double hashed_set = nsPerOp(g_ops, [&](size_t i) { hashed.set(benchKey(i), value); });
+    report("sharding", "range shards after load", static_cast<double>(ranged.shardCount()), "shards");
+    report("sharding", "set, range-sharded (with splits)", ranged_set, "ns/op");
+    report("sharding", "set, hash-sharded", hashed_set, "ns/op");
+
+    size_t scans = std::max<size_t>(g_ops / 100, 1);
+    for (uint32_t count: {10u, 100u, 1000u}) {
+        double r = nsPerOp(scans, [&](size_t i) {
+            g_sink = g_sink + ranged.getManySorted(benchKey((i * 7919) % g_ops), count).size();
+        });
+        double h = nsPerOp(scans, [&](size_t i) {
+            g_sink = g_sink + hashed.getManySorted(benchKey((i * 7919) % g_ops), count).size();
+        });
+        report("sharding", "scan " + std::to_string(count) + ", range-sharded", r, "ns/op");
+        report("sharding", "scan " + std::to_string(count) + ", hash-sharded", h, "ns/op");
+    }
+}
+
+// вливание батча в 10 раз меньше живого хранилища: set на каждую запись против mergeFrom
+static void benchMerge() {
+    BenchTime time;
+    const std::string value(32, 'v');
+    size_t live_size = g_ops * 10, batch_size = g_ops;
+    // половина батча - обновления существующих ключей, половина - новые; у четверти ttl
+    auto fillLive = [&](BenchStorage &store) {
+        for (size_t i = 0; i < live_size; ++i)
+            store.set(benchKey(i * 2), value, i % 4 == 0 ? 1000 : 0);
+    };
+    auto fillBatch = [&](BenchStorage &store) {
+        for (size_t i = 0; i < batch_size; ++i)
+            store.set(benchKey(i * 20 + (i % 2)), value, i % 4 == 1 ? 2000 : 0);
+    };
+
+    for (bool use_merge: {false, true}) {
+        std::vector<BenchEntry> none;
+        BenchStorage live(none, BenchClock{&time}), batch(none, BenchClock{&time});
+        fillLive(live);
+        double ms = 0;
+        if (use_merge) {
+            fillBatch(batch);
+            ms = millis([&] { live.mergeFrom(std::move(batch), MergePolicy::OtherWins); });
+        } else {
+            ms = millis([&] { fillBatch(live); });
+        }
+        report("merge", use_merge ? "mergeFrom" : "set per entry", ms, "ms");
+    }
+}
+
+// копия шардированного хранилища: сколько стоит сама копия и сколько кусков (и памяти) приходится
+// скопировать после 1% записей - разбросанных по всем ключам и подряд идущих
+static void benchClone() {
+    BenchTime time;
+    const std::string value(64, 'v');
+    size_t diverge = std::max<size_t>(g_ops / 100, 1);
+    for (size_t chunk: {size_t{256}, size_t{64}}) {
+        ShardedKVStorage<BenchClock> live(ShardingOptions{1 << 16, 1 << 13, 64, chunk}, BenchClock{&time});
+        for (size_t i = 0; i < g_ops; ++i)
+            live.set(benchKey(i), value, 0);
+        std::string label = "chunks of " + std::to_string(chunk);
+        auto chunks = static_cast<double>(live.chunkCount());
+        auto bytes = static_cast<double>(live.memoryUsage());
+
+        auto diverged = [&](const ShardedKVStorage<BenchClock> &copy, const std::string &writes) {
+            report("clone", label + ", chunks copied after " + writes,
+                   100.0 * (chunks - static_cast<double>(live.sharedChunkCount())) / chunks, "%");
+            report("clone", label + ", memory overhead after " + writes,
+                   100.0 * static_cast<double>(copy.memoryUsage() - copy.sharedMemoryUsage()) / bytes, "%");
+        };
+
+        std::unique_ptr<ShardedKVStorage<BenchClock> > copy;
+        double clone_ms = millis([&] { copy = std::make_unique<ShardedKVStorage<BenchClock> >(live); });
+        report("clone", label + ", clone", clone_ms * 1000, "us");
+        double scattered_ms = millis([&] {
+            for (size_t i = 0; i < diverge; ++i)
+                copy->set(benchKey((i * 7919) % g_ops), "changed", 0);
+        });
+        report("clone", label + ", 1% scattered writes", scattered_ms, "ms");
+        diverged(*copy, "scattered");
+
+        copy.reset();
+        copy = std::make_unique<ShardedKVStorage<BenchClock> >(live);
+        // подряд по порядку ключей: берем ключи из одного скана
+        auto range = live.getManySorted(benchKey(g_ops / 2), static_cast<uint32_t>(diverge));
+        double clustered_ms = millis([&] {
+            for (auto &[key, val]: range)
+                copy->set(key, "changed", 0);
+        });
+        report("clone", label + ", 1% clustered writes", clustered_ms, "ms");
+        diverged(*copy, "clustered");
+    }
+
+    auto plain = makeStorage(time);
+    for (size_t i = 0; i < g_ops; ++i)
+        plain.set(benchKey(i), value, 0);
+    double deep_ms = millis([&] { auto copy = plain.clone(); });
+    report("clone", "KVStorage clone (full copy, for reference)", deep_ms, "ms");
+}
+
+// RSS хранилища с дедупликацией и без: мало разных значений (флаги), по блобу на тенанта, все разные.
+// Каждый замер в своем процессе, иначе malloc переиспользует память прошлого замера
+static void benchDedup() {
+    struct Dataset {
+        std::string name;
+        size_t distinct;
+        size_t value_size;
+    };
+    std::vector<Dataset> datasets = {
+        {"16 distinct x 64 B", 16, 64},
+        {"1000 tenants x 2 KiB", 1000, 2048},
+        {"all distinct x 64 B", g_ops, 64},
+    };
+    for (auto &dataset: datasets) {
+        for (bool dedup: {false, true}) {
+            inChild([&] {
+                BenchTime time;
+                std::vector<std::string> values;
+                for (size_t i = 0; i < std::min(dataset.distinct, size_t{1000}); ++i)
+                    values.push_back(std::string(dataset.value_size, static_cast<char>('a' + i % 26)) + std::to_string(i));
+                uint64_t before = currentRss();
+                auto store = makeStorage(time);
+                if (dedup)
+                    store.enableValueDedup();
+                double ns = nsPerOp(g_ops, [&](size_t i) {
+                    if (dataset.distinct <= values.size())
+                        store.set(benchKey(i), values[i % dataset.distinct], 0);
+                    else
+                        store.set(benchKey(i), values[i % values.size()] + std::to_string(i), 0);
+                });
+                std::string label = dataset.name + (dedup ? ", dedup" : ", plain");
+                report("dedup", label + ", RSS", static_cast<double>(currentRss() - before) / (1 << 20), "MiB");
+                report("dedup", label + ", set", ns, "ns/op");
+            });
+        }
+    }
+}
+
+// хранилище без ttl (KVStorage<NoExpiry>) против обычного с теми же бессмертными записями:
+// байты на запись (по RSS, в отдельном процессе) и ns на set/get
+template<typename Storage, typename Make>
+static void benchExpiryVariant(std::string_view label, Make &&make) {
+    inChild([&] {
+        const std::string value(16, 'v');
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < g_ops; ++i)
+            keys.push_back(benchKey(i));
+        uint64_t before = currentRss();
+        Storage store = make();
+        double set = nsPerOp(g_ops, [&](size_t i) { store.set(keys[i], value, 0); });
+        double bytes = static_cast<double>(currentRss() - before) / static_cast<double>(g_ops);
+        double get = nsPerOp(g_ops, [&](size_t i) { g_sink = g_sink + store.get(keys[(i * 7919) % g_ops])->size(); });
+        report("noexpiry", std::string(label) + ", RSS per entry", bytes, "B");
+        report("noexpiry", std::string(label) + ", set", set, "ns/op");
+        report("noexpiry", std::string(label) + ", get", get, "ns/op");
+    });
+}
+
+static void benchNoExpiry() {
+    BenchTime time;
+    benchExpiryVariant<BenchStorage>("KVStorage<Clock>", [&] { return makeStorage(time); });
+    benchExpiryVariant<KVStorage<NoExpiry> >("KVStorage<NoExpiry>", [] {
+        std::vector<BenchEntry> entries;
+        return KVStorage<NoExpiry>(entries);
+    });
+}
+
+// сканы по хранилищу с 4 КиБ значениями: полные пары против ключей, ключей с длиной/ttl и 16-байтных кусков
+static void benchProjection() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(std::min<size_t>(g_ops, 50'000), 1);
+    const std::string value(4096, 'v');
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < entries; ++i)
+        store.set(benchKey(i), value, i % 2 == 0 ? 1000 : 0);
+
+    const uint32_t count = 1000;
+    size_t scans = std::max<size_t>(g_ops / 100, 10);
+    auto start = [&](size_t i) { return benchKey((i * 7919) % entries); };
+    report("projection", "getManySorted (key + 4 KiB value)",
+           nsPerOp(scans, [&](size_t i) { g_sink = g_sink + store.getManySorted(start(i), count).size(); }), "ns/scan");
+    report("projection", "getKeysSorted",
+           nsPerOp(scans, [&](size_t i) { g_sink = g_sink + store.getKeysSorted(start(i), count).size(); }), "ns/scan");
+    report("projection", "getKeyInfoSorted (key + size + ttl)",
+           nsPerOp(scans, [&](size_t i) { g_sink = g_sink + store.getKeyInfoSorted(start(i), count).size(); }),
+           "ns/scan");
+    report("projection", "getSlicesSorted (key + 16 B)",
+           nsPerOp(scans, [&](size_t i) { g_sink = g_sink + store.getSlicesSorted(start(i), count, 0, 16).size(); }),
+           "ns/scan");
+}
+
+// сканы с фильтром и агрегаты: выгрузить диапазон и посчитать у себя против того же внутри хранилища
+static void benchPushdown() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(std::min<size_t>(g_ops, 100'000), 1);
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < entries; ++i)
+        store.set(benchKey(i), std::to_string(i % 1000) + (i % 4 == 0 ? "" : std::string(60, '.')), 0);
+
+    // диапазоны - префиксы "key:10".."key:99", клиенту заранее известно сколько в них записей
+    struct Range {
+        std::string from, to;
+        uint32_t entries, matches;
+    };
+    // подходит каждая четвертая запись - чистые числа
+    auto numeric = [](std::string_view, std::string_view value) { return value.back() != '.'; };
+    std::vector<Range> ranges;
+    for (size_t p = 10; p < 99; ++p) {
+        Range r{"key:" + std::to_string(p), "key:" + std::to_string(p + 1), 0, 0};
+        r.entries = static_cast<uint32_t>(store.countRange(r.from, r.to));
+        r.matches = static_cast<uint32_t>(store.countRange(r.from, r.to, numeric));
+        ranges.push_back(std::move(r));
+    }
+    size_t scans = std::max<size_t>(g_ops / 200, 10);
+    auto parse = [](std::string_view value) {
+        double number = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+        return error == std::errc() && end == value.data() + value.size() ? number : 0.0;
+    };
+
+    auto clientFilter = [&](size_t i) {
+        auto &r = ranges[i % ranges.size()];
+        size_t n = 0;
+        for (auto &[key, value]: store.getManySorted(r.from, r.entries))
+            n += numeric(key, value);
+        g_sink = g_sink + n;
+    };
+    auto pushedFilter = [&](size_t i) {
+        auto &r = ranges[i % ranges.size()];
+        g_sink = g_sink + store.getManySortedIf(r.from, r.matches, numeric).size();
+    };
+    auto pushedCount = [&](size_t i) {
+        auto &r = ranges[i % ranges.size()];
+        g_sink = g_sink + store.countRange(r.from, r.to, numeric);
+    };
+    report("pushdown", "filter: getManySorted + client", nsPerOp(scans, clientFilter), "ns/scan");
+    report("pushdown", "filter: getManySortedIf", nsPerOp(scans, pushedFilter), "ns/scan");
+    report("pushdown", "filter: countRange", nsPerOp(scans, pushedCount), "ns/scan");
+    report("pushdown", "filter: getManySorted + client", allocsPerOp(scans, clientFilter), "allocs/scan");
+    report("pushdown", "filter: getManySortedIf", allocsPerOp(scans, pushedFilter), "allocs/scan");
+    report("pushdown", "filter: countRange", allocsPerOp(scans, pushedCount), "allocs/scan");
+
+    auto clientSum = [&](size_t i) {
+        auto &r = ranges[i % ranges.size()];
+        double sum = 0;
+        for (auto &[key, value]: store.getManySorted(r.from, r.entries))
+            sum += parse(value);
+        g_sink = g_sink + static_cast<uint64_t>(sum);
+    };
+    auto pushedSum = [&](size_t i) {
+        auto &r = ranges[i % ranges.size()];
+        g_sink = g_sink + static_cast<uint64_t>(store.aggregateRange(r.from, r.to).sum);
+    };
+    report("pushdown", "sum: getManySorted + client", nsPerOp(scans, clientSum), "ns/scan");
+    report("pushdown", "sum: aggregateRange", nsPerOp(scans, pushedSum), "ns/scan");
+    report("pushdown", "sum: getManySorted + client", allocsPerOp(scans, clientSum), "allocs/scan");
+    report("pushdown", "sum: aggregateRange", allocsPerOp(scans, pushedSum), "allocs/scan");
+}
+
+// KEYS-шаблоны: цена должна идти от диапазона с литеральным префиксом, а не от размера хранилища
+static void benchPattern() {
+    BenchTime time;
+    size_t users = std::max<size_t>(std::min<size_t>(g_ops, 100'000), 1);
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < users; ++i) {
+        store.set("user:" + std::to_string(i) + ":cart", "c", i % 10 == 0 ? 1000 : 0);
+        store.set("user:" + std::to_string(i) + ":name", "n", 0);
+        store.set("order:" + std::to_string(i), "o", 0);
+    }
+    size_t scans = std::max<size_t>(g_ops / 2000, 5);
+    const uint32_t limit = 1u << 30;
+    KeyPattern narrow("user:12*:cart");
+    report("pattern", "store entries", static_cast<double>(store.size()), "entries");
+    report("pattern", "user:12*:cart matches", static_cast<double>(store.scanPattern(narrow, limit).size()), "keys");
+    report("pattern", "*:cart (full sweep)",
+           nsPerOp(scans, [&](size_t) { g_sink = g_sink + store.scanPattern("*:cart", limit).size(); }), "ns/scan");
+    report("pattern", "user:*:cart",
+           nsPerOp(scans, [&](size_t) { g_sink = g_sink + store.scanPattern("user:*:cart", limit).size(); }), "ns/scan");
+    report("pattern", "user:12*:cart",
+           nsPerOp(scans * 20, [&](size_t) { g_sink = g_sink + store.scanPattern(narrow, limit).size(); }), "ns/scan");
+    report("pattern", "user:12*:cart (match every key instead)", nsPerOp(scans, [&](size_t) {
+        size_t n = 0;
+        for (auto &key: store.getKeysSorted("", static_cast<uint32_t>(store.size())))
+            n += narrow.matches(key);
+        g_sink = g_sink + n;
+    }), "ns/scan");
+}
+
+// сотня диапазонов разом: цикл getManySorted против getManySortedMulti
+static void benchMultiScan() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(std::min<size_t>(g_ops * 2, 400'000), 1000);
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < entries; ++i)
+        store.set(benchKey(i), "value", 0);
+
+    size_t batches = std::max<size_t>(g_ops / 100, 10);
+    auto sorted = store.getKeysSorted("", static_cast<uint32_t>(entries));
+    // начала - каждый stride-й ключ по порядку, с offset; stride 10 при count 10 - диапазоны встык
+    auto run = [&](std::string_view label, size_t offset, size_t stride, uint32_t count) {
+        std::vector<std::string> starts;
+        for (size_t i = 0; i < 100; ++i)
+            starts.push_back(sorted[(offset + i * stride) % entries]);
+        // порядок запросов у клиента произвольный
+        std::shuffle(starts.begin(), starts.end(), std::mt19937(42));
+        std::vector<ScanRange> ranges;
+        for (auto &start: starts)
+            ranges.push_back({start, count});
+        report("multiscan", std::string(label) + ": loop", nsPerOp(batches, [&](size_t) {
+            for (auto &range: ranges)
+                g_sink = g_sink + store.getManySorted(range.from, range.count).size();
+        }), "ns/batch");
+        report("multiscan", std::string(label) + ": getManySortedMulti", nsPerOp(batches, [&](size_t) {
+            g_sink = g_sink + store.getManySortedMulti(ranges).entries.size();
+        }), "ns/batch");
+        report("multiscan", std::string(label) + ": loop", allocsPerOp(batches, [&](size_t) {
+            for (auto &range: ranges)
+                g_sink = g_sink + store.getManySorted(range.from, range.count).size();
+        }), "allocs/batch");
+        report("multiscan", std::string(label) + ": getManySortedMulti", allocsPerOp(batches, [&](size_t) {
+            g_sink = g_sink + store.getManySortedMulti(ranges).entries.size();
+        }), "allocs/batch");
+    };
+    run("100 x 10, spread", 0, entries / 100, 10);
+    run("100 x 10, back to back", entries / 2, 10, 10);
+}
+
+// сканы по 1000 записей: вектор пар строк на каждый вызов против одного переиспользуемого ScanResult
+static void benchScanBuffer() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(std::min<size_t>(g_ops, 100'000), 1);
+    auto store = makeStorage(time);
+    // ключи и значения длиннее SSO, иначе вектор тоже почти не аллоцирует
+    for (size_t i = 0; i < entries; ++i)
+        store.set("scan-buffer-key:" + benchKey(i), std::string(64, 'v'), 0);
+
+    const uint32_t count = 1000;
+    size_t scans = std::max<size_t>(g_ops / 100, 10);
+    std::vector<std::string> starts;
+    for (size_t i = 0; i < 64; ++i)
+        starts.push_back("scan-buffer-key:" + benchKey((i * 7919) % entries));
+    auto vectorScan = [&](size_t i) {
+        auto result = store.getManySorted(starts[i % starts.size()], count);
+        g_sink = g_sink + result.size() + result.back().second.size();
+    };
+    ScanResult out;
+    auto bufferScan = [&](size_t i) {
+        store.getManySorted(starts[i % starts.size()], count, out);
+        g_sink = g_sink + out.size() + out.value(out.size() - 1).size();
+    };
+    bufferScan(0);  // прогрев: буфер дорастает до размера ответа
+    report("scanbuffer", "vector<pair<string, string>>", nsPerOp(scans, vectorScan), "ns/scan");
+    report("scanbuffer", "ScanResult (reused)", nsPerOp(scans, bufferScan), "ns/scan");
+    report("scanbuffer", "vector<pair<string, string>>", allocsPerOp(scans, vectorScan), "allocs/scan");
+    report("scanbuffer", "ScanResult (reused)", allocsPerOp(scans, bufferScan), "allocs/scan");
+}
+
+// выгрузка всего хранилища: страницами getManySorted против колонок exportColumnar
+static void benchColumnar() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(std::min<size_t>(g_ops * 2, 1'000'000), 1);
+    auto store = makeStorage(time);
+    for (size_t i = 0; i < entries; ++i)
+        store.set(benchKey(i), std::string(24 + i % 40, 'v'), i % 2 == 0 ? 1000 : 0);
+
+    const uint32_t page = 1 << 16;
+    auto rowsPerSec = [&](double ms) { return static_cast<double>(entries) / (ms / 1000.0); };
+    report("columnar", "row-wise (getManySorted pages)", rowsPerSec(millis([&] {
+        std::string cursor;
+        size_t rows = 0;
+        while (true) {
+            auto part = store.getManySorted(cursor, page);
+            rows += part.size();
+            if (part.size() < page)
+                break;
+            cursor = part.back().first + '\0';
+        }
+        g_sink = g_sink + rows;
+    })), "rows/s");
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads: {1u, cores}) {
+        std::atomic<size_t> rows{0};
+        double ms = millis([&] {
+            store.exportColumnar([&](size_t, ColumnarBatch &&batch) { rows += static_cast<size_t>(batch.length); },
+                                 ColumnarOptions{page, threads});
+        });
+        g_sink = g_sink + rows;
+        report("columnar", "exportColumnar, threads " + std::to_string(threads), rowsPerSec(ms), "rows/s");
+        if (cores == 1)
+            break;
+    }
+}
+
+// Память на запись при заданных распределениях длин ключей и значений и разных режимах хранилища:
+// RSS, сколько байт отдал malloc (mallinfo2) и разбивка memoryBreakdown по структурам - все на запись.
+// Каждый замер в своем процессе, чтобы куча предыдущего не мешала. Размеры - g_ops и 5 * g_ops.
+struct FootprintShape {
+    std::string_view name;
+    size_t key_min, key_max;      // длина ключа равномерно в [min, max]
+    size_t value_min, value_max;  // длина значения: min + (max - min) * u^3 - короткие чаще длинных
+    uint32_t distinct_values;     // 0 - все разные, иначе значения из пула такого размера
+};
+
+static std::string footprintString(std::mt19937_64 &rng, size_t min, size_t max, double skew, uint64_t tag) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    size_t size = min + static_cast<size_t>(static_cast<double>(max - min) * std::pow(u, skew));
+    std::string s = std::to_string(tag) + ':';
+    s.resize(std::max(size, s.size()), 'x');
+    return s;
+}
+
+template<typename Storage, typename Make>
+static void footprintRun(std::string_view layout, const FootprintShape &shape, size_t entries, uint32_t ttl,
+                         Make &&make, bool dedup = false, bool digests = false) {
+    inChild([&] {
+        std::mt19937_64 rng(entries);
+        std::vector<std::string> pool;
+        for (uint32_t i = 0; i < shape.distinct_values; ++i)
+            pool.push_back(footprintString(rng, shape.value_min, shape.value_max, 3, i));
+        ::malloc_trim(0);
+        uint64_t rss_before = currentRss();
+        size_t heap_before = ::mallinfo2().uordblks;
+        Storage store = make();
+        if (dedup)
+            store.enableValueDedup();
+        if (digests)
+            store.enableRangeDigests();
+        for (size_t i = 0; i < entries; ++i) {
+            // уникальный номер в начале ключа, хвост добивает до нужной длины
+            std::string key = footprintString(rng, shape.key_min, shape.key_max, 1, i);
+            if (pool.empty())
+                store.set(key, footprintString(rng, shape.value_min, shape.value_max, 3, i), ttl);
+            else
+                store.set(key, pool[rng() % pool.size()], ttl);
+        }
+        double n = static_cast<double>(entries);
+        auto breakdown = store.memoryBreakdown();
+        std::string prefix = std::string(layout) + ", " + std::string(shape.name) + ", " + std::to_string(entries)
+                             + ": ";
+        report("footprint", prefix + "RSS", static_cast<double>(currentRss() - rss_before) / n, "B/entry");
+        report("footprint", prefix + "malloc",
+               static_cast<double>(::mallinfo2().uordblks - heap_before) / n, "B/entry");
+        report("footprint", prefix + "breakdown total", static_cast<double>(breakdown.total()) / n, "B/entry");
+        report("footprint", prefix + "kv_map_ nodes", static_cast<double>(breakdown.map_nodes) / n, "B/entry");
+        report("footprint", prefix + "expiration_set_ nodes", static_cast<double>(breakdown.expiry_nodes) / n,
+               "B/entry");
+        report("footprint", prefix + "key heap", static_cast<double>(breakdown.key_heap) / n, "B/entry");
+        report("footprint", prefix + "value heap", static_cast<double>(breakdown.value_heap) / n, "B/entry");
+        report("footprint", prefix + "indexes", static_cast<double>(breakdown.indexes) / n, "B/entry");
+        report("footprint", prefix + "bookkeeping (part of nodes + indexes)",
+               static_cast<double>(breakdown.bookkeeping) / n, "B/entry");
+        report("footprint", prefix + "memoryUsage estimate", static_cast<double>(store.memoryUsage()) / n,
+               "B/entry");
+    });
+}
+
+static void benchFootprint() {
+    BenchTime time;
+    auto clocked = [&] { return makeStorage(time); };
+    auto noExpiry = [] {
+        std::vector<BenchEntry> entries;
+        return KVStorage<NoExpiry>(entries);
+    };
+    const FootprintShape small{"key 8-24, value 1-15 (sso)", 8, 24, 1, 15, 0};
+    const FootprintShape medium{"key 16-48, value 16-256", 16, 48, 16, 256, 0};
+    const FootprintShape repeated{"key 16-48, value 16-256 of 1000", 16, 48, 16, 256, 1000};
+    for (size_t entries: {g_ops, 5 * g_ops}) {
+        // распределения - на обычном хранилище без ttl
+        footprintRun<BenchStorage>("KVStorage", small, entries, 0, clocked);
+        footprintRun<BenchStorage>("KVStorage", medium, entries, 0, clocked);
+        // режимы - на одном распределении
+        footprintRun<BenchStorage>("KVStorage, all ttl", medium, entries, 1000, clocked);
+        footprintRun<KVStorage<NoExpiry> >("KVStorage<NoExpiry>", medium, entries, 0, noExpiry);
+        footprintRun<BenchStorage>("KVStorage, digests", medium, entries, 0, clocked, false, true);
+        footprintRun<BenchStorage>("KVStorage", repeated, entries, 0, clocked);
+        footprintRun<BenchStorage>("KVStorage, dedup", repeated, entries, 0, clocked, true);
+    }
+}
+
+// Откуда берется время основных операций: ns и аппаратные счетчики на операцию.
+// Ключи читаются вразброс, так что промахи кэша и TLB - от спуска по дереву, а не от порядка обхода.
+static void benchCounters() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(g_ops, 1);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < entries; ++i)
+        keys.push_back(benchKey(i));
+    auto spread = [&](size_t i) -> const std::string & { return keys[(i * 7919) % entries]; };
+    const std::string value(32, 'v');
+
+    auto store = makeStorage(time);
+    reportCounters("counters", "set (insert)", entries, [&](size_t i) { store.set(spread(i), value, 0); });
+    reportCounters("counters", "set (update)", entries, [&](size_t i) { store.set(spread(i), value, 0); });
+    reportCounters("counters", "get", entries, [&](size_t i) { g_sink = g_sink + store.get(spread(i))->size(); });
+    size_t scans = std::max<size_t>(entries / 100, 1);
+    reportCounters("counters", "getManySorted (100)", scans, [&](size_t i) {
+        g_sink = g_sink + store.getManySorted(spread(i), 100).size();
+    });
+
+    // все с ttl, время сдвинуто за смерть - чистая вычистка
+    auto expiring = makeStorage(time);
+    for (size_t i = 0; i < entries; ++i)
+        expiring.set(spread(i), value, 1 + i % 1000);
+    time.now += 1001;
+    reportCounters("counters", "removeOneExpiredEntry", entries, [&](size_t) {
+        g_sink = g_sink + expiring.removeOneExpiredEntry().has_value();
+    });
+}
+
+// Конкуренция на ShardedKVStorage: потоки x смеси операций, пропускная способность без профиля и с ним,
+// и самые горячие блокировки по профилю. Половина обращений идет в 1% ключей - горячий диапазон.
+struct ContentionMix {
+    std::string_view name;
+    uint32_t read, write, scan;  // проценты, остаток - вычистка протухших
+};
+
+static void benchContention() {
+    BenchTime time;
+    size_t entries = std::max<size_t>(g_ops, 1000);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < entries; ++i)
+        keys.push_back(benchKey(i));
+    // по порядку ключей, чтобы горячий 1% был одним диапазоном
+    std::sort(keys.begin(), keys.end());
+    const std::string value(32, 'v');
+    const ContentionMix mixes[] = {
+        {"read 95 / write 5", 95, 5, 0},
+        {"read 50 / write 50", 50, 50, 0},
+        {"read 80 / write 10 / scan 10", 80, 10, 10},
+        {"read 60 / write 20 / expire 20", 60, 20, 0},
+    };
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+
+    auto run = [&](const ContentionMix &mix, unsigned threads, bool profiled, bool print_hot) {
+        time.now = 0;
+        ShardedKVStorage<BenchClock> store(ShardingOptions{std::max<size_t>(entries / 16, 64), 1}, BenchClock{&time});
+        for (size_t i = 0; i < entries; ++i)
+            store.set(keys[i], value, 0);
+        // запас протухших для вычистки
+        for (size_t i = 0; i < entries / 4; ++i)
+            store.set("expired:" + keys[i], value, 1);
+        time.now = 2;
+        store.enableLockProfiling(profiled);
+
+        size_t per_thread = std::max<size_t>(g_ops / threads, 1);
+        double ms = millis([&] {
+            std::vector<std::thread> pool;
+            for (unsigned t = 0; t < threads; ++t) {
+                pool.emplace_back([&, t] {
+                    std::mt19937_64 rng(t + 1);
+                    uint64_t sink = 0;
+                    for (size_t i = 0; i < per_thread; ++i) {
+                        uint64_t r = rng();
+                        size_t hot = entries / 100 + 1;
+                        const std::string &key = keys[(r & 1) ? (r >> 8) % hot : (r >> 8) % entries];
+                        uint32_t dice = static_cast<uint32_t>((r >> 1) % 100);
+                        if (dice < mix.read)
+                            sink += store.get(key).has_value();
+                        else if (dice < mix.read + mix.write)
+                            store.set(key, value, 0);
+                        else if (dice < mix.read + mix.write + mix.scan)
+                            sink += store.getManySorted(key, 20).size();
+                        else
+                            sink += store.removeOneExpiredEntry().has_value();
+                    }
+                    g_sink = g_sink + sink;
+                });
+            }
+            for (auto &thread: pool)
+                thread.join();
+        });
+        double ops_per_sec = static_cast<double>(per_thread * threads) / (ms / 1000.0);
+        report("contention", std::string(mix.name) + ", " + std::to_string(threads) + " threads"
+                             + (profiled ? ", profiled" : ""), ops_per_sec, "ops/s");
+        if (!print_hot)
+            return;
+        auto profile = store.lockProfile();
+        for (size_t i = 0; i < std::min<size_t>(profile.size(), 3); ++i) {
+            auto &lock = profile[i];
+            double n = static_cast<double>(std::max<uint64_t>(lock.acquisitions, 1));
+            report("contention", "  hot " + lock.name + ": contended", 100.0 * static_cast<double>(lock.contended) / n,
+                   "%");
+            report("contention", "  hot " + lock.name + ": wait", static_cast<double>(lock.wait_ns) / 1e6, "ms");
+            report("contention", "  hot " + lock.name + ": hold", static_cast<double>(lock.hold_ns) / 1e6, "ms");
+        }
+    };
+
+    for (auto &mix: mixes) {
+        for (unsigned threads: {1u, 2u, 4u, 8u})
+            run(mix, threads, false, false);
+        // цена профиля и кто горячий - на самом большом кол-ве потоков
+        unsigned threads = std::max(8u, cores);
+        run(mix, threads, true, true);
+    }
+}
+
+// Много записей с ttl и часы, которые идут шагами: как быстро вычищается, что с задержками get/set
+// во время вычистки, сколько памяти возвращается и сколько протухших все еще лежит. Вычистка на шаг
+// ограничена (1/8 записей), так что всплески смертей копятся. Хранилища: KVStorage c reapExpired
+// пачками, KVStorage c removeOneExpiredEntry по одной, ShardedKVStorage (у него только по одной)
+// и PersistentKVStorage со своим списком смертей в файле (тоже по одной).
+enum class ExpiryBackend { Reap, RemoveOne, Sharded, Persistent };
+
+static double percentile(std::vector<double> &samples, double p) {
+    if (samples.empty())
+        return 0;
+    size_t i = std::min(samples.size() - 1, static_cast<size_t>(p * static_cast<double>(samples.size())));
+    std::nth_element(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(i), samples.end());
+    return samples[i];
+}
+
+template<typename Storage, ExpiryBackend backend>
+static void expiryRun(std::string_view label, bool clustered, size_t entries) {
+    auto path = std::filesystem::temp_directory_path() / ("kvstorage_bench_expiry_" + std::to_string(::getpid()));
+    std::filesystem::remove(path);
+    inChild([&] {
+        const uint64_t horizon = 1000;
+        const size_t steps = 8;
+        BenchTime time;
+        std::mt19937_64 rng(7);
+        // смерти: равномерно по горизонту или 90% в трех всплесках (+-5)
+        std::vector<uint32_t> ttls(entries);
+        for (auto &ttl: ttls) {
+            if (!clustered || rng() % 10 == 0)
+                ttl = static_cast<uint32_t>(1 + rng() % horizon);
+            else
+                ttl = static_cast<uint32_t>(std::array<uint64_t, 3>{150, 500, 850}[rng() % 3] + rng() % 11 - 5);
+        }
+        std::vector<uint32_t> deaths = ttls;
+        std::sort(deaths.begin(), deaths.end());
+        const std::string value(32, 'v');
+
+        auto store = [&] {
+            if constexpr (backend == ExpiryBackend::Sharded)
+                return Storage(ShardingOptions{std::max<size_t>(entries / 16, 64), 1}, BenchClock{&time});
+            else if constexpr (backend == ExpiryBackend::Persistent)
+                return Storage(path, BenchClock{&time}, PersistentOptions{.initial_size = 64 << 20});
+            else
+                return makeStorage(time);
+        }();
+        uint64_t rss_start = currentRss();
+        double load = millis([&] {
+            for (size_t i = 0; i < entries; ++i)
+                store.set(benchKey(i), value, ttls[i]);
+        });
+        std::string prefix = std::string(label) + (clustered ? ", clustered" : ", uniform") + ": ";
+        report("expiry", prefix + "load", static_cast<double>(entries) / (load / 1000.0), "entries/s");
+        report("expiry", prefix + "RSS after load", static_cast<double>(currentRss() - rss_start) / 1048576.0, "MiB");
+
+        auto drainOne = [&]() -> size_t {
+            if constexpr (backend == ExpiryBackend::Reap)
+                return store.reapExpired(1000);
+            else {
+                size_t drained = 0;
+                for (; drained < 1000 && store.removeOneExpiredEntry(); ++drained) {
+                }
+                return drained;
+            }
+        };
+        size_t budget = entries / 8, fresh = 0, drained_total = 0;
+        double drain_ms = 0;
+        std::vector<double> get_ns, set_ns;
+        for (size_t step = 1; step <= steps; ++step) {
+            time.now = horizon * step / steps;
+            // живые по нашему списку смертей, остальное в хранилище сверх них и свежих - протухшее
+            size_t live = static_cast<size_t>(deaths.end() - std::upper_bound(deaths.begin(), deaths.end(), time.now));
+            size_t backlog_before = store.size() - live - fresh;
+            size_t drained_step = 0;
+            while (drained_step < budget) {
+                auto start = std::chrono::steady_clock::now();
+                size_t drained = drainOne();
+                drain_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                drained_step += drained;
+                // между пачками вычистки - обычный трафик
+                for (int op = 0; op < 20; ++op) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    g_sink = g_sink + store.get(benchKey(rng() % entries)).has_value();
+                    auto t1 = std::chrono::steady_clock::now();
+                    store.set("fresh:" + std::to_string(fresh++), value, 0);
+                    auto t2 = std::chrono::steady_clock::now();
+                    get_ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+                    set_ns.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
+                }
+                if (drained < 1000)
+                    break;
+            }
+            drained_total += drained_step;
+            std::string at = prefix + "t=" + std::to_string(time.now) + " ";
+            report("expiry", at + "expired resident before drain", static_cast<double>(backlog_before), "entries");
+            report("expiry", at + "expired resident after drain",
+                   static_cast<double>(store.size() - live - fresh), "entries");
+            if constexpr (backend == ExpiryBackend::Persistent)
+                report("expiry", at + "file size", static_cast<double>(store.fileSize()) / 1048576.0, "MiB");
+            else if constexpr (backend != ExpiryBackend::Sharded)
+                report("expiry", at + "memoryUsage", static_cast<double>(store.memoryUsage()) / 1048576.0, "MiB");
+            report("expiry", at + "RSS", static_cast<double>(currentRss() - rss_start) / 1048576.0, "MiB");
+        }
+        // glibc держит освобожденное у себя, RSS падает только после malloc_trim
+        ::malloc_trim(0);
+        report("expiry", prefix + "RSS after malloc_trim", static_cast<double>(currentRss() - rss_start) / 1048576.0,
+               "MiB");
+        report("expiry", prefix + "drain", static_cast<double>(drained_total) / (drain_ms / 1000.0), "entries/s");
+        report("expiry", prefix + "get during drain p50", percentile(get_ns, 0.5), "ns");
+        report("expiry", prefix + "get during drain p99", percentile(get_ns, 0.99), "ns");
+        report("expiry", prefix + "set during drain p50", percentile(set_ns, 0.5), "ns");
+        report("expiry", prefix + "set during drain p99", percentile(set_ns, 0.99), "ns");
+    });
+    std::filesystem::remove(path);
+}
+
+static void benchExpiry() {
+    size_t entries = std::max<size_t>(5 * g_ops, 1000);
+    for (bool clustered: {false, true}) {
+        expiryRun<BenchStorage, ExpiryBackend::Reap>("reapExpired", clustered, entries);
+        expiryRun<BenchStorage, ExpiryBackend::RemoveOne>("removeOneExpiredEntry", clustered, entries);
+        expiryRun<ShardedKVStorage<BenchClock>, ExpiryBackend::Sharded>("sharded", clustered, entries);
+        expiryRun<PersistentKVStorage<BenchClock>, ExpiryBackend::Persistent>("persistent", clustered, entries);
+    }
+}
+
+struct BenchSection {
+    std::string_view name;
+    std::function<void()> run;
+};
+
+int main(int argc, char **argv) {
+    std::vector<BenchSection> sections = {
+        {"watch", benchWatch},
+        {"hotkeys", benchHotKeys},
+        {"sample", benchSample},
+        {"admission", benchAdmission},
+        {"governor", benchGovernor},
+        {"persistent", benchPersistent},
+        {"snapshot", benchSnapshot},
+        {"snapload", benchSnapshotLoad},
+        {"merkle", benchMerkle},
+        {"migrate", benchMigrate},
+        {"sharding", benchSharding},
+        {"merge", benchMerge},
+        {"clone", benchClone},
+        {"dedup", benchDedup},
+        {"noexpiry", benchNoExpiry},
+        {"projection", benchProjection},
+        {"pushdown", benchPushdown},
+        {"pattern", benchPattern},
+        {"multiscan", benchMultiScan},
+        {"scanbuffer", benchScanBuffer},
+        {"columnar", benchColumnar},
+        {"footprint", benchFootprint},
+        {"counters", benchCounters},
+        {"contention", benchContention},
+        {"expiry", benchExpiry},
+    };
+
+    std::vector<std::string_view> selected;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            g_ops = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--json") {
+            g_json = true;
+        } else {
+            selected.push_back(arg);
+        }
+    }
+
+    for (auto &section: sections) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), section.name) == selected.end())
+            continue;
+        section.run();
+    }
+    return 0;
+}
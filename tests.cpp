@@ -4,7 +4,14 @@
 #include <vector>
 #include <optional>
 #include <limits>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
 #include "KVStorage.cpp"
+#include "MemoryGovernor.h"
+#include "PersistentKVStorage.h"
+#include <sys/wait.h>
+#include <thread>
 #define GTEST_COUT std::cout << "[INFO " << __func__ << ":l" << __LINE__ << "] "
 
 struct FakeTimeManager {
@@ -207,4 +214,1374 @@ TEST(KVStorageTest, TTLComparatorTest) {
 
     expired = store.removeOneExpiredEntry();
     EXPECT_EQ(expired, std::nullopt);
-}
\ No newline at end of file
+}
+TEST(KVStorageTest, WatchPrefixAndKey) {
+    std::vector<Entry> entries = {
+        {"user:1", "a", 0},
+        {"order:1", "b", 3}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+
+    std::vector<WatchNotification> users, order;
+    auto usersId = store.watch("user:", WatchMode::Prefix, &users);
+    store.watch("order:1", WatchMode::Key, &order);
+
+    store.set("user:2", "c", 0);
+    store.set("order:10", "d", 0);  // точная подписка на order:1 сюда не смотрит
+    EXPECT_TRUE(store.remove("user:1"));
+    ASSERT_EQ(users.size(), 2);
+    EXPECT_EQ(users[0].event, WatchEvent::Set);
+    EXPECT_EQ(users[0].key, "user:2");
+    EXPECT_EQ(users[1].event, WatchEvent::Remove);
+    EXPECT_EQ(users[1].value, "a");
+    EXPECT_TRUE(order.empty());
+
+    // протухание прилетает когда запись вычищают
+    clock.set(3);
+    ASSERT_TRUE(store.removeOneExpiredEntry().has_value());
+    ASSERT_EQ(order.size(), 1);
+    EXPECT_EQ(order[0].event, WatchEvent::Expire);
+    EXPECT_EQ(order[0].key, "order:1");
+
+    EXPECT_TRUE(store.unwatch(usersId));
+    EXPECT_FALSE(store.unwatch(usersId));
+    store.set("user:3", "e", 0);
+    EXPECT_EQ(users.size(), 2);
+}
+
+TEST(KVStorageTest, WatchBatching) {
+    std::vector<Entry> entries;
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+
+    std::vector<size_t> batches;
+    store.setWatchBatchSize(3);
+    store.watch("k", WatchMode::Prefix, [&](std::span<const WatchNotification> batch) {
+        batches.push_back(batch.size());
+    });
+    for (int i = 0; i < 7; ++i)
+        store.set("k" + std::to_string(i), "v", 0);
+    EXPECT_EQ(batches, (std::vector<size_t>{3, 3}));
+
+    store.flushWatches();
+    EXPECT_EQ(batches, (std::vector<size_t>{3, 3, 1}));
+}
+
+TEST(KVStorageTest, OneShotWatchesUnwatchThemselves) {
+    std::vector<Entry> entries;
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+
+    // одноразовые подписки: отписываются прямо в колбэке, одна еще и подписывает новую
+    std::vector<WatchId> ids(4);
+    std::vector<int> fired(4, 0);
+    int late = 0;
+    for (int i = 0; i < 4; ++i) {
+        ids[i] = store.watch("user:", WatchMode::Prefix, [&, i](std::span<const WatchNotification>) {
+            ++fired[i];
+            EXPECT_TRUE(store.unwatch(ids[i]));
+            if (i == 0)
+                store.watch("user:", WatchMode::Prefix, [&](std::span<const WatchNotification>) { ++late; });
+        });
+    }
+    EXPECT_NO_THROW(store.set("user:1", "a", 0));
+    EXPECT_EQ(fired, (std::vector<int>{1, 1, 1, 1}));
+    store.set("user:2", "b", 0);
+    EXPECT_EQ(fired, (std::vector<int>{1, 1, 1, 1}));
+    EXPECT_EQ(late, 1);
+
+    // то же в пачках через flushWatches: колбэк отписывает соседа
+    store.setWatchBatchSize(10);
+    WatchId second = 0;
+    int first_calls = 0, second_calls = 0;
+    store.watch("k", WatchMode::Prefix, [&](std::span<const WatchNotification>) {
+        ++first_calls;
+        store.unwatch(second);
+    });
+    second = store.watch("k", WatchMode::Prefix, [&](std::span<const WatchNotification>) { ++second_calls; });
+    store.set("k1", "v", 0);
+    EXPECT_NO_THROW(store.flushWatches());
+    EXPECT_EQ(first_calls, 1);
+    // сосед либо успел получить свою пачку до отписки, либо получил ее напоследок при отписке
+    EXPECT_EQ(second_calls, 1);
+}
+
+TEST(KVStorageTest, HotKeyTracking) {
+    std::vector<Entry> entries = {
+        {"user:1:cart", "xx", 0},
+        {"user:2:cart", "yy", 0},
+        {"order:1", "zzzz", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    EXPECT_TRUE(store.hotKeys(3).empty());
+
+    // без сэмплирования, чтобы цифры были точными
+    store.enableHotKeyTracking(HotKeyOptions{.sample_every = 1, .top_capacity = 8});
+    for (int i = 0; i < 100; ++i)
+        store.get("user:1:cart");
+    for (int i = 0; i < 30; ++i)
+        store.get("user:2:cart");
+    for (int i = 0; i < 50; ++i)
+        store.set("order:1", "zzzz", 0);
+
+    auto keys = store.hotKeys(2);
+    ASSERT_EQ(keys.size(), 2);
+    EXPECT_EQ(keys[0].key, "user:1:cart");
+    EXPECT_EQ(keys[0].hits, 100);
+    EXPECT_EQ(keys[0].bytes, 100 * (11 + 2));
+    EXPECT_EQ(keys[1].key, "order:1");
+
+    auto prefixes = store.hotPrefixes(1);
+    ASSERT_EQ(prefixes.size(), 1);
+    EXPECT_EQ(prefixes[0].key, "user:");
+    EXPECT_EQ(prefixes[0].hits, 130);
+
+    EXPECT_GE(store.estimateKeyHits("user:2:cart"), 30);
+    store.disableHotKeyTracking();
+    EXPECT_EQ(store.estimateKeyHits("user:2:cart"), 0);
+}
+
+TEST(KVStorageTest, SpaceSavingKeepsHeavyHitters) {
+    SpaceSavingTopK topK(8);
+    // тяжелые элементы вперемешку с кучей одиночек
+    for (int i = 0; i < 1000; ++i) {
+        topK.add("heavy", 1, 0);
+        if (i % 2 == 0)
+            topK.add("medium", 1, 0);
+        topK.add("noise" + std::to_string(i), 1, 0);
+    }
+    auto top = topK.top(2);
+    ASSERT_EQ(top.size(), 2);
+    EXPECT_EQ(top[0].key, "heavy");
+    EXPECT_EQ(top[1].key, "medium");
+    EXPECT_GE(top[0].hits, 1000);
+    EXPECT_LE(top[0].hits - top[0].error, 1000);
+}
+
+TEST(KVStorageTest, SampleIsUniformOverLiveEntries) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 10; ++i)
+        entries.emplace_back("k" + std::to_string(i), std::to_string(i), i < 3 ? 1 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    store.remove("k9");  // дырка в индексе выборки должна закрыться
+    clock.set(1);        // k0..k2 протухли, живы k3..k8
+
+    EXPECT_TRUE(store.sample(0).empty());
+    auto all = store.sample(100);
+    EXPECT_EQ(all.size(), 6);
+
+    store.seedSampler(42);
+    std::map<std::string, int> hits;
+    const int rounds = 60000;
+    for (int i = 0; i < rounds; ++i) {
+        auto one = store.sample(1);
+        ASSERT_EQ(one.size(), 1);
+        ++hits[one[0].first];
+    }
+    ASSERT_EQ(hits.size(), 6);
+    // хи-квадрат с 5 степенями свободы, 20.5 - это p ~ 0.001
+    double expected = rounds / 6.0, chi2 = 0;
+    for (auto &[key, count]: hits) {
+        EXPECT_GE(key, "k3");
+        chi2 += (count - expected) * (count - expected) / expected;
+    }
+    EXPECT_LT(chi2, 20.5);
+
+    // выборка размером с хранилище - все живые записи ровно по разу
+    std::vector<Entry> many;
+    for (int i = 0; i < 1000; ++i)
+        many.emplace_back("m" + std::to_string(i), "v", i % 4 == 0 ? 1 : 0);
+    KVStorage<FakeClock> big(many, clock);
+    for (int i = 0; i < 1000; i += 4)
+        big.set("m" + std::to_string(i), "v", 0);
+    auto every = big.sample(static_cast<uint32_t>(big.size()));
+    std::set<std::string> keys;
+    for (auto &[key, value]: every)
+        keys.insert(key);
+    EXPECT_EQ(every.size(), 1000);
+    EXPECT_EQ(keys.size(), 1000);
+    clock.set(2);
+    big.set("fresh", "v", 1);  // протухнет на 3, до этого жива
+    clock.set(3);
+    EXPECT_EQ(big.sample(2000).size(), 1000);
+}
+
+TEST(KVStorageTest, MemoryLimitEvictsExpiredThenLeastRecent) {
+    std::vector<Entry> entries = {
+        {"a", "1", 0},
+        {"b", "2", 0},
+        {"c", "3", 5}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    size_t entrySize = store.memoryUsage() / 3;
+
+    // на выборке из 64 при трех записях приближенный LRU совпадает с честным
+    store.setEvictionSamples(64);
+    store.setMemoryLimit(3 * entrySize);
+    store.get("a");
+
+    // сначала уходит протухшая c, хотя трогали ее позже всех
+    clock.set(5);
+    std::vector<WatchNotification> events;
+    store.watch("", WatchMode::Prefix, &events);
+    EXPECT_TRUE(store.set("d", "4", 0));
+    ASSERT_EQ(events.size(), 2);
+    EXPECT_EQ(events[0].event, WatchEvent::Expire);
+    EXPECT_EQ(events[0].key, "c");
+
+    // дальше самая давно тронутая - b
+    EXPECT_TRUE(store.set("e", "5", 0));
+    EXPECT_EQ(events[2].event, WatchEvent::Evict);
+    EXPECT_EQ(events[2].key, "b");
+    EXPECT_TRUE(store.get("a").has_value());
+    EXPECT_EQ(store.memoryUsage(), 3 * entrySize);
+
+    // не влезающее значение не принимается вовсе
+    EXPECT_FALSE(store.set("big", std::string(4 * entrySize, 'x'), 0));
+    EXPECT_FALSE(store.get("big").has_value());
+
+    // уменьшение лимита вытесняет сразу
+    store.setMemoryLimit(entrySize);
+    EXPECT_EQ(store.memoryUsage(), entrySize);
+}
+
+TEST(KVStorageTest, TinyLfuRejectsOneHitWonders) {
+    std::vector<Entry> entries;
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    store.set("hot1", "v", 0);
+    size_t entrySize = store.memoryUsage();
+    store.remove("hot1");
+
+    // фильтр сидит в том же лимите, так что место под две записи - поверх него
+    store.setMemoryLimit(2 * entrySize, EvictionPolicy::TinyLfu);
+    size_t filter = store.memoryUsage();
+    EXPECT_GT(filter, 0u);
+    store.setMemoryLimit(2 * entrySize + filter, EvictionPolicy::TinyLfu);
+    EXPECT_EQ(store.memoryUsage(), filter);
+    EXPECT_TRUE(store.set("hot1", "v", 0));
+    EXPECT_TRUE(store.set("hot2", "v", 0));
+    for (int i = 0; i < 10; ++i) {
+        store.get("hot1");
+        store.get("hot2");
+    }
+
+    // скан из одноразовых ключей горячих не выдавливает
+    for (int i = 0; i < 100; ++i)
+        EXPECT_FALSE(store.set("scan" + std::to_string(i), "v", 0));
+    EXPECT_TRUE(store.get("hot1").has_value());
+    EXPECT_TRUE(store.get("hot2").has_value());
+
+    // а ключ, который спрашивают чаще горячих, в итоге пускается
+    for (int i = 0; i < 30; ++i)
+        store.get("rising");
+    EXPECT_TRUE(store.set("rising", "v", 0));
+    EXPECT_TRUE(store.get("rising").has_value());
+}
+
+TEST(KVStorageTest, TinyLfuFilterFollowsLimit) {
+    std::vector<Entry> entries;
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+
+    // ~50k записей по оценке лимита: 4-битный скетч + doorkeeper - единицы байт на запись
+    size_t limit = 10 << 20;
+    store.setMemoryLimit(limit, EvictionPolicy::TinyLfu);
+    size_t filter = store.memoryUsage();
+    EXPECT_GT(filter, 0u);
+    EXPECT_LT(filter, limit / 40);
+
+    // мелкие сдвиги лимита (как у MemoryGovernor) фильтр не пересоздают
+    store.setMemoryLimit(limit + limit / 10, EvictionPolicy::TinyLfu);
+    EXPECT_EQ(store.memoryUsage(), filter);
+
+    // а в разы - пересобирают под новый размер
+    store.setMemoryLimit(limit * 8, EvictionPolicy::TinyLfu);
+    EXPECT_GT(store.memoryUsage(), 4 * filter);
+    store.setMemoryLimit(limit / 8, EvictionPolicy::TinyLfu);
+    EXPECT_LT(store.memoryUsage(), filter / 4);
+    EXPECT_EQ(store.memoryBreakdown().entries, 0u);
+
+    store.setMemoryLimit(limit, EvictionPolicy::SampledLru);
+    EXPECT_EQ(store.memoryUsage(), 0u);
+}
+
+// каталог с поддельными файлами cgroup v2
+struct FakeCgroup {
+    std::filesystem::path dir;
+
+    FakeCgroup() : dir(std::filesystem::temp_directory_path() / ("kvstorage_cgroup_" + std::to_string(::getpid()))) {
+        std::filesystem::create_directories(dir);
+    }
+
+    ~FakeCgroup() { std::filesystem::remove_all(dir); }
+
+    void write(const char *name, const std::string &text) const {
+        std::ofstream(dir / name) << text;
+    }
+
+    void pressure(double avg10) const {
+        write("memory.pressure", "some avg10=" + std::to_string(avg10) + " avg60=0.00 avg300=0.00 total=0\n"
+                                 "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    }
+};
+
+TEST(KVStorageTest, MemoryGovernorFollowsCgroup) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 100; ++i)
+        entries.emplace_back("k" + std::to_string(100 + i), std::string(72, 'v'), i < 20 ? 1 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    size_t entrySize = store.memoryUsage() / 100;
+    ASSERT_GT(entrySize, 0);
+
+    FakeCgroup cgroup;
+    MemoryGovernor governor(GovernorOptions{.cgroup_dir = cgroup.dir, .target_fraction = 0.8});
+
+    // файлов нет - governor ничего не делает
+    EXPECT_FALSE(governor.poll(store).available);
+
+    // лимита нет
+    cgroup.write("memory.current", "1000\n");
+    cgroup.write("memory.max", "max\n");
+    cgroup.pressure(0);
+    auto report = governor.poll(store);
+    EXPECT_TRUE(report.available);
+    EXPECT_EQ(report.max, 0);
+    EXPECT_EQ(store.memoryLimit(), 0);
+
+    // cgroup = хранилище + еще 20 записей чужой памяти, цель 80% от лимита в 100 записей:
+    // 20 протухших отдаются первыми, потом вытесняется еще 20 живых
+    clock.set(1);
+    cgroup.write("memory.current", std::to_string(120 * entrySize));
+    cgroup.write("memory.max", std::to_string(100 * entrySize));
+    report = governor.poll(store);
+    EXPECT_EQ(report.target, 80 * entrySize);
+    EXPECT_EQ(report.reaped, 20);
+    EXPECT_EQ(report.evicted, 20);
+    EXPECT_EQ(store.size(), 60);
+    EXPECT_LE(store.memoryUsage(), 60 * entrySize);
+
+    // под давлением цель опускается ниже 80%
+    cgroup.write("memory.current", std::to_string(80 * entrySize));
+    cgroup.pressure(40);
+    report = governor.poll(store);
+    EXPECT_LT(report.target, 80 * entrySize);
+    EXPECT_LT(store.size(), 60);
+
+    // отпустило - лимит хранилища снова растет
+    size_t squeezed = store.memoryLimit();
+    cgroup.write("memory.current", std::to_string(40 * entrySize));
+    cgroup.pressure(0);
+    governor.poll(store);
+    EXPECT_GT(store.memoryLimit(), squeezed);
+}
+
+// временный файл, удаляется вместе с объектом
+struct TempFile {
+    std::filesystem::path path;
+
+    explicit TempFile(const std::string &name)
+        : path(std::filesystem::temp_directory_path() / (name + "_" + std::to_string(::getpid()))) {
+        std::filesystem::remove(path);
+    }
+
+    ~TempFile() { std::filesystem::remove(path); }
+};
+
+TEST(PersistentKVStorageTest, SurvivesReopen) {
+    TempFile file("kvstorage_persistent");
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    {
+        PersistentKVStorage<FakeClock> store(file.path, clock, PersistentOptions{.initial_size = 8192});
+        EXPECT_FALSE(store.recovered());
+        store.set("b", "2", 0);
+        store.set("a", "1", 5);
+        store.set("c", "3", 0);
+        store.set("c", "33", 0);
+        EXPECT_TRUE(store.remove("b"));
+        EXPECT_FALSE(store.remove("b"));
+        // файл дорастает сам
+        for (int i = 0; i < 1000; ++i)
+            store.set("k" + std::to_string(i), std::string(100, 'x'), 0);
+        EXPECT_GT(store.fileSize(), 8192);
+    }
+
+    PersistentKVStorage<FakeClock> store(file.path, clock);
+    EXPECT_FALSE(store.recovered());
+    EXPECT_EQ(store.size(), 1002);
+    EXPECT_EQ(store.get("a").value(), "1");
+    EXPECT_EQ(store.getView("c").value(), "33");
+    EXPECT_FALSE(store.get("b").has_value());
+    auto result = store.getManySorted("b", 2);
+    ASSERT_EQ(result.size(), 2);
+    EXPECT_EQ(result[0], (std::pair{"c", "33"}));
+    EXPECT_EQ(result[1].first, "k0");
+
+    // ttl тоже пережил переоткрытие
+    clock.set(5);
+    EXPECT_FALSE(store.get("a").has_value());
+    auto expired = store.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(expired->first, "a");
+    EXPECT_EQ(store.removeOneExpiredEntry(), std::nullopt);
+}
+
+TEST(PersistentKVStorageTest, RecoversAfterCrash) {
+    TempFile file("kvstorage_persistent_crash");
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+
+    // дочерний процесс пишет и умирает без деструктора
+    pid_t child = ::fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        auto *store = new PersistentKVStorage<FakeClock>(file.path, clock);
+        for (int i = 0; i < 500; ++i)
+            store->set("k" + std::to_string(i), "v" + std::to_string(i), i % 2 == 0 ? 10 : 0);
+        for (int i = 0; i < 500; i += 3)
+            store->remove("k" + std::to_string(i));
+        ::_exit(0);
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+
+    PersistentKVStorage<FakeClock> store(file.path, clock);
+    EXPECT_TRUE(store.recovered());
+    EXPECT_EQ(store.size(), 500 - 167);
+    EXPECT_EQ(store.get("k1").value(), "v1");
+    EXPECT_FALSE(store.get("k3").has_value());
+
+    // восстановленный список по времени смерти рабочий
+    clock.set(10);
+    size_t expired = 0;
+    while (store.removeOneExpiredEntry())
+        ++expired;
+    EXPECT_EQ(expired, 166);
+    EXPECT_EQ(store.size(), 500 - 167 - 166);
+
+    // и освобожденное место переиспользуется
+    size_t size = store.fileSize();
+    for (int i = 0; i < 300; ++i)
+        store.set("n" + std::to_string(i), "v", 0);
+    EXPECT_EQ(store.fileSize(), size);
+}
+
+TEST(PersistentKVStorageTest, RecoversWithStaleHeader) {
+    TempFile file("kvstorage_persistent_stale_header");
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+
+    // падение ОС: страница заголовка на диске осталась такой, какой была при открытии,
+    // а узлы и значения за ее heap_top уже дошли
+    pid_t child = ::fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        auto *store = new PersistentKVStorage<FakeClock>(file.path, clock,
+                                                         PersistentOptions{.durability = Durability::PerWrite});
+        std::string page(4096, '\0');
+        int fd = ::open(file.path.c_str(), O_RDWR);
+        bool ok = ::pread(fd, page.data(), page.size(), 0) == static_cast<ssize_t>(page.size());
+        for (int i = 0; i < 200; ++i)
+            store->set("k" + std::to_string(i), "v" + std::to_string(i), i % 2 == 0 ? 10 : 0);
+        ok = ok && ::pwrite(fd, page.data(), page.size(), 0) == static_cast<ssize_t>(page.size());
+        ::_exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    PersistentKVStorage<FakeClock> store(file.path, clock);
+    EXPECT_TRUE(store.recovered());
+    EXPECT_EQ(store.size(), 200);
+
+    // новые блоки не должны лечь поверх живых
+    for (int i = 0; i < 200; ++i)
+        store.set("n" + std::to_string(i), std::string(i, 'x'), 0);
+    EXPECT_EQ(store.size(), 400);
+    for (int i = 0; i < 200; ++i) {
+        EXPECT_EQ(store.get("k" + std::to_string(i)).value(), "v" + std::to_string(i));
+        EXPECT_EQ(store.get("n" + std::to_string(i)).value(), std::string(i, 'x'));
+    }
+    clock.set(10);
+    size_t expired = 0;
+    while (store.removeOneExpiredEntry())
+        ++expired;
+    EXPECT_EQ(expired, 100);
+}
+
+TEST(KVStorageTest, SnapshotRoundTrip) {
+    std::vector<Entry> entries = {
+        {"a", "1", 0},
+        {"b", "2", 3},
+        {"d", std::string(1000, 'z'), 10},
+        {"e", "5", 1}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    TempFile file("kvstorage_snapshot");
+
+    clock.set(1);  // e уже протух и в снапшот не попадет
+    store.saveSnapshot(file.path);
+
+    std::vector<Entry> none;
+    KVStorage<FakeClock> loaded(none, clock);
+    loaded.loadSnapshot(file.path);
+    EXPECT_EQ(loaded.size(), 3);
+    EXPECT_EQ(loaded.get("a").value(), "1");
+    EXPECT_EQ(loaded.get("d").value(), std::string(1000, 'z'));
+
+    // время смерти абсолютное
+    clock.set(3);
+    EXPECT_FALSE(loaded.get("b").has_value());
+    auto expired = loaded.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(expired->first, "b");
+}
+
+TEST(KVStorageTest, SnapshotBackedStorage) {
+    std::vector<Entry> entries = {
+        {"a", "1", 0},
+        {"b", "2", 3},
+        {"d", "4", 0},
+        {"e", "5", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    TempFile file("kvstorage_snapshot_view");
+    KVStorage<FakeClock>(entries, clock).saveSnapshot(file.path);
+
+    SnapshotKVStorage<FakeClock> view(file.path, clock);
+    EXPECT_EQ(view.size(), 4);
+    EXPECT_EQ(view.get("a").value(), "1");
+    EXPECT_EQ(view.get("b").value(), "2");
+    EXPECT_FALSE(view.get("c").has_value());
+    EXPECT_FALSE(view.get("f").has_value());
+
+    auto result = view.getManySorted("c", 2);
+    ASSERT_EQ(result.size(), 2);
+    EXPECT_EQ(result[0].first, "d");
+    EXPECT_EQ(result[1].second, "5");
+
+    clock.set(3);
+    EXPECT_FALSE(view.get("b").has_value());
+    result = view.getManySorted("", 10);
+    ASSERT_EQ(result.size(), 3);
+    EXPECT_EQ(result[1].first, "d");
+
+    SnapshotHeader header{};
+    std::ifstream(file.path, std::ios::binary).read(reinterpret_cast<char *>(&header), sizeof(header));
+    // длина ключа, уводящая запись за индекс, тоже ловится при открытии (индекс при этом цел)
+    {
+        uint64_t off = 0;
+        uint32_t key_len = 0, wild = 0x7fffffff;
+        std::fstream patch(file.path, std::ios::in | std::ios::out | std::ios::binary);
+        patch.seekg(static_cast<std::streamoff>(header.index_offset + sizeof(uint64_t)));
+        patch.read(reinterpret_cast<char *>(&off), sizeof(off));
+        auto at = static_cast<std::streamoff>(off + offsetof(SnapshotRecord, key_len));
+        patch.seekg(at);
+        patch.read(reinterpret_cast<char *>(&key_len), sizeof(key_len));
+        patch.seekp(at);
+        patch.write(reinterpret_cast<const char *>(&wild), sizeof(wild));
+        patch.flush();
+        EXPECT_THROW(SnapshotKVStorage<FakeClock>(file.path, clock), std::runtime_error);
+        patch.seekp(at);
+        patch.write(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+    }
+    EXPECT_EQ(SnapshotKVStorage<FakeClock>(file.path, clock).get("d").value(), "4");
+
+    // смещение за пределами файла в индексе ловится при открытии, до первого get
+    {
+        std::fstream patch(file.path, std::ios::in | std::ios::out | std::ios::binary);
+        patch.seekp(static_cast<std::streamoff>(header.index_offset + sizeof(uint64_t)));
+        uint64_t wild = uint64_t{1} << 40;
+        patch.write(reinterpret_cast<const char *>(&wild), sizeof(wild));
+    }
+    EXPECT_THROW(SnapshotKVStorage<FakeClock>(file.path, clock), std::runtime_error);
+
+    // чужой файл не открывается
+    std::ofstream(file.path, std::ios::trunc) << "definitely not a snapshot, just some text";
+    EXPECT_THROW(SnapshotKVStorage<FakeClock>(file.path, clock), std::runtime_error);
+}
+
+TEST(KVStorageTest, ChunkedSnapshotParallelLoad) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 1000; ++i)
+        entries.emplace_back("k" + std::to_string(1000 + i), std::string(50, 'a' + i % 26), i < 300 ? 5 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    TempFile file("kvstorage_snapshot_chunks");
+    // мелкие чанки, чтобы их было много
+    store.saveSnapshot(file.path, 1024);
+
+    {
+        SnapshotFile snapshot(file.path);
+        EXPECT_GT(snapshot.chunks(), 10);
+        EXPECT_TRUE(snapshot.verify(4));
+        EXPECT_EQ(snapshot.chunk(0).max_death_time, 5);
+    }
+
+    // уже лежащие ключи перезаписываются
+    std::vector<Entry> existing = {{"k1500", "old", 0}, {"a", "keep", 0}};
+    KVStorage<FakeClock> loaded(existing, clock);
+    loaded.loadSnapshot(file.path, 4);
+    EXPECT_EQ(loaded.size(), 1001);
+    EXPECT_EQ(loaded.get("k1500").value(), std::string(50, 'a' + 500 % 26));
+    EXPECT_EQ(loaded.get("a").value(), "keep");
+    EXPECT_EQ(loaded.getManySorted("k", 1000), store.getManySorted("k", 1000));
+
+    // первые чанки целиком протухли - их даже не читаем
+    clock.set(5);
+    KVStorage<FakeClock> later(existing, clock);
+    later.loadSnapshot(file.path, 2);
+    EXPECT_EQ(later.size(), 701);
+    EXPECT_FALSE(later.get("k1000").has_value());
+
+    // порча одного байта в живом чанке ловится по CRC, хранилище не трогается
+    uint64_t lastChunk = SnapshotFile(file.path).chunk(SnapshotFile(file.path).chunks() - 1).offset;
+    {
+        std::fstream patch(file.path, std::ios::in | std::ios::out | std::ios::binary);
+        patch.seekp(static_cast<std::streamoff>(lastChunk + 20));
+        patch.put('#');
+    }
+    KVStorage<FakeClock> broken(existing, clock);
+    EXPECT_THROW(broken.loadSnapshot(file.path, 3), std::runtime_error);
+    EXPECT_EQ(broken.size(), 2);
+    EXPECT_FALSE(SnapshotFile(file.path).verify());
+}
+
+TEST(KVStorageTest, Crc32cKnownValues) {
+    // контрольные значения из RFC 3720
+    std::string zeros(32, '\0'), ones(32, '\xff');
+    EXPECT_EQ(crc32c(zeros.data(), zeros.size()), 0x8a9136aaU);
+    EXPECT_EQ(crc32c(ones.data(), ones.size()), 0x62a8ab43U);
+    std::string text = "123456789";
+    EXPECT_EQ(crc32c(text.data(), text.size()), 0xe3069283U);
+    // по кускам - то же самое, и совпадает с табличным вариантом
+    EXPECT_EQ(crc32c(text.data() + 4, 5, crc32c(text.data(), 4)), 0xe3069283U);
+    EXPECT_EQ(~crc32cSoftware(reinterpret_cast<const unsigned char *>(text.data()), text.size(), ~0U), 0xe3069283U);
+}
+
+TEST(KVStorageTest, RangeDigestSync) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 2000; ++i)
+        entries.emplace_back("k" + std::to_string(i), std::string(50, 'a' + i % 26), i % 7 == 0 ? 100 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> primary(entries, clock), replica(entries, clock);
+    EXPECT_FALSE(primary.rootDigest());
+    EXPECT_THROW(replica.syncFrom(primary), std::invalid_argument);
+
+    primary.enableRangeDigests(8);
+    replica.enableRangeDigests(8);
+    EXPECT_EQ(primary.rootDigest(), replica.rootDigest());
+    auto nothing = replica.syncFrom(primary);
+    EXPECT_EQ(nothing.digests_compared, 1);
+    EXPECT_EQ(nothing.ranges_differ, 0);
+
+    // расходятся значение, ttl, лишний и недостающий ключ
+    primary.set("k5", "new", 0);
+    primary.set("k6", std::string(50, 'g'), 10);
+    primary.set("fresh", "1", 0);
+    primary.remove("k7");
+    replica.set("stale", "1", 0);
+    EXPECT_NE(primary.rootDigest(), replica.rootDigest());
+
+    auto stats = replica.syncFrom(primary);
+    EXPECT_EQ(primary.rootDigest(), replica.rootDigest());
+    EXPECT_EQ(stats.entries_sent, 3);
+    EXPECT_EQ(stats.entries_removed, 2);
+    EXPECT_LE(stats.ranges_differ, 5);
+    EXPECT_LT(stats.bytes_exchanged, 2000 * 50 / 10);
+    EXPECT_EQ(replica.get("k5"), "new");
+    EXPECT_FALSE(replica.get("k7"));
+    EXPECT_FALSE(replica.get("stale"));
+    EXPECT_EQ(replica.getManySorted("", 3000), primary.getManySorted("", 3000));
+
+    // протухание и вытеснение тоже ведут дерево
+    clock.set(100);
+    while (primary.removeOneExpiredEntry()) {
+    }
+    while (replica.removeOneExpiredEntry()) {
+    }
+    EXPECT_EQ(primary.rootDigest(), replica.rootDigest());
+    replica.setMemoryLimit(replica.memoryUsage() / 2);
+    auto incremental = replica.rootDigest();
+    replica.enableRangeDigests(8);
+    EXPECT_EQ(incremental, replica.rootDigest());
+    EXPECT_NE(primary.rootDigest(), replica.rootDigest());
+}
+
+TEST(KVStorageTest, ExtractInsertMovesNodes) {
+    std::vector<Entry> entries = {
+        {"a", "1", 0},
+        {"b", "2", 5},
+        {"c", "3", 0},
+        {"d", "4", 10},
+        {"e", "5", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> from(entries, clock);
+    std::vector<Entry> none;
+    KVStorage<FakeClock> to(none, clock);
+    from.enableRangeDigests(4);
+    to.enableRangeDigests(4);
+
+    std::vector<WatchNotification> removed;
+    from.watch("", WatchMode::Prefix, &removed);
+
+    EXPECT_TRUE(from.extract("zzz").empty());
+    auto b = from.extract("b");
+    ASSERT_FALSE(b.empty());
+    const std::string *value_address = &b.value();
+    EXPECT_EQ(b.key(), "b");
+    EXPECT_EQ(b.deathTime(), 5);
+    EXPECT_FALSE(from.get("b"));
+    EXPECT_TRUE(to.insert(std::move(b)));
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(to.get("b"), "2");
+    // узел тот же самый, ничего не копировалось
+    auto again = to.extract("b");
+    EXPECT_EQ(&again.value(), value_address);
+    EXPECT_TRUE(to.insert(std::move(again)));
+
+    auto range = from.extractRange("c", "e");
+    ASSERT_EQ(range.size(), 2);
+    EXPECT_EQ(range[0].key(), "c");
+    EXPECT_EQ(range[1].key(), "d");
+    EXPECT_EQ(to.insertRange(std::move(range)), 2);
+    EXPECT_EQ(removed.size(), 3);
+    EXPECT_EQ(removed[0].event, WatchEvent::Remove);
+
+    EXPECT_EQ(from.size(), 2);
+    EXPECT_EQ(to.size(), 3);
+    EXPECT_EQ(from.memoryUsage() + to.memoryUsage(), KVStorage<FakeClock>(entries, clock).memoryUsage());
+    // дерево дайджестов пересчитывается честно
+    auto incremental = to.rootDigest();
+    to.enableRangeDigests(4);
+    EXPECT_EQ(incremental, to.rootDigest());
+
+    // время смерти переехало вместе с записью
+    clock.set(5);
+    EXPECT_FALSE(to.get("b"));
+    auto expired = to.removeOneExpiredEntry();
+    ASSERT_TRUE(expired);
+    EXPECT_EQ(expired->first, "b");
+    EXPECT_EQ(expired->second, "2");
+    clock.set(10);
+    expired = to.removeOneExpiredEntry();
+    ASSERT_TRUE(expired);
+    EXPECT_EQ(expired->first, "d");
+    EXPECT_FALSE(to.removeOneExpiredEntry());
+    EXPECT_EQ(to.getManySorted("", 10), (std::vector<std::pair<std::string, std::string> >{{"c", "3"}}));
+
+    // поверх существующего ключа - перезапись, как set
+    to.set("a", "old", 0);
+    EXPECT_TRUE(to.insert(from.extract("a")));
+    EXPECT_EQ(to.get("a"), "1");
+    EXPECT_EQ(to.size(), 2);
+}
+
+TEST(ShardedKVStorageTest, SplitsAndMergesByRange) {
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    ShardedKVStorage<FakeClock> store(ShardingOptions{64, 8, 16}, clock);
+    std::vector<Entry> none;
+    KVStorage<FakeClock> plain(none, clock);
+    for (int i = 0; i < 1000; ++i) {
+        std::string key = "k" + std::to_string(1000 + i * 7 % 1000);
+        store.set(key, std::to_string(i), i % 10 == 1 ? 5 : 0);
+        plain.set(key, std::to_string(i), i % 10 == 1 ? 5 : 0);
+    }
+    EXPECT_EQ(store.size(), 1000);
+    EXPECT_GE(store.shardCount(), 1000 / 64);
+    auto bounds = store.shardBoundaries();
+    EXPECT_EQ(bounds.front(), "");
+    EXPECT_TRUE(std::is_sorted(bounds.begin(), bounds.end()));
+
+    EXPECT_EQ(store.get("k1500"), plain.get("k1500"));
+    EXPECT_EQ(store.getManySorted("k1", 1000), plain.getManySorted("k1", 1000));
+    EXPECT_EQ(store.getManySorted("k1234", 300), plain.getManySorted("k1234", 300));
+
+    clock.set(5);
+    EXPECT_EQ(store.getManySorted("", 2000).size(), 900);
+    size_t expired = 0;
+    while (store.removeOneExpiredEntry())
+        ++expired;
+    EXPECT_EQ(expired, 100);
+
+    for (int i = 0; i < 1000; ++i) {
+        if (i % 100 != 0)
+            store.remove("k" + std::to_string(1000 + i));
+    }
+    store.rebalance();
+    EXPECT_EQ(store.size(), 10);
+    EXPECT_EQ(store.shardCount(), 1);
+    EXPECT_EQ(store.getManySorted("", 100).front().first, "k1000");
+}
+
+TEST(ShardedKVStorageTest, ConcurrentWritesDuringSplits) {
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    ShardedKVStorage<FakeClock> store(ShardingOptions{128, 16, 32}, clock);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&store, t] {
+            for (int i = 0; i < 2000; ++i) {
+                std::string key = "k" + std::to_string(10000 + i) + ":" + std::to_string(t);
+                store.set(key, key, 0);
+                EXPECT_EQ(store.get(key), key);
+                if (i % 100 == 0) {
+                    EXPECT_FALSE(store.getManySorted(key, 10).empty());
+                }
+            }
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+    EXPECT_EQ(store.size(), 8000);
+    auto all = store.getManySorted("", 10000);
+    ASSERT_EQ(all.size(), 8000);
+    EXPECT_TRUE(std::is_sorted(all.begin(), all.end()));
+}
+
+TEST(KVStorageTest, MergeFromPolicies) {
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    auto makeLive = [&] {
+        std::vector<Entry> entries = {
+            {"a", "live", 0},
+            {"c", "live", 10},
+            {"e", "live", 3},
+            {"g", "live", 0}
+        };
+        return std::make_unique<KVStorage<FakeClock> >(entries, clock);
+    };
+    auto makeBatch = [&] {
+        std::vector<Entry> entries = {
+            {"b", "batch", 4},
+            {"c", "batch", 5},
+            {"e", "batch", 0},
+            {"h", "batch", 0}
+        };
+        return std::make_unique<KVStorage<FakeClock> >(entries, clock);
+    };
+    using Result = std::vector<std::pair<std::string, std::string> >;
+
+    auto live = makeLive(), batch = makeBatch();
+    live->enableRangeDigests(4);
+    std::vector<WatchNotification> events;
+    live->watch("", WatchMode::Prefix, &events);
+    auto stats = live->mergeFrom(std::move(*batch), MergePolicy::OtherWins);
+    EXPECT_EQ(stats.inserted, 2);
+    EXPECT_EQ(stats.replaced, 2);
+    EXPECT_EQ(stats.kept, 0);
+    EXPECT_EQ(events.size(), 4);
+    EXPECT_EQ(batch->size(), 0);
+    EXPECT_EQ(batch->memoryUsage(), 0);
+    EXPECT_EQ(live->getManySorted("", 10), (Result{{"a", "live"}, {"b", "batch"}, {"c", "batch"}, {"e", "batch"},
+                                                {"g", "live"}, {"h", "batch"}}));
+    auto incremental = live->rootDigest();
+    live->enableRangeDigests(4);
+    EXPECT_EQ(incremental, live->rootDigest());
+    std::vector<Entry> same = {{"a", "live", 0}, {"b", "batch", 4}, {"c", "batch", 5}, {"e", "batch", 0},
+                               {"g", "live", 0}, {"h", "batch", 0}};
+    EXPECT_EQ(live->memoryUsage(), KVStorage<FakeClock>(same, clock).memoryUsage());
+    // сет протухания собран правильно: b и c из батча, e стала бессмертной
+    clock.set(5);
+    EXPECT_EQ(live->removeOneExpiredEntry()->first, "b");
+    EXPECT_EQ(live->removeOneExpiredEntry()->first, "c");
+    EXPECT_FALSE(live->removeOneExpiredEntry());
+    clock.set(0);
+
+    live = makeLive(), batch = makeBatch();
+    stats = live->mergeFrom(std::move(*batch), MergePolicy::LaterDeathTimeWins);
+    EXPECT_EQ(stats.replaced, 1);
+    EXPECT_EQ(stats.kept, 1);
+    EXPECT_EQ(live->get("c"), "live");
+    EXPECT_EQ(live->get("e"), "batch");
+    clock.set(5);
+    EXPECT_EQ(live->removeOneExpiredEntry()->first, "b");
+    EXPECT_FALSE(live->removeOneExpiredEntry());
+    clock.set(0);
+
+    live = makeLive(), batch = makeBatch();
+    EXPECT_THROW(live->mergeFrom(std::move(*batch), MergePolicy::Custom), std::invalid_argument);
+    stats = live->mergeFrom(std::move(*batch), MergePolicy::Custom,
+                            [](std::string_view key, std::string_view, uint64_t, std::string_view, uint64_t) {
+                                return key == "e";
+                            });
+    EXPECT_EQ(stats.replaced, 1);
+    EXPECT_EQ(stats.kept, 1);
+    EXPECT_EQ(live->get("c"), "live");
+    EXPECT_EQ(live->get("e"), "batch");
+    EXPECT_EQ(live->size(), 6);
+}
+
+TEST(ShardedKVStorageTest, CopyOnWriteClone) {
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    ShardedKVStorage<FakeClock> live(ShardingOptions{256, 32, 16, 16}, clock);
+    for (int i = 0; i < 1000; ++i)
+        live.set("k" + std::to_string(1000 + i), "v", i % 2 ? 5 : 0);
+    size_t shards = live.shardCount();
+    size_t chunks = live.chunkCount();
+    EXPECT_GE(chunks, 1000 / 16);
+    EXPECT_EQ(live.sharedChunkCount(), 0);
+    EXPECT_EQ(live.sharedMemoryUsage(), 0);
+
+    {
+        auto what_if = live.clone();
+        EXPECT_EQ(live.sharedChunkCount(), chunks);
+        EXPECT_EQ(what_if.shardCount(), shards);
+        EXPECT_EQ(what_if.sharedMemoryUsage(), live.memoryUsage());
+
+        // запись копирует только свой кусок и видна только своей стороне
+        what_if.set("k1500", "changed", 0);
+        live.remove("k1001");
+        EXPECT_EQ(live.sharedChunkCount(), chunks - 2);
+        EXPECT_LT(what_if.memoryUsage() - what_if.sharedMemoryUsage(), what_if.memoryUsage() / 20);
+        EXPECT_EQ(live.get("k1500"), "v");
+        EXPECT_EQ(what_if.get("k1500"), "changed");
+        EXPECT_FALSE(live.get("k1001"));
+        EXPECT_EQ(what_if.get("k1001"), "v");
+
+        // протухание - тоже запись
+        clock.set(5);
+        EXPECT_TRUE(what_if.removeOneExpiredEntry());
+        EXPECT_EQ(what_if.size(), 999);
+        EXPECT_EQ(live.size(), 999);
+        EXPECT_EQ(live.getManySorted("", 2000).size(), 500);
+
+        // шард делится по границам кусков, так что общие куски так и остаются общими
+        for (int i = 0; i < 300; ++i)
+            what_if.set("k1500:" + std::to_string(i), "new", 0);
+        EXPECT_GT(what_if.shardCount(), shards);
+        EXPECT_EQ(live.shardCount(), shards);
+        EXPECT_GT(live.sharedChunkCount(), chunks / 2);
+        EXPECT_EQ(live.get("k1500:7"), std::nullopt);
+        EXPECT_EQ(what_if.get("k1500:7"), "new");
+        auto range = what_if.getManySorted("k1498", 3);  // k1499 уже протух
+        ASSERT_EQ(range.size(), 3);
+        EXPECT_EQ(range[1], (std::pair<std::string, std::string>{"k1500", "changed"}));
+        EXPECT_EQ(range[2], (std::pair<std::string, std::string>{"k1500:0", "new"}));
+    }
+    // копия умерла - оригинал снова единственный владелец
+    EXPECT_EQ(live.sharedChunkCount(), 0);
+
+    // KVStorage копируется целиком
+    std::vector<Entry> entries = {{"a", "1", 0}, {"b", "2", 10}};
+    KVStorage<FakeClock> original(entries, clock);
+    KVStorage<FakeClock> copy = original.clone();
+    original.set("a", "changed", 0);
+    EXPECT_EQ(copy.get("a"), "1");
+    EXPECT_EQ(copy.memoryUsage(), KVStorage<FakeClock>(entries, clock).memoryUsage());
+    EXPECT_EQ(copy.sample(10).size(), 2);
+    clock.set(15);
+    EXPECT_EQ(copy.removeOneExpiredEntry()->first, "b");
+}
+
+TEST(KVStorageTest, ValueDedupSharesBuffers) {
+    std::string blob(100, 'x'), other_blob(100, 'y');
+    std::vector<Entry> entries = {{"a", blob, 0}, {"b", blob, 0}, {"short1", "ok", 0}};
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    store.enableValueDedup(32);
+    store.set("c", blob, 5);
+    store.set("d", other_blob, 0);
+    store.set("short2", "ok", 0);
+
+    auto a = store.extract("a"), c = store.extract("c"), d = store.extract("d");
+    auto s1 = store.extract("short1"), s2 = store.extract("short2");
+    EXPECT_EQ(&a.value(), &c.value());
+    EXPECT_NE(&a.value(), &d.value());
+    EXPECT_NE(&s1.value(), &s2.value());
+    EXPECT_EQ(c.value(), blob);
+
+    // общий буфер переживает переезд в другое хранилище и удаление из исходного
+    std::vector<Entry> none;
+    KVStorage<FakeClock> target(none, clock);
+    target.insert(std::move(a));
+    target.insert(std::move(c));
+    store.remove("b");
+    EXPECT_EQ(target.get("a"), blob);
+
+    // перезапись снимает запись с общего буфера, протухание отпускает ссылку
+    target.set("a", "fresh", 0);
+    EXPECT_EQ(target.get("a"), "fresh");
+    clock.set(5);
+    auto expired = target.removeOneExpiredEntry();
+    ASSERT_TRUE(expired);
+    EXPECT_EQ(expired->second, blob);
+    std::vector<Entry> left = {{"a", "fresh", 0}};
+    EXPECT_EQ(target.memoryUsage(), KVStorage<FakeClock>(left, clock).memoryUsage());
+}
+
+TEST(KVStorageTest, NoExpirySpecialization) {
+    std::vector<Entry> entries = {{"a", "1", 0}, {"b", "2", 5}, {"c", "3", 0}};
+    KVStorage<NoExpiry> store(entries);
+    // сета протухания нет вовсе: на std::set меньше самого хранилища
+    static_assert(sizeof(KVStorage<NoExpiry>) + sizeof(std::set<std::string>) <= sizeof(KVStorage<FakeClock>));
+    // ttl игнорируется, протухать нечему
+    EXPECT_EQ(store.get("b"), "2");
+    EXPECT_FALSE(store.removeOneExpiredEntry());
+    EXPECT_FALSE(store.nextDeathTime());
+    EXPECT_TRUE(store.set("d", "4", 1));
+    EXPECT_EQ(store.getManySorted("b", 10),
+              (std::vector<std::pair<std::string, std::string> >{{"b", "2"}, {"c", "3"}, {"d", "4"}}));
+    EXPECT_TRUE(store.remove("a"));
+    EXPECT_EQ(store.sample(10).size(), 3);
+
+    auto node = store.extract("d");
+    EXPECT_EQ(node.deathTime(), std::numeric_limits<uint64_t>::max());
+    KVStorage<NoExpiry> copy(store);
+    EXPECT_TRUE(copy.insert(std::move(node)));
+    copy.setMemoryLimit(copy.memoryUsage() - 1);
+    EXPECT_EQ(copy.size(), 2);
+
+    std::vector<Entry> none;
+    KVStorage<NoExpiry> other(none);
+    other.set("z", "26", 0);
+    auto stats = store.mergeFrom(std::move(other), MergePolicy::LaterDeathTimeWins);
+    EXPECT_EQ(stats.inserted, 1);
+    EXPECT_EQ(store.size(), 3);
+
+    ShardedKVStorage<NoExpiry> sharded(ShardingOptions{4, 1, 8});
+    for (int i = 0; i < 20; ++i)
+        sharded.set("k" + std::to_string(10 + i), "v", 3);
+    EXPECT_EQ(sharded.size(), 20);
+    EXPECT_GT(sharded.shardCount(), 1);
+    EXPECT_FALSE(sharded.removeOneExpiredEntry());
+}
+
+TEST(KVStorageTest, ProjectionScans) {
+    std::vector<Entry> entries = {
+        {"a", "alpha", 0},
+        {"b", "beta", 10},
+        {"c", "gamma", 2},
+        {"d", "delta", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(3);  // c протухла
+
+    EXPECT_EQ(store.getKeysSorted("b", 10), (std::vector<std::string>{"b", "d"}));
+    EXPECT_EQ(store.getKeysSorted("", 2), (std::vector<std::string>{"a", "b"}));
+    EXPECT_TRUE(store.getKeysSorted("", 0).empty());
+
+    auto info = store.getKeyInfoSorted("", 10);
+    ASSERT_EQ(info.size(), 3);
+    EXPECT_EQ(info[0].key, "a");
+    EXPECT_EQ(info[0].value_size, 5);
+    EXPECT_EQ(info[0].ttl_left, std::nullopt);
+    EXPECT_EQ(info[1].key, "b");
+    EXPECT_EQ(info[1].value_size, 4);
+    EXPECT_EQ(info[1].ttl_left, 7);
+
+    using Result = std::vector<std::pair<std::string, std::string> >;
+    EXPECT_EQ(store.getSlicesSorted("", 10, 0, 2), (Result{{"a", "al"}, {"b", "be"}, {"d", "de"}}));
+    EXPECT_EQ(store.getSlicesSorted("b", 10, 3, 100), (Result{{"b", "a"}, {"d", "ta"}}));
+    EXPECT_EQ(store.getSlicesSorted("d", 1, 10, 1), (Result{{"d", ""}}));
+}
+
+TEST(KVStorageTest, PredicateAndAggregatePushdown) {
+    std::vector<Entry> entries = {
+        {"order:1", "10", 0},
+        {"order:2", "2.5", 0},
+        {"order:3", "n/a", 0},
+        {"order:4", "100", 5},
+        {"order:5", "7", 0},
+        {"user:1", "42", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(5);  // order:4 протух
+
+    using Result = std::vector<std::pair<std::string, std::string> >;
+    auto numeric = [](std::string_view, std::string_view value) { return !value.empty() && value[0] != 'n'; };
+    EXPECT_EQ(store.getManySortedIf("order:", 2, numeric), (Result{{"order:1", "10"}, {"order:2", "2.5"}}));
+    EXPECT_EQ(store.getManySortedIf("order:3", 10, numeric), (Result{{"order:5", "7"}, {"user:1", "42"}}));
+    EXPECT_TRUE(store.getManySortedIf("", 0, numeric).empty());
+
+    EXPECT_EQ(store.countRange("order:", "order;"), 4);
+    EXPECT_EQ(store.countRange("", std::nullopt), 5);
+    EXPECT_EQ(store.countRange("order:", "order;", numeric), 3);
+
+    auto orders = store.aggregateRange("order:", "order;");
+    EXPECT_EQ(orders.count, 4);
+    EXPECT_EQ(orders.numeric, 3);
+    EXPECT_DOUBLE_EQ(orders.sum, 19.5);
+    EXPECT_EQ(orders.min_key, "order:1");
+    EXPECT_EQ(orders.max_key, "order:5");
+
+    auto none = store.aggregateRange("x", std::nullopt);
+    EXPECT_EQ(none.count, 0);
+    EXPECT_FALSE(none.min_key);
+}
+
+TEST(KVStorageTest, ScanPatternUsesLiteralPrefix) {
+    std::vector<Entry> entries = {
+        {"user:1:cart", "a", 0},
+        {"user:1:name", "b", 0},
+        {"user:2:cart", "c", 5},
+        {"user:3:cart", "d", 0},
+        {"user:10:cart", "e", 0},
+        {"users", "f", 0},
+        {"admin:1:cart", "g", 0},
+        {"a*b", "h", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(5);  // user:2:cart протух
+
+    using Keys = std::vector<std::string>;
+    EXPECT_EQ(store.scanPattern("user:*:cart", 10), (Keys{"user:10:cart", "user:1:cart", "user:3:cart"}));
+    EXPECT_EQ(store.scanPattern("user:?:cart", 10), (Keys{"user:1:cart", "user:3:cart"}));
+    EXPECT_EQ(store.scanPattern("user:[12]:*", 10), (Keys{"user:1:cart", "user:1:name"}));
+    EXPECT_EQ(store.scanPattern("user:[^1]*", 10), (Keys{"user:3:cart"}));
+    EXPECT_EQ(store.scanPattern("*:cart", 2), (Keys{"admin:1:cart", "user:10:cart"}));
+    EXPECT_EQ(store.scanPattern("a\\*b", 10), (Keys{"a*b"}));
+    EXPECT_EQ(store.scanPattern("user*", 10).size(), 5);
+    EXPECT_TRUE(store.scanPattern("user:*", 0).empty());
+
+    KeyPattern pattern("user:[0-9]*:cart");
+    EXPECT_EQ(pattern.prefix(), "user:");
+    EXPECT_EQ(pattern.prefixEnd(), "user;");
+    EXPECT_TRUE(pattern.matches("user:10:cart"));
+    EXPECT_FALSE(pattern.matches("user:x:cart"));
+    EXPECT_FALSE(pattern.matches("admin:1:cart"));
+    EXPECT_EQ(KeyPattern("*").prefixEnd(), std::nullopt);
+    EXPECT_TRUE(KeyPattern("[abc").matches("[abc"));
+}
+
+TEST(KVStorageTest, GetManySortedMultiMatchesLoop) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 200; ++i)
+        entries.emplace_back("k" + std::to_string(1000 + i), std::to_string(i), i % 7 == 0 ? 5 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(5);
+
+    // вразнобой, с пересечениями, повторами, пустым и выходящим за конец диапазонами
+    std::vector<std::string> starts = {"k1150", "k1000", "k1003", "k1150", "k1199", "k1", "z", "k1100", "k1101"};
+    std::vector<ScanRange> ranges;
+    for (size_t i = 0; i < starts.size(); ++i)
+        ranges.push_back({starts[i], static_cast<uint32_t>(i * 3)});
+
+    auto result = store.getManySortedMulti(ranges);
+    ASSERT_EQ(result.slices.size(), ranges.size());
+    size_t total = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        auto expected = store.getManySorted(ranges[i].from, ranges[i].count);
+        auto got = result.range(i);
+        EXPECT_EQ(std::vector(got.begin(), got.end()), expected) << "range " << i;
+        total += expected.size();
+    }
+    EXPECT_EQ(result.entries.size(), total);
+    EXPECT_TRUE(store.getManySortedMulti({}).entries.empty());
+}
+
+TEST(KVStorageTest, GetManySortedIntoScanResult) {
+    std::vector<Entry> entries = {
+        {"a", "val1", 0},
+        {"b", std::string(100, 'x'), 0},
+        {"c", "", 0},
+        {"d", "val3", 5},
+        {"e", "val4", 0}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(5);
+
+    ScanResult out;
+    store.getManySorted("b", 3, out);
+    ASSERT_EQ(out.size(), 3);
+    EXPECT_EQ(out.key(0), "b");
+    EXPECT_EQ(out.value(0), std::string(100, 'x'));
+    EXPECT_EQ(out[1], std::make_pair(std::string_view("c"), std::string_view("")));
+    EXPECT_EQ(out.key(2), "e");
+    EXPECT_EQ(out.value(2), "val4");
+    EXPECT_EQ(out.bytes(), 1 + 100 + 1 + 1 + 4);
+
+    // следующий вызов заменяет содержимое, буфер тот же
+    const char *buffer = out.key(0).data();
+    store.getManySorted("a", 1, out);
+    ASSERT_EQ(out.size(), 1);
+    EXPECT_EQ(out[0], std::make_pair(std::string_view("a"), std::string_view("val1")));
+    EXPECT_EQ(out.key(0).data(), buffer);
+
+    store.getManySorted("f", 10, out);
+    EXPECT_TRUE(out.empty());
+}
+
+TEST(KVStorageTest, ColumnarExportMatchesRows) {
+    std::vector<Entry> entries;
+    for (int i = 0; i < 1000; ++i)
+        entries.emplace_back("k" + std::to_string(i), std::string(i % 5, 'v'), i % 3 == 0 ? 10 : i % 3 == 1 ? 5 : 0);
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+    clock.set(5);  // записи с ttl 5 протухли
+
+    for (unsigned threads: {1u, 4u}) {
+        std::mutex mutex;
+        std::map<size_t, std::vector<ColumnarBatch> > parts;
+        store.exportColumnar([&](size_t part, ColumnarBatch &&batch) {
+            std::lock_guard lock(mutex);
+            parts[part].push_back(std::move(batch));
+        }, ColumnarOptions{64, threads});
+
+        std::vector<std::tuple<std::string, std::string, std::optional<uint64_t> > > rows;
+        for (auto &[part, batches]: parts) {
+            for (auto &batch: batches) {
+                EXPECT_LE(batch.length, 64);
+                ASSERT_EQ(batch.key_offsets.size(), static_cast<size_t>(batch.length) + 1);
+                ASSERT_EQ(batch.value_offsets.size(), static_cast<size_t>(batch.length) + 1);
+                ASSERT_EQ(batch.death_time.size(), static_cast<size_t>(batch.length));
+                ASSERT_EQ(batch.death_time_validity.size(), static_cast<size_t>(batch.length + 7) / 8);
+                EXPECT_EQ(batch.key_offsets.front(), 0);
+                EXPECT_EQ(static_cast<size_t>(batch.key_offsets.back()), batch.key_data.size());
+                int64_t nulls = 0;
+                for (int64_t i = 0; i < batch.length; ++i) {
+                    rows.emplace_back(batch.key(i), batch.value(i), batch.deathTime(i));
+                    nulls += !batch.deathTime(i);
+                }
+                EXPECT_EQ(batch.death_time_null_count, nulls);
+            }
+        }
+        if (threads > 1) {
+            EXPECT_GT(parts.size(), 1);
+        }
+
+        auto expected = store.getManySorted("", 1000);
+        ASSERT_EQ(rows.size(), expected.size()) << threads;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            EXPECT_EQ(std::get<0>(rows[i]), expected[i].first);
+            EXPECT_EQ(std::get<1>(rows[i]), expected[i].second);
+            auto ttl = store.getKeyInfoSorted(expected[i].first, 1)[0].ttl_left;
+            EXPECT_EQ(std::get<2>(rows[i]).has_value(), ttl.has_value());
+            if (ttl) {
+                EXPECT_EQ(*std::get<2>(rows[i]), 10u);
+            }
+        }
+    }
+
+    // смещения int32: байты ключей и значений батча не дальше max_bytes, без переполнения в проверке
+    ColumnarBatch batch;
+    batch.append("abc", "de", std::nullopt);
+    EXPECT_TRUE(batch.fits(ColumnarBatch::max_bytes - 3, ColumnarBatch::max_bytes - 2));
+    EXPECT_FALSE(batch.fits(ColumnarBatch::max_bytes - 2, 0));
+    EXPECT_FALSE(batch.fits(0, ColumnarBatch::max_bytes - 1));
+    EXPECT_FALSE(batch.fits(std::numeric_limits<size_t>::max(), 0));
+}
+
+TEST(KVStorageTest, MemoryBreakdownCountsStructures) {
+    std::vector<Entry> entries = {
+        {"short", "v", 0},
+        {"a key that does not fit into sso", std::string(100, 'x'), 10},
+        {"ttl", std::string(40, 'y'), 10}
+    };
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    KVStorage<FakeClock> store(entries, clock);
+
+    auto breakdown = store.memoryBreakdown();
+    EXPECT_EQ(breakdown.entries, 3);
+    EXPECT_EQ(breakdown.expiring, 2);
+    EXPECT_GT(breakdown.map_nodes, 0);
+    EXPECT_EQ(breakdown.map_nodes % 3, 0);
+    EXPECT_EQ(breakdown.expiry_nodes % 2, 0);
+    // длинный ключ дважды (map и expiration_set_), значения - 100 и 40 байт
+    EXPECT_GE(breakdown.key_heap, 2 * 33);
+    EXPECT_GE(breakdown.value_heap, 101 + 41);
+    EXPECT_EQ(breakdown.total(), breakdown.map_nodes + breakdown.expiry_nodes + breakdown.key_heap
+                                 + breakdown.value_heap + breakdown.indexes);
+    // служебные поля записи и индекс выборки есть всегда, хотя ни sample, ни лимит, ни дайджесты не включены
+    EXPECT_GE(breakdown.bookkeeping, 3 * (16 + sizeof(void *)));
+    EXPECT_LE(breakdown.bookkeeping, breakdown.map_nodes + breakdown.indexes);
+
+    // одинаковые значения с дедупликацией считаются один раз
+    store.set("dup1", std::string(200, 'z'), 0);
+    store.set("dup2", std::string(200, 'z'), 0);
+    size_t separate = store.memoryBreakdown().value_heap;
+    store.enableValueDedup();
+    EXPECT_LT(store.memoryBreakdown().value_heap, separate);
+
+    EXPECT_EQ(stringHeapBytes(std::string("sso")), 0);
+    EXPECT_GT(stringHeapBytes(std::string(64, 'h')), 64);
+}
+
+TEST(ShardedKVStorageTest, LockProfile) {
+    ProfiledMutex<std::mutex> mutex;
+    {
+        std::lock_guard lock(mutex);  // профиль выключен - ничего не считается
+    }
+    EXPECT_EQ(mutex.report("m").acquisitions, 0);
+
+    mutex.profile(true);
+    mutex.lock();
+    std::thread waiter([&] {
+        std::lock_guard lock(mutex);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    mutex.unlock();
+    waiter.join();
+    auto report = mutex.report("m");
+    EXPECT_EQ(report.acquisitions, 2);
+    EXPECT_EQ(report.contended, 1);
+    EXPECT_GE(report.wait_ns, 10'000'000u);
+    EXPECT_EQ(report.max_wait_ns, report.wait_ns);
+    EXPECT_GE(report.hold_ns, 10'000'000u);
+
+    FakeTimeManager timeManager;
+    FakeClock clock(&timeManager);
+    ShardedKVStorage<FakeClock> store(ShardingOptions{128, 16, 32}, clock);
+    store.enableLockProfiling();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&store, t] {
+            for (int i = 0; i < 1000; ++i)
+                store.set("k" + std::to_string(10000 + i) + ":" + std::to_string(t), "v", 0);
+        });
+    }
+    for (auto &thread: threads)
+        thread.join();
+
+    auto profile = store.lockProfile();
+    ASSERT_EQ(profile.size(), store.shardCount() + 2);
+    EXPECT_TRUE(std::is_sorted(profile.begin(), profile.end(),
+                               [](const LockReport &a, const LockReport &b) { return a.wait_ns > b.wait_ns; }));
+    uint64_t shard_acquisitions = 0;
+    for (auto &lock: profile) {
+        if (lock.name.rfind("shard ", 0) == 0)
+            shard_acquisitions += lock.acquisitions;
+    }
+    // у слитых и замененных шардов счетчики пропадают, но новые шарды тоже профилируются
+    EXPECT_GT(shard_acquisitions, 0);
+    EXPECT_GT(profile.size(), 3);
+}